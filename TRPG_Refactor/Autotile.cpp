@@ -0,0 +1,139 @@
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <regex>
+
+#include <SDL.h>
+
+#include "GraphicsEngine.h"
+#include "Autotile.h"
+
+void AutotileSet::clear() {
+	rules.clear();
+	kinds.clear();
+	joined.clear();
+}
+
+/// <summary>
+/// Reads the rules in path, looking up every Order they name. All or nothing: if anything in the file is
+/// wrong, nothing is loaded.
+/// </summary>
+/// <param name="assets">Has to have loaded already.</param>
+/// <param name="path">The rule file. See AutotileSet for what goes in it.</param>
+/// <returns>false if the file couldn't be read, or names something that doesn't exist.</returns>
+bool AutotileSet::load(AssetManager& assets, const std::string& path) {
+	clear();
+
+	std::ifstream file{ path.c_str() };
+	if (!file) {
+		printf("ERROR: AutotileSet::load couldn't open %s.\n", path.c_str());
+		return false;
+	}
+	// comments go first, so they can't get mixed up with the rules
+	std::string s;
+	std::string line;
+	while (std::getline(file, line)) {
+		size_t start = line.find_first_not_of(" \t\r");
+		if (start != std::string::npos && line[start] == '#') continue;
+		s += line + "\n";
+	}
+
+	// capture 1 is the name, 2 the connectivity, 3 the asset, 4 the joins (if any), and 5 the orders
+	std::regex ruleEntry("([A-Za-z0-9_]+)\\s*\\(\\s*([48])\\s*\\)\\s*=\\s*([A-Za-z0-9_]+)\\s*(?:joins\\s+([A-Za-z0-9_,\\s]*?))?\\s*:\\s*\\{([^}]*)\\}");
+	std::regex name("[A-Za-z0-9_]+");
+
+	// joins can name rules further down, so they're looked up once everything's read
+	std::vector<std::string> joinNames;
+	for (std::sregex_iterator rule(s.begin(), s.end(), ruleEntry); rule != std::sregex_iterator(); ++rule) {
+		AutotileRule added;
+		added.name = rule->str(1);
+		added.connectivity = std::stoi(rule->str(2));
+		std::string assetName = rule->str(3);
+		if (findRule(added.name) != AUTOTILE_NONE) {
+			printf("ERROR: AutotileSet::load found two rules called %s in %s.\n", added.name.c_str(), path.c_str());
+			clear();
+			return false;
+		}
+		if (!assets.hasAFrame(assetName)) {
+			printf("ERROR: AutotileSet::load's rule %s uses asset %s, which doesn't exist.\n", added.name.c_str(), assetName.c_str());
+			clear();
+			return false;
+		}
+		const AFrame& graphics = assets.getAFrame(assetName);
+		added.graphics = &graphics;
+
+		std::string orders = rule->str(5);
+		for (std::sregex_iterator order(orders.begin(), orders.end(), name); order != std::sregex_iterator(); ++order) {
+			const Order* variant = graphics.getOrder(order->str());
+			if (variant == NULL) {
+				printf("ERROR: AutotileSet::load's rule %s uses order %s::%s, which doesn't exist.\n", added.name.c_str(),
+					assetName.c_str(), order->str().c_str());
+				clear();
+				return false;
+			}
+			added.variants.push_back(variant);
+		}
+		size_t needed = (added.connectivity == 4) ? AUTOTILE_EDGE_VARIANTS : AUTOTILE_BLOB_VARIANTS;
+		if (added.variants.size() != needed) {
+			printf("ERROR: AutotileSet::load's rule %s has %d orders, but %d neighbor rules need %d.\n", added.name.c_str(),
+				(int)added.variants.size(), added.connectivity, (int)needed);
+			clear();
+			return false;
+		}
+
+		for (const Order* variant : added.variants) {
+			// an Order in two rules would make it ambiguous which kind a Tile is
+			if (kinds.count(variant) != 0 && kinds[variant] != (int)rules.size()) {
+				printf("ERROR: AutotileSet::load's rule %s shares an order with rule %s.\n", added.name.c_str(),
+					rules[kinds[variant]].name.c_str());
+				clear();
+				return false;
+			}
+			kinds[variant] = (int)rules.size();
+		}
+		rules.push_back(added);
+		joinNames.push_back(rule->str(4));
+	}
+
+	int count = getKindCount();
+	joined.assign((size_t)count * count, false);
+	for (int kind = 0; kind < count; ++kind) {
+		joined[(size_t)kind * count + kind] = true;
+		const std::string& joins = joinNames[kind];
+		for (std::sregex_iterator other(joins.begin(), joins.end(), name); other != std::sregex_iterator(); ++other) {
+			int found = findRule(other->str());
+			if (found == AUTOTILE_NONE) {
+				printf("ERROR: AutotileSet::load's rule %s joins %s, which isn't a rule.\n", rules[kind].name.c_str(),
+					other->str().c_str());
+				clear();
+				return false;
+			}
+			rules[kind].joins.push_back(found);
+			joined[(size_t)kind * count + found] = true;
+		}
+	}
+	return true;
+}
+
+int AutotileSet::findRule(const std::string& name) const {
+	for (size_t i = 0; i < rules.size(); ++i) {
+		if (rules[i].name == name) return (int)i;
+	}
+	return AUTOTILE_NONE;
+}
+
+int AutotileSet::findKind(const Order* order) const {
+	std::unordered_map<const Order*, int>::const_iterator found = kinds.find(order);
+	return (found == kinds.end()) ? AUTOTILE_NONE : found->second;
+}
+
+bool AutotileSet::connects(int kind, int other) const {
+	if (kind == AUTOTILE_NONE || other == AUTOTILE_NONE) return false;
+	return joined[(size_t)kind * getKindCount() + other];
+}
+
+int AutotileSet::getVariant(int kind, Uint8 mask) const {
+	return (rules[kind].connectivity == 4) ? autotile::EDGE_TABLE[mask] : autotile::BLOB_TABLE[mask];
+}
@@ -0,0 +1,141 @@
+#ifndef AUTOTILE_H
+#define AUTOTILE_H
+
+#include <string>
+#include <vector>
+#include <array>
+#include <unordered_map>
+
+#include <SDL.h>
+
+#include "GraphicsEngine.h"
+
+// Neighbor masks have one bit per direction, clockwise from north. A bit is set when the
+// neighbor on that side connects to the cell (see AutotileSet::connects).
+#define AUTOTILE_N		0x01
+#define AUTOTILE_NE		0x02
+#define AUTOTILE_E		0x04
+#define AUTOTILE_SE		0x08
+#define AUTOTILE_S		0x10
+#define AUTOTILE_SW		0x20
+#define AUTOTILE_W		0x40
+#define AUTOTILE_NW		0x80
+// kind for a Tile that isn't autotiled
+#define AUTOTILE_NONE	-1
+// how many Orders a rule needs: 4 neighbor rules look at the sides only, 8 neighbor rules at
+// the corners too (but only where both sides next to the corner connect, so it's 47, not 256)
+#define AUTOTILE_EDGE_VARIANTS	16
+#define AUTOTILE_BLOB_VARIANTS	47
+
+/// <summary>
+/// The tables that turn a neighbor mask into which of a rule's Orders to use, worked out at compile time
+/// so picking one is a single lookup.
+///
+/// Edge variants are the side bits packed together: N = 1, E = 2, S = 4, W = 8. Blob variants number
+/// the 47 masks that are left once corners without both of their sides are dropped, in increasing
+/// order of mask (so 0 is an island, and 46 is surrounded).
+/// </summary>
+namespace autotile {
+
+	constexpr Uint8 dropLoneCorners(int mask) {
+		int kept = mask & (AUTOTILE_N | AUTOTILE_E | AUTOTILE_S | AUTOTILE_W);
+		if ((mask & AUTOTILE_NE) && (mask & AUTOTILE_N) && (mask & AUTOTILE_E)) kept |= AUTOTILE_NE;
+		if ((mask & AUTOTILE_SE) && (mask & AUTOTILE_S) && (mask & AUTOTILE_E)) kept |= AUTOTILE_SE;
+		if ((mask & AUTOTILE_SW) && (mask & AUTOTILE_S) && (mask & AUTOTILE_W)) kept |= AUTOTILE_SW;
+		if ((mask & AUTOTILE_NW) && (mask & AUTOTILE_N) && (mask & AUTOTILE_W)) kept |= AUTOTILE_NW;
+		return (Uint8)kept;
+	}
+
+	constexpr std::array<Uint8, 256> makeEdgeTable() {
+		std::array<Uint8, 256> table{};
+		for (int mask = 0; mask < 256; ++mask) {
+			table[mask] = (Uint8)(((mask & AUTOTILE_N) ? 1 : 0) | ((mask & AUTOTILE_E) ? 2 : 0) |
+				((mask & AUTOTILE_S) ? 4 : 0) | ((mask & AUTOTILE_W) ? 8 : 0));
+		}
+		return table;
+	}
+
+	constexpr std::array<Uint8, 256> makeBlobTable() {
+		// which masks survive dropLoneCorners, and so get a variant of their own
+		std::array<bool, 256> isKept{};
+		for (int mask = 0; mask < 256; ++mask) {
+			isKept[dropLoneCorners(mask)] = true;
+		}
+		std::array<Uint8, 256> numbers{};
+		int next = 0;
+		for (int mask = 0; mask < 256; ++mask) {
+			if (isKept[mask]) numbers[mask] = (Uint8)next++;
+		}
+		std::array<Uint8, 256> table{};
+		for (int mask = 0; mask < 256; ++mask) {
+			table[mask] = numbers[dropLoneCorners(mask)];
+		}
+		return table;
+	}
+
+	constexpr std::array<Uint8, 256> EDGE_TABLE = makeEdgeTable();
+	constexpr std::array<Uint8, 256> BLOB_TABLE = makeBlobTable();
+
+	static_assert(EDGE_TABLE[0xFF] == AUTOTILE_EDGE_VARIANTS - 1, "edge variants should be 0 to 15");
+	static_assert(BLOB_TABLE[0xFF] == AUTOTILE_BLOB_VARIANTS - 1, "blob variants should be 0 to 46");
+	static_assert(BLOB_TABLE[AUTOTILE_NE] == BLOB_TABLE[0], "corners alone don't connect");
+
+}
+
+/// <summary>
+/// AutotileRule -- one kind of autotiled Tile (a road, a river, a shoreline), and which of its Orders to
+/// draw for each variant.
+/// </summary>
+typedef struct atr_ {
+	std::string name;
+	// 4 or 8
+	int connectivity;
+	const AFrame* graphics;
+	// AUTOTILE_EDGE_VARIANTS or AUTOTILE_BLOB_VARIANTS of them, all from the same AFrame
+	std::vector<const Order*> variants;
+	// the other kinds this one connects to, besides itself (roads into bridges, say)
+	std::vector<int> joins;
+} AutotileRule;
+
+/// <summary>
+/// AutotileSet -- the autotiling rules, loaded from a file that sits beside objects.txt. Each rule looks like
+///
+///     name(4) = asset: { order, order, ... }
+///     name(8) = asset joins other, other: { order, order, ... }
+///
+/// with the 4 or 8 being which neighbors count, and one Order per variant, in variant order (see the
+/// autotile namespace). Lines starting with # are comments.
+///
+/// Tiles belong to a rule by being drawn with any of its Orders, so painting any variant onto a Layer is
+/// painting that kind, and the Layer picks the right variant from there (see Layer::setAutotiles).
+/// </summary>
+class AutotileSet {
+
+public:
+	AutotileSet() = default;
+	~AutotileSet() = default;
+	// anything already loaded is thrown out. The assets have to be loaded first.
+	bool load(AssetManager& assets, const std::string& path);
+
+	int getKindCount() const { return (int)rules.size(); }
+	const AutotileRule& getRule(int kind) const { return rules[kind]; }
+	// AUTOTILE_NONE if there isn't one by that name
+	int findRule(const std::string& name) const;
+	// which rule order is one of the variants of, or AUTOTILE_NONE
+	int findKind(const Order* order) const;
+	// true if a kind Tile should treat an other Tile next to it as connected
+	bool connects(int kind, int other) const;
+	// which of kind's variants to use for a neighbor mask
+	int getVariant(int kind, Uint8 mask) const;
+
+private:
+	void clear();
+
+	std::vector<AutotileRule> rules;
+	std::unordered_map<const Order*, int> kinds;
+	// [kind * getKindCount() + other]
+	std::vector<bool> joined;
+
+};
+
+#endif
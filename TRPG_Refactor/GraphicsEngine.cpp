@@ -7,6 +7,9 @@
 #include <vector>
 #include <unordered_map>
 #include <list>
+#include <algorithm>
+#include <stdexcept>
+#include <cmath>
 
 #include <SDL.h>
 #include <SDL_image.h>
@@ -18,7 +21,12 @@
 /// </summary>
 /// <param name="renderer">The current renderer</param>
 /// <param name="graphic">A texture to wrap with that renderer</param>
-Frame::Frame(SDL_Renderer* renderer, SDL_Texture* graphic) : renderer(renderer), texture(graphic) {}
+Frame::Frame(SDL_Renderer* renderer, SDL_Texture* graphic, SDL_Color averageColor) :
+	renderer(renderer), texture(graphic), width(0), height(0), averageColor(averageColor) {
+	if (texture != NULL && SDL_QueryTexture(texture, NULL, NULL, &width, &height) < 0) {
+		printf("Frame::Frame: Couldn't query texture. SDL_Error: %s\n", SDL_GetError());
+	}
+}
 
 /// <summary>
 /// Destructor for Frame
@@ -40,7 +48,10 @@ Frame::~Frame() {
 // Move semantics yay
 Frame::Frame(Frame&& rhs) noexcept :
 	renderer{rhs.renderer},
-	texture{rhs.texture}
+	texture{rhs.texture},
+	width{rhs.width},
+	height{rhs.height},
+	averageColor{rhs.averageColor}
 {
 	rhs.texture = NULL;
 	rhs.renderer = NULL;
@@ -50,6 +61,9 @@ Frame::Frame(Frame&& rhs) noexcept :
 Frame& Frame::operator=(Frame&& rhs) noexcept {
 	this->renderer = rhs.renderer;
 	this->texture = rhs.texture;
+	this->width = rhs.width;
+	this->height = rhs.height;
+	this->averageColor = rhs.averageColor;
 
 	rhs.texture = NULL;
 	rhs.renderer = NULL;
@@ -57,15 +71,53 @@ Frame& Frame::operator=(Frame&& rhs) noexcept {
 	return *this;
 }
 
+/// <summary>
+/// Averages every pixel of a surface. Pixels count for as much as they're opaque, so a sprite's
+/// transparent border doesn't drag its color towards black.
+/// </summary>
+/// <param name="surface">Any format; it's converted to read it.</param>
+/// <returns>The average color, with the average alpha. All 0 if the surface couldn't be read.</returns>
+SDL_Color GE_AverageColor(SDL_Surface* surface) {
+	SDL_Color average = { 0, 0, 0, 0 };
+	if (surface == NULL) return average;
+	SDL_Surface* rgba = SDL_ConvertSurfaceFormat(surface, SDL_PIXELFORMAT_RGBA32, 0);
+	if (rgba == NULL) {
+		printf("GE_AverageColor: Couldn't convert surface. SDL_Error: %s\n", SDL_GetError());
+		return average;
+	}
+
+	Uint64 r = 0, g = 0, b = 0, a = 0;
+	SDL_LockSurface(rgba);
+	for (int y = 0; y < rgba->h; ++y) {
+		const Uint8* pixel = (const Uint8*)rgba->pixels + y * rgba->pitch;
+		for (int x = 0; x < rgba->w; ++x, pixel += 4) {
+			r += (Uint64)pixel[0] * pixel[3];
+			g += (Uint64)pixel[1] * pixel[3];
+			b += (Uint64)pixel[2] * pixel[3];
+			a += pixel[3];
+		}
+	}
+	SDL_UnlockSurface(rgba);
+
+	if (a > 0) {
+		average.r = (Uint8)(r / a);
+		average.g = (Uint8)(g / a);
+		average.b = (Uint8)(b / a);
+		average.a = (Uint8)(a / ((Uint64)rgba->w * rgba->h));
+	}
+	SDL_FreeSurface(rgba);
+	return average;
+}
+
 /// <summary>
 /// Lets you grab the width and height of the internal texture, just in case
 /// </summary>
 /// <param name="w">int pointer to place the width</param>
 /// <param name="h">int pointer to place the height</param>
 void Frame::queryWidthHeight(int* w, int* h) const {
-	if (SDL_QueryTexture(texture, NULL, NULL, w, h) < 0) {
-		printf("Frame::queryWidthHeight: Couldn't query texture. SDL_Error: %s\n", SDL_GetError());
-	}
+	// these were cached when the Frame was made
+	if (w != NULL) *w = width;
+	if (h != NULL) *h = height;
 }
 
 /// <summary>
@@ -81,6 +133,341 @@ void Frame::render(SDL_Rect* dst) const {
 }
 
 
+DrawList::DrawList() :
+	isInTarget{ false } {}
+
+void DrawList::clear() {
+	commands.clear();
+	targetCommands.clear();
+	passes.clear();
+	uploads.clear();
+	uploadPixels.clear();
+	isInTarget = false;
+}
+
+void DrawList::append(const DrawList& other) {
+	commands.insert(commands.end(), other.commands.begin(), other.commands.end());
+	size_t offset = targetCommands.size();
+	targetCommands.insert(targetCommands.end(), other.targetCommands.begin(), other.targetCommands.end());
+	for (TargetPass pass : other.passes) {
+		pass.begin += offset;
+		pass.end += offset;
+		passes.push_back(pass);
+	}
+	size_t pixelOffset = uploadPixels.size();
+	uploadPixels.insert(uploadPixels.end(), other.uploadPixels.begin(), other.uploadPixels.end());
+	for (TextureUpload upload : other.uploads) {
+		upload.offset += pixelOffset;
+		uploads.push_back(upload);
+	}
+}
+
+void DrawList::add(int zlayer, SDL_Texture* texture, const SDL_Rect& dst, int sublayer) {
+	DrawCommand command;
+	command.zlayer = zlayer;
+	command.sublayer = sublayer;
+	command.texture = texture;
+	command.dst = dst;
+	if (isInTarget) {
+		targetCommands.push_back(command);
+		passes.back().end = targetCommands.size();
+	}
+	else {
+		commands.push_back(command);
+	}
+}
+
+/// <summary>
+/// Starts a target pass. Until endTarget, add puts commands in the pass instead of the main list.
+/// Passes can't be nested.
+/// </summary>
+/// <param name="target">A texture made with SDL_TEXTUREACCESS_TARGET. It's cleared before the pass draws into it.</param>
+/// <param name="clip">If not NULL, the part of target (in its own pixels) to clear and draw to. The rest keeps what it had.</param>
+void DrawList::beginTarget(SDL_Texture* target, const SDL_Rect* clip) {
+	if (isInTarget) {
+		printf("ERROR: DrawList::beginTarget called inside another target pass.\n");
+		endTarget();
+	}
+	TargetPass pass;
+	pass.target = target;
+	pass.hasClip = clip != NULL;
+	pass.clip = (clip != NULL) ? *clip : SDL_Rect{ 0, 0, 0, 0 };
+	pass.begin = targetCommands.size();
+	pass.end = pass.begin;
+	passes.push_back(pass);
+	isInTarget = true;
+}
+
+void DrawList::endTarget() {
+	isInTarget = false;
+}
+
+void DrawList::uploadTexture(SDL_Texture* texture, const SDL_Rect& rect, const Uint32* pixels) {
+	if (rect.w <= 0 || rect.h <= 0) return;
+	TextureUpload upload;
+	upload.texture = texture;
+	upload.rect = rect;
+	upload.offset = uploadPixels.size();
+	uploadPixels.insert(uploadPixels.end(), pixels, pixels + (size_t)rect.w * rect.h);
+	uploads.push_back(upload);
+}
+
+/// <summary>
+/// Sorts the list so that lower zlayers draw first (then lower sublayers), and so that inside of those all
+/// the quads sharing a texture are next to each other. Sprites on the same zlayer never had a defined draw order relative to
+/// each other, so grouping them by texture doesn't change anything visible. The sort is stable, so
+/// commands with the same zlayer and texture keep the order they were added in.
+/// </summary>
+void DrawList::sort() {
+	auto order = [](const DrawCommand& left, const DrawCommand& right) {
+		if (left.zlayer != right.zlayer) return left.zlayer < right.zlayer;
+		if (left.sublayer != right.sublayer) return left.sublayer < right.sublayer;
+		return std::less<SDL_Texture*>()(left.texture, right.texture);
+	};
+	std::stable_sort(commands.begin(), commands.end(), order);
+	for (const TargetPass& pass : passes) {
+		std::stable_sort(targetCommands.begin() + pass.begin, targetCommands.begin() + pass.end, order);
+	}
+}
+
+/// <summary>
+/// Draws every target pass into its texture, then every command to the active render target, in list
+/// order. Call sort first. Runs of the same texture are handed to SDL back to back, so with
+/// SDL_HINT_RENDER_BATCHING on they become a single draw. Also updates the stats for this submission.
+/// </summary>
+/// <param name="renderer">The active renderer.</param>
+void DrawList::submit(SDL_Renderer* renderer) {
+	stats = RenderStats();
+
+	for (const TextureUpload& upload : uploads) {
+		if (SDL_UpdateTexture(upload.texture, &upload.rect, &uploadPixels[upload.offset], upload.rect.w * sizeof(Uint32)) < 0) {
+			printf("DrawList::submit: Failed to update texture. SDL_Error: %s\n", SDL_GetError());
+		}
+		++stats.textureUploads;
+	}
+
+	if (!passes.empty()) {
+		// put everything back the way we found it afterwards
+		SDL_Texture* screen = SDL_GetRenderTarget(renderer);
+		Uint8 r, g, b, a;
+		SDL_BlendMode blend;
+		SDL_GetRenderDrawColor(renderer, &r, &g, &b, &a);
+		SDL_GetRenderDrawBlendMode(renderer, &blend);
+		SDL_SetRenderDrawColor(renderer, 0, 0, 0, 0);
+		// so filling a clip rect with transparent actually clears it
+		SDL_SetRenderDrawBlendMode(renderer, SDL_BLENDMODE_NONE);
+		for (const TargetPass& pass : passes) {
+			if (SDL_SetRenderTarget(renderer, pass.target) < 0) {
+				printf("DrawList::submit: Failed to set render target. SDL_Error: %s\n", SDL_GetError());
+				continue;
+			}
+			if (pass.hasClip) {
+				// RenderClear ignores the clip rect, so clear just our part by hand
+				SDL_RenderSetClipRect(renderer, &pass.clip);
+				SDL_RenderFillRect(renderer, &pass.clip);
+			}
+			else {
+				SDL_RenderClear(renderer);
+			}
+			drawCommands(renderer, targetCommands, pass.begin, pass.end);
+			if (pass.hasClip) SDL_RenderSetClipRect(renderer, NULL);
+			++stats.targetPasses;
+		}
+		SDL_SetRenderTarget(renderer, screen);
+		SDL_SetRenderDrawColor(renderer, r, g, b, a);
+		SDL_SetRenderDrawBlendMode(renderer, blend);
+	}
+
+	drawCommands(renderer, commands, 0, commands.size());
+}
+
+void DrawList::drawCommands(SDL_Renderer* renderer, const std::vector<DrawCommand>& from, size_t begin, size_t end) {
+	SDL_Texture* lastTexture = NULL;
+	for (size_t i = begin; i < end; ++i) {
+		const DrawCommand& command = from[i];
+		if (command.texture != lastTexture) {
+			++stats.textureSwitches;
+			lastTexture = command.texture;
+		}
+		if (SDL_RenderCopy(renderer, command.texture, NULL, &command.dst) < 0) {
+			printf("DrawList::submit: Failed to render. SDL_Error: %s\n", SDL_GetError());
+		}
+		++stats.drawCalls;
+	}
+}
+
+
+/// <summary>
+/// Starts up the worker threads. They sleep until run is called.
+/// </summary>
+/// <param name="threadCount">How many threads to start, on top of whoever calls run. 0 picks one less than the core count.</param>
+WorkerPool::WorkerPool(int threadCount) :
+	threads{},
+	lock{ SDL_CreateMutex() },
+	wake{ SDL_CreateCond() },
+	done{ SDL_CreateCond() },
+	job{ NULL },
+	jobCount{ 0 },
+	nextJob{ 0 },
+	finishedJobs{ 0 },
+	generation{ 0 },
+	isQuitting{ false }
+{
+	if (lock == NULL || wake == NULL || done == NULL) {
+		printf("WorkerPool: Couldn't create sync objects. SDL_Error: %s\n", SDL_GetError());
+		return;
+	}
+	if (threadCount <= 0) threadCount = SDL_GetCPUCount() - 1;
+	for (int i = 0; i < threadCount; ++i) {
+		SDL_Thread* t = SDL_CreateThread(WorkerPool::workerMain, "worker", this);
+		if (t == NULL) {
+			printf("WorkerPool: Couldn't start a worker. SDL_Error: %s\n", SDL_GetError());
+			break;
+		}
+		threads.push_back(t);
+	}
+}
+
+WorkerPool::~WorkerPool() {
+	SDL_LockMutex(lock);
+	isQuitting = true;
+	SDL_CondBroadcast(wake);
+	SDL_UnlockMutex(lock);
+	for (SDL_Thread* t : threads) {
+		SDL_WaitThread(t, NULL);
+	}
+	SDL_DestroyCond(done);
+	SDL_DestroyCond(wake);
+	SDL_DestroyMutex(lock);
+}
+
+/// <summary>
+/// Runs every job and waits for them all to finish. Don't call this from inside a job.
+/// </summary>
+/// <param name="jobCount">How many jobs there are.</param>
+/// <param name="job">Gets called once with each job number. It has to be safe to call from several threads at once.</param>
+void WorkerPool::run(size_t jobCount, const std::function<void(size_t)>& job) {
+	if (jobCount == 0) return;
+
+	SDL_LockMutex(lock);
+	this->job = &job;
+	this->jobCount = jobCount;
+	nextJob = 0;
+	finishedJobs = 0;
+	++generation;
+	SDL_CondBroadcast(wake);
+
+	// pitch in ourselves, then wait for any stragglers
+	runJobs();
+	while (finishedJobs < jobCount) {
+		SDL_CondWait(done, lock);
+	}
+	this->job = NULL;
+	SDL_UnlockMutex(lock);
+}
+
+void WorkerPool::runJobs() {
+	while (job != NULL && nextJob < jobCount) {
+		size_t mine = nextJob++;
+		const std::function<void(size_t)>* current = job;
+		// don't hold the lock while actually working
+		SDL_UnlockMutex(lock);
+		(*current)(mine);
+		SDL_LockMutex(lock);
+		if (++finishedJobs == jobCount) SDL_CondBroadcast(done);
+	}
+}
+
+int WorkerPool::workerMain(void* data) {
+	WorkerPool* pool = (WorkerPool*)data;
+	SDL_LockMutex(pool->lock);
+	Uint32 seen = pool->generation;
+	while (true) {
+		while (!pool->isQuitting && pool->generation == seen) {
+			SDL_CondWait(pool->wake, pool->lock);
+		}
+		if (pool->isQuitting) break;
+		seen = pool->generation;
+		pool->runJobs();
+	}
+	SDL_UnlockMutex(pool->lock);
+	return 0;
+}
+
+
+DrawListExchange::DrawListExchange() :
+	lists{},
+	front{ 0 },
+	back{ 1 },
+	isPending{ false },
+	isStopped{ false },
+	lastStats{},
+	lock{ SDL_CreateMutex() },
+	pickedUp{ SDL_CreateCond() }
+{
+	if (lock == NULL || pickedUp == NULL) {
+		printf("DrawListExchange: Couldn't create sync objects. SDL_Error: %s\n", SDL_GetError());
+	}
+}
+
+DrawListExchange::~DrawListExchange() {
+	SDL_DestroyCond(pickedUp);
+	SDL_DestroyMutex(lock);
+}
+
+/// <summary>
+/// Called by the game thread once the back list is built and sorted. This waits for the render thread
+/// to take it, which happens at the start of its next frame, so the game thread can overlap the
+/// render thread's drawing and presenting but never gets more than a frame ahead.
+/// </summary>
+void DrawListExchange::publish() {
+	SDL_LockMutex(lock);
+	isPending = true;
+	while (isPending && !isStopped) {
+		SDL_CondWait(pickedUp, lock);
+	}
+	SDL_UnlockMutex(lock);
+}
+
+/// <summary>
+/// Called by the render thread once per frame, with the backbuffer as the render target. Swaps in a
+/// newly published list if there is one, then draws whatever the front list is.
+/// </summary>
+/// <param name="renderer">The active renderer. This should only ever be used from this thread.</param>
+void DrawListExchange::submitLatest(SDL_Renderer* renderer) {
+	SDL_LockMutex(lock);
+	if (isPending) {
+		int temp = front;
+		front = back;
+		back = temp;
+		isPending = false;
+		SDL_CondSignal(pickedUp);
+	}
+	SDL_UnlockMutex(lock);
+
+	// the game thread only touches the back list, so we can draw without holding the lock
+	lists[front].submit(renderer);
+
+	SDL_LockMutex(lock);
+	lastStats = lists[front].getStats();
+	SDL_UnlockMutex(lock);
+}
+
+RenderStats DrawListExchange::getLastStats() {
+	SDL_LockMutex(lock);
+	RenderStats stats = lastStats;
+	SDL_UnlockMutex(lock);
+	return stats;
+}
+
+void DrawListExchange::stop() {
+	SDL_LockMutex(lock);
+	isStopped = true;
+	SDL_CondBroadcast(pickedUp);
+	SDL_UnlockMutex(lock);
+}
+
+
 /// <summary>
 /// AssetManager constructor; doesn't actually do much. Call loadAssets before using.
 /// </summary>
@@ -166,7 +553,7 @@ int AssetManager::loadAssets(SDL_Renderer* renderer, std::string assetDir) {
 
 			// put the new texture into a Frame wrapper and push it to the map, then free the surface
 			// TODO: might've messed up the syntax here with the uniform init
-			Frame newFrame{ renderer, SDL_CreateTextureFromSurface(renderer, img) };
+			Frame newFrame{ renderer, SDL_CreateTextureFromSurface(renderer, img), GE_AverageColor(img) };
 			std::pair<int, Frame> temp{ nextKey++, std::move(newFrame) };
 			frames.insert(std::move(temp));
 			SDL_FreeSurface(img);
@@ -269,7 +656,24 @@ Order::Order(double msPerFrame, std::vector<Frame*> frames, std::vector<SDL_Poin
 	msPerFrame(msPerFrame), 
 	frames(frames), 
 	offsets(offsets), 
-	scale(scale) {}
+	scale(scale),
+	minOffset{ 0, 0 },
+	maxOffset{ 0, 0 },
+	maxWidth{ 0 },
+	maxHeight{ 0 }
+{
+	for (size_t i = 0; i < this->frames.size(); ++i) {
+		int w = 0, h = 0;
+		this->frames[i]->queryWidthHeight(&w, &h);
+		const SDL_Point& o = this->offsets.at(i);
+		if (i == 0 || o.x < minOffset.x) minOffset.x = o.x;
+		if (i == 0 || o.y < minOffset.y) minOffset.y = o.y;
+		if (i == 0 || o.x > maxOffset.x) maxOffset.x = o.x;
+		if (i == 0 || o.y > maxOffset.y) maxOffset.y = o.y;
+		if (w > maxWidth) maxWidth = w;
+		if (h > maxHeight) maxHeight = h;
+	}
+}
 
 /// <summary>
 /// Renders the requested frame in the order at the given coordinates.
@@ -290,6 +694,49 @@ void Order::drawFrame(int screenX, int screenY, int frame, double otherScale) co
 	frames.at(frame)->render(&dst);
 }
 
+/// <summary>
+/// Works out the same dst rectangle as drawFrame, but adds it to a DrawList rather than drawing it.
+/// </summary>
+/// <param name="list">The DrawList to add this frame to.</param>
+/// <param name="zlayer">The zlayer to sort this frame by.</param>
+/// <param name="zoom">The scene's zoom. Edges are rounded down after zooming, so things that touch (Tiles, say) still touch.</param>
+void Order::queueFrame(DrawList& list, int zlayer, int screenX, int screenY, int frame, double otherScale, int sublayer,
+	double zoom) const {
+	const Frame* f = frames.at(frame);
+	SDL_Rect dst;
+	dst.x = screenX + offsets.at(frame).x;
+	dst.y = screenY + offsets.at(frame).y;
+	f->queryWidthHeight(&(dst.w), &(dst.h));
+	if (zoom == 1) {
+		dst.w = (int)(dst.w * scale * otherScale);
+		dst.h = (int)(dst.h * scale * otherScale);
+	}
+	else {
+		double left = dst.x * zoom, top = dst.y * zoom;
+		double right = left + dst.w * scale * otherScale * zoom, bottom = top + dst.h * scale * otherScale * zoom;
+		dst.x = (int)floor(left);
+		dst.y = (int)floor(top);
+		dst.w = (int)floor(right) - dst.x;
+		dst.h = (int)floor(bottom) - dst.y;
+	}
+	list.add(zlayer, f->getTexture(), dst, sublayer);
+}
+
+void Order::queueIcon(DrawList& list, int zlayer, int centerX, int centerY, int size, int sublayer) const {
+	if (frames.empty()) return;
+	const Frame* f = frames[0];
+	int w, h;
+	f->queryWidthHeight(&w, &h);
+	if (w <= 0 || h <= 0) return;
+	// keep the shape, just fit the longer side
+	SDL_Rect dst;
+	dst.w = (w >= h) ? size : std::max(1, size * w / h);
+	dst.h = (h >= w) ? size : std::max(1, size * h / w);
+	dst.x = centerX - dst.w / 2;
+	dst.y = centerY - dst.h / 2;
+	list.add(zlayer, f->getTexture(), dst, sublayer);
+}
+
 double Order::getMSPerFrame() const {
 	return msPerFrame;
 }
@@ -298,12 +745,35 @@ size_t Order::getLength() const {
 	return frames.size();
 }
 
+int Order::getFrameAt(Uint32 elapsedMs) const {
+	Uint32 ms = (Uint32)msPerFrame;
+	if (ms == 0 || frames.empty()) return 0;
+	return (int)((elapsedMs / ms) % frames.size());
+}
+
 void Order::getWidthHeight(int* w, int* h, int frame) const {
 	frames.at(frame)->queryWidthHeight(w, h);
 	*w *= scale;
 	*h *= scale;
 }
 
+SDL_Color Order::getAverageColor(int frame) const {
+	return frames.at(frame)->getAverageColor();
+}
+
+/// <summary>
+/// Gives a rectangle that covers every frame of this Order, relative to where it's drawn. It can be a bit
+/// bigger than any one frame, which is fine for deciding whether something is on screen.
+/// </summary>
+/// <param name="bounds">Where to put the rectangle.</param>
+/// <param name="otherScale">The extra scale the Order is drawn with (e.g. the Sprite's).</param>
+void Order::getBounds(SDL_Rect* bounds, double otherScale) const {
+	bounds->x = minOffset.x;
+	bounds->y = minOffset.y;
+	bounds->w = (maxOffset.x - minOffset.x) + (int)(maxWidth * scale * otherScale) + 1;
+	bounds->h = (maxOffset.y - minOffset.y) + (int)(maxHeight * scale * otherScale) + 1;
+}
+
 
 
 /// <summary>
@@ -318,6 +788,13 @@ void AFrame::draw(int screenX, int screenY, std::string order, int frame, double
 	orders.at(order).drawFrame(screenX, screenY, frame, otherScale);
 }
 
+/// <summary>
+/// Queues the requested Frame of the given Order into a DrawList. See Order::queueFrame.
+/// </summary>
+void AFrame::queue(DrawList& list, int zlayer, int screenX, int screenY, const std::string& order, int frame, double otherScale) const {
+	orders.at(order).queueFrame(list, zlayer, screenX, screenY, frame, otherScale);
+}
+
 /// <summary>
 /// Adds a new Order to this AFrame with the given attributes and name.
 /// </summary>
@@ -342,140 +819,170 @@ void AFrame::getWidthHeight(int* w, int* h, std::string order, int frame) const
 	orders.at(order).getWidthHeight(w, h, frame);
 }
 
+const Order* AFrame::getOrder(const std::string& order) const {
+	auto it = orders.find(order);
+	return (it == orders.end()) ? NULL : &it->second;
+}
+
 
 /// <summary>
 /// Constructor for Sprite; defaults x and y to 0. z layer is also 0, and scale is 1.0.
 /// </summary>
+/// <param name="scene"></param>
 /// <param name="frames"></param>
 /// <param name="order"></param>
-/// <param name="camera"></param>
-Sprite::Sprite(const AFrame& frames, std::string order, bool isVisible) : Sprite(frames, order, 0, 0, 0, 1.0, isVisible) {}
+Sprite::Sprite(AnimationManager& scene, const AFrame& frames, std::string order, bool isVisible) : Sprite(scene, frames, order, 0, 0, 0, 1.0, isVisible) {}
 
 /// <summary>
 /// Constructor for Sprite. 
 /// </summary>
+/// <param name="scene">The AnimationManager this Sprite lives in and gets drawn by.</param>
 /// <param name="frames">A pointer to the AFrame to get animations from.</param>
 /// <param name="order">The Order of the given AFrame to start with. It will start at the first entry for the Order</param>
-/// <param name="camera">A pointer to the SDL_Rect being used as the camera. You either maintain this yourself, or use the
-///  one supplied by your AnimationManager (recommended).</param>
 /// <param name="x"></param>
 /// <param name="y"></param>
-Sprite::Sprite(const AFrame& frames, std::string order, int x, int y, int zlayer, double scale, bool isVisible) : 
-	x{ x },
-	y{ y },
-	zlayer{ zlayer },
-	scale{ scale },
-	graphics{ &frames },
-	order{ order },
-	orderPosition{ 0 },
-	orderLength{frames.getOrderLength(order)},
-	flags{ 0 },
-	isVisible{ isVisible },
-	callbackID{},
-	callbackArg{this, animator.getCamera()}
+Sprite::Sprite(AnimationManager& scene, const AFrame& frames, std::string order, int x, int y, int zlayer, double scale, bool isVisible) : 
+	scene{ &scene },
+	id{ SPRITE_NO_ID }
 {
-	callbackID = SDL_AddTimer((Uint32)graphics->getOrderMSPerFrame(order), Sprite::callback_render, &callbackArg);
-	animator.addSprite(this);
-}
+	const Order* o = frames.getOrder(order);
+	if (o == NULL) {
+		// same as it always was, this blows up, just with a better message
+		printf("ERROR: Sprite::Sprite got an order %s that doesn't exist.\n", order.c_str());
+		throw std::out_of_range(order);
+	}
 
-// Here we initialize the AnimationManager that every Sprite will use. Unfortunately this means we
-// can't have multiple AnimationManagers, but also there isn't a use case for that yet so eh
-AnimationManager Sprite::animator{};
+	SpriteRecord r;
+	r.x = x;
+	r.y = y;
+	r.zlayer = GE_ZlayerToRecord(zlayer);
+	r.scale = GE_ScaleToFixed(scale);
+	r.order = scene.internOrder(o);
+	r.animStart = SDL_GetTicks();
+	r.parent = SPRITE_NO_ID;
+	r.firstChild = SPRITE_NO_ID;
+	r.nextSibling = SPRITE_NO_ID;
+	r.flags = isVisible ? SPRITE_VISIBLE : 0;
+	id = scene.addSprite(r);
+}
 
+// a copy of a moved-from Sprite is just as empty
 Sprite::Sprite(const Sprite& rhs) :
-	x{ rhs.x },
-	y{ rhs.y },
-	zlayer{ rhs.zlayer },
-	scale{ rhs.scale },
-	graphics{ rhs.graphics }, // should be ok?
-	order{ rhs.order },
-	orderPosition{ rhs.orderPosition },
-	orderLength{ rhs.orderLength },
-	flags{ rhs.flags },
-	isVisible{ true },
-	callbackID{},
-	callbackArg{this, animator.getCamera()}
+	scene{ rhs.scene },
+	id{ (rhs.id == SPRITE_NO_ID) ? SPRITE_NO_ID : rhs.scene->cloneSprite(rhs.id) } {}
+
+Sprite& Sprite::operator=(const Sprite& rhs) {
+	if (this == &rhs) return *this;
+	if (rhs.id == SPRITE_NO_ID) {
+		// rhs was moved from, so we end up empty like it
+		if (id != SPRITE_NO_ID) scene->removeSprite(id);
+		scene = rhs.scene;
+		id = SPRITE_NO_ID;
+	}
+	else if (scene == rhs.scene && id != SPRITE_NO_ID) {
+		// we already have a record in the right scene, so just copy the data over
+		scene->copySprite(id, rhs.id);
+	}
+	else {
+		// otherwise (or if we were moved from) we get a new record in rhs's scene
+		Sprite temp{ rhs };
+		swap(*this, temp);
+	}
+	return *this;
+}
+
+Sprite::Sprite(Sprite&& rhs) noexcept :
+	scene{ rhs.scene },
+	id{ rhs.id }
 {
-	callbackID = SDL_AddTimer((Uint32)graphics->getOrderMSPerFrame(order), Sprite::callback_render, &callbackArg);
-	// then register yourself with the animator
-	animator.addSprite(this);
+	rhs.id = SPRITE_NO_ID;
 }
 
-Sprite& Sprite::operator=(Sprite rhs) {
+Sprite& Sprite::operator=(Sprite&& rhs) noexcept {
+	// rhs cleans up our old record when it's destroyed
 	swap(*this, rhs);
 	return *this;
 }
 
 /// <summary>
-/// Sprite destructor. Simply cleans up the animation callback.
-/// EDIT: now also deregisters from the AnimationManager.
+/// Sprite destructor. Gives its record back to the AnimationManager, unless it was moved from.
 /// </summary>
 Sprite::~Sprite() {
-	SDL_RemoveTimer(callbackID);
-	animator.removeSprite(this);
-	callbackArg.spr = NULL;
+	if (id != SPRITE_NO_ID) scene->removeSprite(id);
 }
 
 /// <summary>
-/// Draws the Sprite using the given camera (TODO: don't we already have the camera?). Note: The actual frame rendered is handled by 
-///  a timer that cycles through the active Order of the AFrame. You have to actually render it for the graphic to update.
-///  Ideally, you should just sync to VSync and render everything once per main loop, and then if the graphic updated, it'll
-///  update. OR you could just put everything in an AnimationManager, and it'll do that for you. Just sayin.
+/// Draws the Sprite using the given camera (TODO: don't we already have the camera?). Note: The actual frame rendered is worked
+///  out from the clock, so you have to actually render it for the graphic to update. Ideally, you should just sync to VSync and
+///  render everything once per main loop. OR you could just put everything in an AnimationManager, and it'll do that for you. Just sayin.
 /// </summary>
 /// <param name="camera">The camera to use (?) for rendering.</param>
 void Sprite::render(SDL_Rect* camera) const {
-	//printf("Drawing sprite order %s at %d,%d...\n", order.c_str(), x, y);
-	graphics->draw(x - camera->x, y - camera->y, order, orderPosition, scale);
+	const SpriteRecord& r = record();
+	int x, y;
+	scene->getWorldPosition(id, &x, &y);
+	scene->getOrder(r.order)->drawFrame(x - camera->x, y - camera->y, scene->getFrameIndex(r, SDL_GetTicks()), GE_ScaleFromFixed(r.scale));
 }
 
 /// <summary>
-/// Updates the current Frame at the correct interval for this Order. This all happens under the hood.
-/// Note: Deceiving name! This doesn't actually render anything, it just sets up the next render!
+/// Adds the Sprite to a DrawList using the given camera.
 /// </summary>
-/// <param name="interval"></param>
-/// <param name="sp"></param>
-/// <returns></returns>
-Uint32 Sprite::callback_render(Uint32 interval, void* sp) {
-	
-	SpriteCallbackArg* args = (SpriteCallbackArg*)sp;
+void Sprite::queueDraw(DrawList& list, const SDL_Rect* camera) const {
+	const SpriteRecord& r = record();
+	int x, y;
+	scene->getWorldPosition(id, &x, &y);
+	scene->getOrder(r.order)->queueFrame(list, r.zlayer, x - camera->x, y - camera->y, scene->getFrameIndex(r, SDL_GetTicks()),
+		GE_ScaleFromFixed(r.scale));
+}
 
-	(args->spr->orderPosition)++;
-	if (args->spr->orderPosition >= args->spr->orderLength) args->spr->orderPosition = 0;
-	//printf("Callback from sprite %hi updated to order position %i of %i.\n", args->spr, args->spr->orderPosition, args->spr->orderLength - 1);
-	
-	return interval;
+void Sprite::setX(int newX) { record().x = newX; }
+void Sprite::setY(int newY) { record().y = newY; }
+void Sprite::setXY(int newX, int newY) { SpriteRecord& r = record(); r.x = newX; r.y = newY; }
+int Sprite::moveX(int xOffset) { return record().x += xOffset; }
+int Sprite::moveY(int yOffset) { return record().y += yOffset; }
+int Sprite::getX() const { return record().x; }
+int Sprite::getY() const { return record().y; }
+int Sprite::getZlayer() const { return record().zlayer; }
+void Sprite::setZlayer(int z) { record().zlayer = GE_ZlayerToRecord(z); }
+void Sprite::setScale(double scale) { record().scale = GE_ScaleToFixed(scale); }
+double Sprite::getScale() const { return GE_ScaleFromFixed(record().scale); }
+
+void Sprite::getScaledWidthHeight(int* w, int* h) const {
+	if (w == NULL || h == NULL) return;
+
+	const SpriteRecord& r = record();
+	scene->getOrder(r.order)->getWidthHeight(w, h, scene->getFrameIndex(r, SDL_GetTicks()));
+	*w = *w * r.scale / SPRITE_SCALE_ONE;
+	*h = *h * r.scale / SPRITE_SCALE_ONE;
 }
 
-/// <summary>
-/// For getting the args passed to the callback, if you want that for some reason. I guess you could
-/// update those args that way, but there aren't any you'd want to update yet.
-/// </summary>
-/// <returns></returns>
-SpriteCallbackArg* Sprite::getCallbackArg() {
-	return &callbackArg;
+const Order* Sprite::getOrder() const { return scene->getOrder(record().order); }
+
+void Sprite::setVisible(bool isVisible) {
+	SpriteRecord& r = record();
+	r.flags = isVisible ? (r.flags | SPRITE_VISIBLE) : (r.flags & ~SPRITE_VISIBLE);
 }
 
-void Sprite::setX(int newX) { x = newX; }
-void Sprite::setY(int newY) { y = newY; }
-void Sprite::setXY(int newX, int newY) { x = newX; y = newY; }
-int Sprite::moveX(int xOffset) { x += xOffset; return x; }
-int Sprite::moveY(int yOffset) { y += yOffset; return y; }
-int Sprite::getX() const { return x; }
-int Sprite::getY() const { return y; }
-int Sprite::getZlayer() const { return zlayer; }
-void Sprite::setZlayer(int z) { zlayer = z; }
-void Sprite::setScale(double scale) { this->scale = scale; }
-double Sprite::getScale() const { return scale; }
+bool Sprite::getVisible() const { return (record().flags & SPRITE_VISIBLE) != 0; }
 
-void Sprite::getScaledWidthHeight(int* w, int* h) const {
-	if (w == NULL || h == NULL) return;
+void Sprite::setSynchronized(bool isSynchronized) {
+	SpriteRecord& r = record();
+	r.flags = isSynchronized ? (r.flags | SPRITE_SYNCHRONIZED) : (r.flags & ~SPRITE_SYNCHRONIZED);
+}
 
-	graphics->getWidthHeight(w, h, order, orderPosition);
-	*w *= scale;
-	*h *= scale;
+bool Sprite::getSynchronized() const { return (record().flags & SPRITE_SYNCHRONIZED) != 0; }
+
+void Sprite::attachTo(const Sprite& parent, int offsetX, int offsetY) {
+	if (parent.scene != scene) {
+		printf("ERROR: Sprite::attachTo tried to attach to a Sprite in a different scene.\n");
+		return;
+	}
+	if (scene->attachSprite(id, parent.id)) {
+		setXY(offsetX, offsetY);
+	}
 }
 
-void Sprite::setVisible(bool isVisible) { this->isVisible = isVisible; }
+void Sprite::detach() { scene->detachSprite(id); }
 
 
 
@@ -490,88 +997,382 @@ AnimationManager::AnimationManager(Uint32 msPerUpdate) {
 	camera->h = 0;
 	camera->w = 0;
 	this->msPerUpdate = msPerUpdate;
-	//callbackID = SDL_AddTimer(msPerUpdate, AnimationManager::callback_render, this);
+	isActive = true;
+	zoom = 1;
+	lodMinPixelSize = 0;
+	lodInterval = 0;
+	iconBelowZoom = 0;
+	iconSize = 0;
+	culledCount = 0;
+	workers = NULL;
+	nextDrawSourceId = 0;
+	generation = 0;
 }
 
 /// <summary>
-/// AnimationManager destructor. Deletes all Sprites it's responsible for as well as the camera.
+/// AnimationManager destructor. Deletes the camera. Sprite records go with the vector.
 /// </summary>
 AnimationManager::~AnimationManager() {
-	//SDL_RemoveTimer(callbackID);
 	delete camera;
 }
 
 /// <summary>
-/// Adds a new Sprite. Once added, the AnimationManager assumes ownership of the Sprite and will delete it when it's destroyed.
-/// DON'T delete it yourself. You still get a ~~pointer~~ reference to it for updating its values, but do not delete it.
+/// Stores a new Sprite record and returns its id. Dead records get reused before the store grows.
+/// Sprites call this themselves; you shouldn't need to.
 /// </summary>
-/// <param name="graphics"></param>
-/// <param name="order"></param>
-/// <returns></returns>
-//Sprite& AnimationManager::addSprite(const AFrame& graphics, std::string order) {
-//	sprites.emplace_back(graphics, order, camera);
-//	// TODO: Is this render call problematic, or necessary? (i'm removing it so we'll see lol)
-//	// sprite->render(camera);
-//	return sprites.back();
-//}
+/// <param name="record">The data for the new Sprite. It's copied in.</param>
+/// <returns>The id the Sprite should use from now on.</returns>
+Uint32 AnimationManager::addSprite(const SpriteRecord& record) {
+	++generation;
+	Uint32 id;
+	// a reused id might still be in touched from when it was removed
+	Uint32 wasTouched = 0;
+	if (!freeIds.empty()) {
+		id = freeIds.back();
+		freeIds.pop_back();
+		wasTouched = records[id].flags & SPRITE_TOUCHED;
+		records[id] = record;
+	}
+	else {
+		records.push_back(record);
+		recordGenerations.push_back(0);
+		id = (Uint32)(records.size() - 1);
+	}
+	// new records always start out on their own, and unwatched
+	SpriteRecord& r = records[id];
+	r.flags = (r.flags & ~(SPRITE_WATCHED | SPRITE_TOUCHED)) | SPRITE_ALIVE | wasTouched;
+	r.parent = SPRITE_NO_ID;
+	r.firstChild = SPRITE_NO_ID;
+	r.nextSibling = SPRITE_NO_ID;
+	return id;
+}
+
+Uint32 AnimationManager::cloneSprite(Uint32 id) {
+	SDL_assert(id < records.size() && (records[id].flags & SPRITE_ALIVE));
+	// copy it out first; addSprite might move the store around
+	SpriteRecord copy = records[id];
+	if (copy.parent != SPRITE_NO_ID) {
+		getWorldPosition(id, &copy.x, &copy.y);
+		copy.zlayer = records[getRoot(id)].zlayer;
+	}
+	return addSprite(copy);
+}
+
+void AnimationManager::copySprite(Uint32 dst, Uint32 src) {
+	SDL_assert(dst < records.size() && (records[dst].flags & SPRITE_ALIVE) && src < records.size() && (records[src].flags & SPRITE_ALIVE));
+	if (dst == src) return;
+	++generation;
+	SpriteRecord& r = records[dst];
+	Uint32 parent = r.parent, firstChild = r.firstChild, nextSibling = r.nextSibling;
+	Uint32 watching = r.flags & (SPRITE_WATCHED | SPRITE_TOUCHED);
+	r = records[src];
+	r.parent = parent;
+	r.firstChild = firstChild;
+	r.nextSibling = nextSibling;
+	r.flags = (r.flags & ~(SPRITE_WATCHED | SPRITE_TOUCHED)) | watching;
+	touchSprite(dst);
+}
+
+/// <summary>
+/// Makes child an overlay of parent. The child keeps its x and y, which now count from the parent.
+/// If it already had a parent, it's detached from that one first.
+/// </summary>
+/// <param name="child"></param>
+/// <param name="parent"></param>
+/// <returns>false (and nothing changes) if parent is child, or one of child's own children.</returns>
+bool AnimationManager::attachSprite(Uint32 child, Uint32 parent) {
+	for (Uint32 p = parent; p != SPRITE_NO_ID; p = records[p].parent) {
+		if (p == child) {
+			printf("ERROR: AnimationManager::attachSprite would have made a Sprite its own parent.\n");
+			return false;
+		}
+	}
+	if (records[child].parent != SPRITE_NO_ID) detachSprite(child);
+
+	++generation;
+	touchSprite(child);
+	SpriteRecord& c = records[child];
+	SpriteRecord& p = records[parent];
+	c.parent = parent;
+	c.nextSibling = p.firstChild;
+	p.firstChild = child;
+	return true;
+}
+
+/// <summary>
+/// Turns child back into a plain Sprite. Its x, y and zlayer are set to what it was drawing with, so
+/// it doesn't jump anywhere.
+/// </summary>
+/// <param name="child"></param>
+void AnimationManager::detachSprite(Uint32 child) {
+	SpriteRecord& c = records[child];
+	if (c.parent == SPRITE_NO_ID) return;
+	++generation;
+	touchSprite(child);
+
+	int x, y;
+	getWorldPosition(child, &x, &y);
+	int zlayer = records[getRoot(child)].zlayer;
+
+	// unlink from the parent's list of children
+	Uint32* link = &records[c.parent].firstChild;
+	while (*link != child) link = &records[*link].nextSibling;
+	*link = c.nextSibling;
+
+	c.parent = SPRITE_NO_ID;
+	c.nextSibling = SPRITE_NO_ID;
+	c.x = x;
+	c.y = y;
+	c.zlayer = (Sint16)zlayer;
+}
+
+void AnimationManager::getWorldPosition(Uint32 id, int* x, int* y) const {
+	*x = 0;
+	*y = 0;
+	for (Uint32 i = id; i != SPRITE_NO_ID; i = records[i].parent) {
+		*x += records[i].x;
+		*y += records[i].y;
+	}
+}
 
-// TODO: this might not be necessary now? idk
-void AnimationManager::addSprite(const Sprite* s) {
-	// welp i realize one of the big problems now
-	// these two lines of code are so obviously not what i want, but it's all i can do
-	// we need AnimationManager to store THE Sprite data, not copies
-	// or something else, idk
-	sprites.push_back(s);
-	return;
+Uint32 AnimationManager::getRoot(Uint32 id) const {
+	while (records[id].parent != SPRITE_NO_ID) id = records[id].parent;
+	return id;
 }
 
 /// <summary>
 /// Renders all the Sprites managed by this AnimationManager. Call this once in your main loop.
-/// Renders everything in z stages. Lower z values render first.
+/// Renders everything in z stages. Lower z values render first. Within a z stage, Sprites
+/// are grouped by texture so the renderer can batch them; see getRenderStats for how well that went.
 /// </summary>
-void AnimationManager::updateSprites() const {
-	
-	// make a compare lambda for the PQ
-	auto compare = [](const Sprite* left, const Sprite* right) {
-		// false if left >= right, otherwise true
-		// (that has to be not >=, since comp(a,a) must be false)
-		return left->getZlayer() > right->getZlayer();
-	};
-	// we use a list internally here; TODO: make sure this doesn't break
-	// anything b/c copy assignment or smth
-	std::priority_queue<const Sprite*, std::deque<const Sprite*>, decltype(compare)> heap(compare);
+/// <param name="renderer">The active renderer.</param>
+void AnimationManager::updateSprites(SDL_Renderer* renderer) {
+	drawList.clear();
+	buildDrawList(drawList);
+	drawList.sort();
+	drawList.submit(renderer);
+}
 
-	// push everything by zorder
-	for (const Sprite* e : sprites) {
-		if (e->getVisible())
-			heap.push(e);
+/// <summary>
+/// Adds every visible Sprite to the given DrawList. Nothing is sorted or drawn here. Does nothing
+/// if this scene isn't active.
+/// 
+/// Sprites are checked against the camera before anything else, so ones off screen cost no animation
+/// work at all. Since frames are worked out from the clock, they're on exactly the right frame again
+/// as soon as they come back into view. If the camera has no size, nothing gets culled.
+/// </summary>
+/// <param name="list">The DrawList to add to. It is not cleared first.</param>
+void AnimationManager::buildDrawList(DrawList& list) {
+	if (!isActive) return;
+
+	// every Sprite in this frame uses the same clock reading, so they all stay in step
+	Uint32 now = SDL_GetTicks();
+
+	BuildContext context;
+	context.now = now;
+	// small Sprites see a clock that only moves every lodInterval
+	context.slowNow = (lodInterval > 0) ? now - (now % lodInterval) : now;
+	context.isCulling = camera->w > 0 && camera->h > 0;
+	context.view = getView();
+	context.zoom = zoom;
+	context.isIcons = iconSize > 0 && zoom < iconBelowZoom;
+	culledCount = 0;
+
+	// Every synchronized frame gets worked out here, before anything is queued, so queueing only
+	// ever reads the scene and can go over the worker pool. There's one per Order, so this is cheap.
+	for (SceneOrder& o : orders) {
+		o.frame = o.order->getFrameAt(now);
 	}
 
-	// then render in zorder
-	while (!heap.empty()) {
-		heap.top()->render(camera);
-		//printf("Rendered Sprite with zlayer %d...\n", heap.top()->getZlayer());
-		heap.pop();
+	// not worth waking anyone up for a small scene
+	if (workers == NULL || workers->getThreadCount() < 2 || records.size() < PARALLEL_BUILD_MIN_SPRITES) {
+		queueRange(list, 0, records.size(), context, &culledCount);
+	}
+	else {
+		queueParallel(list, context);
+	}
+
+	for (const DrawSource& source : drawSources) {
+		source(list, context.view);
 	}
 
+	// the draw sources have seen them now
+	for (Uint32 id : touched) {
+		records[id].flags &= ~SPRITE_TOUCHED;
+	}
+	touched.clear();
 }
 
 /// <summary>
-/// Removes the input sprite from the Manager. This will delete it. It will NOT delete its
-/// AFrame or any associated graphics; those remain for later use by other Sprites.
-/// Whatever reference you passed to this function will be invalidated by the end of
-/// it, so be sure to throw it away once you're done.
+/// Same as queueRange over every record, but split up over the worker pool.
 /// </summary>
-/// <param name="sprite"></param>
-void AnimationManager::removeSprite(const Sprite* sprite) {
-	// this is a hack lol, i wanted to capture the address
-	// but doing [&sprite] gives a ref and [sprite] makes a copy
-	// Sprite* addressToCheckFor = sprite;
-	// this way we remove the same Sprite we were passed
-	sprites.remove_if([sprite](const Sprite* s) {
-		return s == sprite;
+void AnimationManager::queueParallel(DrawList& list, const BuildContext& context) {
+	// a few jobs per thread evens things out if some ranges are mostly off screen
+	size_t jobCount = (size_t)workers->getThreadCount() * 4;
+	size_t jobSize = (records.size() + jobCount - 1) / jobCount;
+	if (partialLists.size() < jobCount) partialLists.resize(jobCount);
+	partialCulled.assign(jobCount, 0);
+
+	workers->run(jobCount, [&](size_t job) {
+		size_t begin = job * jobSize;
+		size_t end = (begin + jobSize < records.size()) ? begin + jobSize : records.size();
+		partialLists[job].clear();
+		if (begin < end) queueRange(partialLists[job], begin, end, context, &partialCulled[job]);
 		});
-	return;
+
+	// Stitching the pieces back together in id order gives exactly the list one thread would
+	// have made, so the (stable) sort afterwards comes out the same too.
+	for (size_t job = 0; job < jobCount; ++job) {
+		list.append(partialLists[job]);
+		culledCount += partialCulled[job];
+	}
+}
+
+void AnimationManager::queueRange(DrawList& list, size_t begin, size_t end, const BuildContext& context, size_t* culled) const {
+	for (size_t i = begin; i < end; ++i) {
+		const SpriteRecord& r = records[i];
+		// children get queued along with their parents
+		if ((r.flags & (SPRITE_ALIVE | SPRITE_VISIBLE)) != (SPRITE_ALIVE | SPRITE_VISIBLE) || r.parent != SPRITE_NO_ID) continue;
+		queueTree(list, r, r.x, r.y, r.zlayer, 0, context, culled);
+	}
+}
+
+/// <summary>
+/// Queues one Sprite and then its children, recursively. Children go one sublayer up from their parent,
+/// so they always draw after it (and after every other parent in the zlayer, which keeps all the badges
+/// of one kind together for batching).
+/// </summary>
+void AnimationManager::queueTree(DrawList& list, const SpriteRecord& r, int worldX, int worldY, int zlayer, int depth,
+	const BuildContext& context, size_t* culled) const {
+
+	const SceneOrder& o = orders[r.order];
+	double scale = GE_ScaleFromFixed(r.scale);
+	SDL_Rect bounds;
+	o.order->getBounds(&bounds, scale);
+	const SDL_Rect& view = context.view;
+	bool isOnScreen = true;
+	if (context.isCulling) {
+		int left = worldX + bounds.x, top = worldY + bounds.y;
+		isOnScreen = !(left >= view.x + view.w || left + bounds.w <= view.x ||
+			top >= view.y + view.h || top + bounds.h <= view.y);
+		if (!isOnScreen) ++*culled;
+	}
+
+	if (context.isIcons) {
+		// no animation and no overlays, just something to show where the unit is
+		if (isOnScreen) {
+			int centerX = (int)floor((worldX + bounds.x + bounds.w / 2 - view.x) * context.zoom);
+			int centerY = (int)floor((worldY + bounds.y + bounds.h / 2 - view.y) * context.zoom);
+			o.order->queueIcon(list, zlayer, centerX, centerY, iconSize, depth);
+		}
+		return;
+	}
+
+	if (isOnScreen) {
+		int frame;
+		// animation LOD goes by how big the Sprite is on screen
+		int drawnW = (int)(bounds.w * context.zoom), drawnH = (int)(bounds.h * context.zoom);
+		if (lodMinPixelSize > 0 && lodInterval > 0 && drawnW < lodMinPixelSize && drawnH < lodMinPixelSize) {
+			frame = getFrameIndex(r, context.slowNow);
+		}
+		else if (r.flags & SPRITE_SYNCHRONIZED) {
+			// worked out once per Order at the start of the build
+			frame = o.frame;
+		}
+		else {
+			frame = getFrameIndex(r, context.now);
+		}
+		o.order->queueFrame(list, zlayer, worldX - view.x, worldY - view.y, frame, scale, depth, context.zoom);
+	}
+
+	// a child can stick out past its parent, so they get checked on their own
+	for (Uint32 c = r.firstChild; c != SPRITE_NO_ID; c = records[c].nextSibling) {
+		const SpriteRecord& child = records[c];
+		if (child.flags & SPRITE_VISIBLE) {
+			queueTree(list, child, worldX + child.x, worldY + child.y, zlayer, depth + 1, context, culled);
+		}
+	}
+}
+
+/// <summary>
+/// Frees a Sprite's record so it can be reused. It will NOT delete its AFrame or any associated
+/// graphics; those remain for later use by other Sprites. The id is invalid after this.
+/// </summary>
+/// <param name="id"></param>
+void AnimationManager::removeSprite(Uint32 id) {
+	// orphaned children stay where they were on screen
+	while (records[id].firstChild != SPRITE_NO_ID) detachSprite(records[id].firstChild);
+	detachSprite(id);
+	++generation;
+	touchSprite(id);
+	records[id].flags &= ~(SPRITE_ALIVE | SPRITE_WATCHED);
+	++recordGenerations[id];
+	freeIds.push_back(id);
+}
+
+Uint32 AnimationManager::addDrawSource(DrawSource source) {
+	drawSources.push_back(source);
+	drawSourceIds.push_back(nextDrawSourceId);
+	return nextDrawSourceId++;
+}
+
+void AnimationManager::removeDrawSource(Uint32 id) {
+	for (size_t i = 0; i < drawSourceIds.size(); ++i) {
+		if (drawSourceIds[i] == id) {
+			// erase rather than swap so the others keep drawing in the same order
+			drawSources.erase(drawSources.begin() + i);
+			drawSourceIds.erase(drawSourceIds.begin() + i);
+			return;
+		}
+	}
+}
+
+void AnimationManager::setAnimationLOD(int minPixelSize, Uint32 reducedIntervalMs) {
+	lodMinPixelSize = minPixelSize;
+	lodInterval = reducedIntervalMs;
+}
+
+void AnimationManager::setIconLOD(double belowZoom, int iconSize) {
+	iconBelowZoom = belowZoom;
+	this->iconSize = iconSize;
+}
+
+/// <summary>
+/// Works out which frame of its Order a Sprite is on. Since this only depends on when the animation
+/// started, we don't need a timer per Sprite bumping a counter.
+/// </summary>
+/// <param name="record">The Sprite to check.</param>
+/// <param name="now">The current tick, from SDL_GetTicks.</param>
+/// <returns>An index into the Sprite's Order.</returns>
+int AnimationManager::getFrameIndex(const SpriteRecord& record, Uint32 now) const {
+	// synchronized Sprites run off tick 0 instead of their own start
+	Uint32 start = (record.flags & SPRITE_SYNCHRONIZED) ? 0 : record.animStart;
+	// now can be from before the animation started (animation LOD rounds it down), which would
+	// otherwise wrap around to some random frame
+	return orders[record.order].order->getFrameAt((now > start) ? now - start : 0);
+}
+
+/// <summary>
+/// Finds the id for an Order, adding it to the scene the first time it's asked for. Ids are never
+/// removed; there's at most one per Order, so there aren't many.
+/// </summary>
+/// <param name="order">The Order to look up.</param>
+/// <returns>An id to store in SpriteRecord::order.</returns>
+Uint32 AnimationManager::internOrder(const Order* order) {
+	auto it = orderIds.find(order);
+	if (it != orderIds.end()) return it->second;
+
+	if (orders.size() >= SPRITE_MAX_ORDERS) {
+		printf("ERROR: AnimationManager::internOrder ran out of order ids.\n");
+		throw std::length_error("AnimationManager::internOrder");
+	}
+	SceneOrder o;
+	o.order = order;
+	o.frame = 0;
+	orders.push_back(o);
+	Uint32 id = (Uint32)(orders.size() - 1);
+	orderIds.emplace(order, id);
+	return id;
 }
 
 /// <summary>
@@ -588,15 +1389,38 @@ void AnimationManager::setCamera(SDL_Rect* camera) {
 }
 SDL_Rect* AnimationManager::getCamera() const { return camera; }
 
-/*Uint32 AnimationManager::callback_render(Uint32 interval, void* sp) {
+void AnimationManager::setZoom(double zoom) {
+	this->zoom = std::min(GE_MAX_ZOOM, std::max(GE_MIN_ZOOM, zoom));
+}
 
-	((AnimationManager*)sp)->updateSprites();
+/// <summary>
+/// Zooms while keeping one spot on screen over the same bit of the world, the way zooming with a mouse wheel
+/// should feel. The camera's position is whole pixels, so the spot can drift by a pixel.
+/// </summary>
+/// <param name="zoom">The new zoom. See setZoom.</param>
+/// <param name="screenX">The spot to keep still, in screen pixels.</param>
+/// <param name="screenY"></param>
+void AnimationManager::zoomAt(double zoom, int screenX, int screenY) {
+	zoomAt(zoom, screenX, screenY, camera->x + screenX / this->zoom, camera->y + screenY / this->zoom);
+}
+
+void AnimationManager::zoomAt(double zoom, int screenX, int screenY, double worldX, double worldY) {
+	setZoom(zoom);
+	camera->x = (int)floor(worldX - screenX / this->zoom + 0.5);
+	camera->y = (int)floor(worldY - screenY / this->zoom + 0.5);
+}
 
-	//printf("Callback from sprite %hi updated to order position %i of %i.\n", args->spr, args->spr->orderPosition, args->spr->orderLength - 1);
-	//args->spr->render(args->cam);
+SDL_Rect AnimationManager::getView() const {
+	SDL_Rect view = { camera->x, camera->y, (int)ceil(camera->w / zoom), (int)ceil(camera->h / zoom) };
+	return view;
+}
 
-	return interval;
-}*/
+void AnimationManager::screenToWorld(int screenX, int screenY, int* worldX, int* worldY) const {
+	// drawing rounds (world - camera) * zoom down, so this is the world pixel whose left edge is at or
+	// just before screenX
+	*worldX = camera->x + (int)floor(screenX / zoom);
+	*worldY = camera->y + (int)floor(screenY / zoom);
+}
 
 /// <summary>
 /// Helper function. Call this in the main loop instead of SDL_RenderPresent.
@@ -616,9 +1440,22 @@ void GE_PushFromBackbuffer(SDL_Renderer* renderer, SDL_Texture* backbuffer, int
 	SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
 	SDL_RenderClear(renderer);
 	
-	// do some math to make the texture fit and scale
 	int virtualHeight, virtualWidth;
 	SDL_QueryTexture(backbuffer, NULL, NULL, &virtualWidth, &virtualHeight);
+	SDL_Rect dest = GE_GetBackbufferRect(virtualWidth, virtualHeight, screenWidth, screenHeight);
+
+	SDL_RenderCopy(renderer, backbuffer, NULL, &dest);
+
+	SDL_RenderPresent(renderer);
+
+	SDL_SetRenderTarget(renderer, backbuffer);
+}
+
+/// <summary>
+/// The math that makes the backbuffer fit and scale: as big as it goes without stretching, centered,
+/// with black bars along whichever side doesn't fit.
+/// </summary>
+SDL_Rect GE_GetBackbufferRect(int virtualWidth, int virtualHeight, int screenWidth, int screenHeight) {
 	double hScale = (double)screenHeight / (double)virtualHeight, wScale = (double)screenWidth / (double)virtualWidth;
 	double scale = (hScale < wScale) ? hScale : wScale;
 
@@ -638,10 +1475,21 @@ void GE_PushFromBackbuffer(SDL_Renderer* renderer, SDL_Texture* backbuffer, int
 		dest.x = 0;
 		dest.y = 0;
 	}
+	return dest;
+}
 
-	SDL_RenderCopy(renderer, backbuffer, NULL, &dest);
-
-	SDL_RenderPresent(renderer);
-
-	SDL_SetRenderTarget(renderer, backbuffer);
+/// <summary>
+/// Undoes GE_GetBackbufferRect for one point, so mouse positions from window events can be turned
+/// into backbuffer (and from there world) positions.
+/// </summary>
+/// <returns>false if the point isn't on the backbuffer at all.</returns>
+bool GE_WindowToBackbuffer(int virtualWidth, int virtualHeight, int screenWidth, int screenHeight, int windowX, int windowY,
+	int* x, int* y) {
+	SDL_Rect dest = GE_GetBackbufferRect(virtualWidth, virtualHeight, screenWidth, screenHeight);
+	if (dest.w <= 0 || dest.h <= 0) return false;
+	if (windowX < dest.x || windowX >= dest.x + dest.w || windowY < dest.y || windowY >= dest.y + dest.h) return false;
+	// the offsets aren't negative here, so dividing rounds down like it should
+	*x = (int)((Sint64)(windowX - dest.x) * virtualWidth / dest.w);
+	*y = (int)((Sint64)(windowY - dest.y) * virtualHeight / dest.h);
+	return true;
 }
@@ -6,6 +6,8 @@
 #include <list>
 #include <string>
 #include <map>
+#include <functional>
+#include <atomic>
 
 #include <SDL.h>
 
@@ -20,12 +22,16 @@ class AnimationManager;
 class Frame {
 
 public:
-	Frame(SDL_Renderer* renderer, SDL_Texture* graphic);
+	// averageColor is what the Frame looks like from far away, for minimaps and the like
+	Frame(SDL_Renderer* renderer, SDL_Texture* graphic, SDL_Color averageColor = SDL_Color{ 0, 0, 0, 0 });
 	// Frees the SDL_Texture ONLY, not the renderer
 	~Frame();
 	void queryWidthHeight(int* w, int* h) const;
 	// Renders the entire texture to dst
 	void render(SDL_Rect* dst) const;
+	// The raw texture, for batching draws in a DrawList
+	SDL_Texture* getTexture() const { return texture; }
+	SDL_Color getAverageColor() const { return averageColor; }
 
 	// Since a Frame is responsible for deleting its texture,
 	// we want to give it move semantics
@@ -37,6 +43,207 @@ private:
 	SDL_Texture* texture;
 	// The renderer this Frame uses to draw itself.
 	SDL_Renderer* renderer;
+	// The texture's size never changes, so we query it once here
+	// instead of on every draw.
+	int width;
+	int height;
+	// worked out from the surface when the Frame was loaded
+	SDL_Color averageColor;
+
+};
+
+// the average color of every pixel in surface, weighted by alpha
+SDL_Color GE_AverageColor(SDL_Surface* surface);
+
+
+/// <summary>
+/// DrawCommand -- a single textured quad waiting to be submitted. These
+/// are collected into a DrawList each frame rather than drawn right away.
+/// </summary>
+typedef struct dc_ {
+	int zlayer;
+	// sorts inside a zlayer, before texture. Child Sprites use this to draw after their parents.
+	int sublayer;
+	SDL_Texture* texture;
+	SDL_Rect dst;
+} DrawCommand;
+
+/// <summary>
+/// RenderStats -- counters from the last DrawList submission, so we can
+/// actually measure what batching buys us.
+/// </summary>
+typedef struct rs_ {
+	// number of quads submitted (one SDL_RenderCopy each)
+	Uint32 drawCalls;
+	// number of times consecutive quads used a different texture. With
+	// render batching on, this is roughly how many real GPU draws happen.
+	Uint32 textureSwitches;
+	// number of textures drawn into before the main pass (see DrawList::beginTarget)
+	Uint32 targetPasses;
+	// number of SDL_UpdateTexture calls (see DrawList::uploadTexture)
+	Uint32 textureUploads;
+
+	rs_() : drawCalls{ 0 }, textureSwitches{ 0 }, targetPasses{ 0 }, textureUploads{ 0 } {}
+} RenderStats;
+
+/// <summary>
+/// TargetPass -- a run of DrawCommands that get drawn into a texture before the rest of
+/// the DrawList. This is how the game thread bakes things (map chunks, say) into textures
+/// without ever touching the renderer itself.
+/// </summary>
+typedef struct tp_ {
+	// has to have been made with SDL_TEXTUREACCESS_TARGET
+	SDL_Texture* target;
+	// if hasClip, only clip is cleared and drawn into; the rest of target is left alone
+	bool hasClip;
+	SDL_Rect clip;
+	// the commands for this pass are targetCommands[begin, end)
+	size_t begin;
+	size_t end;
+} TargetPass;
+
+/// <summary>
+/// TextureUpload -- new pixels for part of a texture, copied into the DrawList so the render
+/// thread can put them in before drawing anything.
+/// </summary>
+typedef struct tu_ {
+	SDL_Texture* texture;
+	SDL_Rect rect;
+	// where the rect.w * rect.h pixels start in the list's uploadPixels
+	size_t offset;
+} TextureUpload;
+
+/// <summary>
+/// DrawList -- the per-frame list of everything to draw. Sprites add
+/// themselves to it, then it gets sorted by (zlayer, texture) and submitted
+/// in one go, so quads sharing a texture end up next to each other and the
+/// renderer can batch them.
+/// </summary>
+class DrawList {
+
+public:
+	DrawList();
+	~DrawList() = default;
+	void clear();
+	void add(int zlayer, SDL_Texture* texture, const SDL_Rect& dst, int sublayer = 0);
+	// Everything added between these two goes into target instead, which is cleared to transparent
+	// first. Target passes are drawn before the rest of the list, in the order they were started.
+	// dst rects are then relative to the target's top left. With a clip, only that part of target
+	// is cleared and drawn to, so a texture can be patched up a piece at a time.
+	void beginTarget(SDL_Texture* target, const SDL_Rect* clip = NULL);
+	void endTarget();
+	// Copies rect.w * rect.h SDL_PIXELFORMAT_RGBA8888 pixels (row by row, no padding) to go into
+	// rect of texture. Uploads happen before anything (target passes included) is drawn.
+	void uploadTexture(SDL_Texture* texture, const SDL_Rect& rect, const Uint32* pixels);
+	// adds all of other's commands (and target passes) onto the end of this one, in order
+	void append(const DrawList& other);
+	// stable sort by zlayer, then sublayer, then by texture. Target passes are sorted on their own.
+	void sort();
+	// draws every target pass, then every command in the current order to the active render target
+	void submit(SDL_Renderer* renderer);
+	size_t size() const { return commands.size(); }
+	size_t getTargetCount() const { return passes.size(); }
+	const RenderStats& getStats() const { return stats; }
+
+private:
+	void drawCommands(SDL_Renderer* renderer, const std::vector<DrawCommand>& from, size_t begin, size_t end);
+
+	std::vector<DrawCommand> commands;
+	// the commands for every target pass, back to back
+	std::vector<DrawCommand> targetCommands;
+	std::vector<TargetPass> passes;
+	std::vector<TextureUpload> uploads;
+	std::vector<Uint32> uploadPixels;
+	// true between beginTarget and endTarget
+	bool isInTarget;
+	RenderStats stats;
+
+};
+
+/// <summary>
+/// WorkerPool -- a few threads for splitting up big loops, like building the DrawList for a
+/// huge scene. The thread calling run does its share of the work too, so a pool of n threads
+/// keeps n + 1 cores busy. Between runs the workers just sleep.
+/// </summary>
+class WorkerPool {
+
+public:
+	// threadCount extra threads; 0 means one less than the number of cores
+	WorkerPool(int threadCount = 0);
+	~WorkerPool();
+	// how many threads run jobs, counting the caller
+	int getThreadCount() const { return (int)threads.size() + 1; }
+	// calls job(i) for every i from 0 to jobCount - 1, spread over all the threads,
+	// and returns once they're all done. Jobs can run in any order.
+	void run(size_t jobCount, const std::function<void(size_t)>& job);
+
+	WorkerPool(const WorkerPool&) = delete;
+	WorkerPool& operator=(const WorkerPool&) = delete;
+
+private:
+	static int workerMain(void* data);
+	// grabs and runs jobs until there aren't any left. Call with lock held.
+	void runJobs();
+
+	std::vector<SDL_Thread*> threads;
+	SDL_mutex* lock;
+	// signalled when a new run starts, and when we're shutting down
+	SDL_cond* wake;
+	// signalled when the last job of a run finishes
+	SDL_cond* done;
+	// everything below is only touched while holding lock
+	const std::function<void(size_t)>* job;
+	size_t jobCount;
+	size_t nextJob;
+	size_t finishedJobs;
+	// bumped every run so sleeping workers can tell there's new work
+	Uint32 generation;
+	bool isQuitting;
+
+};
+
+/// <summary>
+/// DrawListExchange -- hands finished DrawLists from the game thread to the render thread.
+/// It's double buffered: the game thread fills the back list while the render thread draws
+/// the front one, and publish swaps them. The render thread never waits on the game thread;
+/// if no new list is ready it just draws the last one again. The game thread runs at most one
+/// frame ahead of the render thread, so no published list ever gets skipped.
+/// 
+/// Only the render thread should touch the SDL_Renderer. The game thread only ever sees
+/// DrawLists, which are plain data.
+/// </summary>
+class DrawListExchange {
+
+public:
+	DrawListExchange();
+	~DrawListExchange();
+	// game thread: the list to build the next frame into. Only valid until publish.
+	DrawList& getBackList() { return lists[back]; }
+	// game thread: hands the back list over. Blocks until the render thread picks it up
+	// (or until stop is called).
+	void publish();
+	// render thread: draws the newest published list to the active render target
+	void submitLatest(SDL_Renderer* renderer);
+	// counters from the last submitLatest call; safe to call from either thread
+	RenderStats getLastStats();
+	// wakes up a game thread stuck in publish so it can shut down
+	void stop();
+
+	// a mutex and a cond var aren't something you can copy
+	DrawListExchange(const DrawListExchange&) = delete;
+	DrawListExchange& operator=(const DrawListExchange&) = delete;
+
+private:
+	DrawList lists[2];
+	// indices into lists; these only change while holding lock
+	int front;
+	int back;
+	// true while a published list is waiting for the render thread
+	bool isPending;
+	bool isStopped;
+	RenderStats lastStats;
+	SDL_mutex* lock;
+	SDL_cond* pickedUp;
 
 };
 
@@ -54,10 +261,21 @@ public:
 	~Order() = default;
 	// calls the appropriate Frame::render() function of this order
 	void drawFrame(int screenX, int screenY, int frame, double otherScale) const;
+	// same as drawFrame, but adds the quad to a DrawList instead of drawing it. With a zoom,
+	// screenX and screenY are world pixels from the view's top left, and everything is scaled by it.
+	void queueFrame(DrawList& list, int zlayer, int screenX, int screenY, int frame, double otherScale, int sublayer = 0,
+		double zoom = 1) const;
+	// the first frame, scaled to fit a size pixel square, centered on (centerX, centerY) on screen
+	void queueIcon(DrawList& list, int zlayer, int centerX, int centerY, int size, int sublayer = 0) const;
 	// basic getters
 	double getMSPerFrame() const;
 	size_t getLength() const;
+	// which frame the animation is on, elapsedMs after it started (it loops)
+	int getFrameAt(Uint32 elapsedMs) const;
 	void getWidthHeight(int* w, int* h, int frame) const;
+	SDL_Color getAverageColor(int frame) const;
+	// the smallest rectangle, relative to the draw position, that every frame fits in
+	void getBounds(SDL_Rect* bounds, double otherScale) const;
 
 private:
 	double msPerFrame;
@@ -72,6 +290,11 @@ private:
 	std::vector<Frame*> frames;
 	std::vector<SDL_Point> offsets;
 	double scale;
+	// worked out once in the constructor for getBounds
+	SDL_Point minOffset;
+	SDL_Point maxOffset;
+	int maxWidth;
+	int maxHeight;
 
 };
 
@@ -86,12 +309,17 @@ public:
 	~AFrame() = default;
 	// calls the Order::draw function on the given order
 	void draw(int screenX, int screenY, std::string order, int frame, double otherScale) const;
+	// calls the Order::queueFrame function on the given order
+	void queue(DrawList& list, int zlayer, int screenX, int screenY, const std::string& order, int frame, double otherScale) const;
 	// creates and adds a new order
 	void addOrder(std::string name, double msPerFrame, std::vector<Frame*> frames, std::vector<SDL_Point> offsets, double scale);
 	// getters
 	double getOrderMSPerFrame(std::string order) const;
 	size_t getOrderLength(std::string order) const;
 	void getWidthHeight(int* w, int* h, std::string order, int frame) const;
+	// looks up an Order once so you don't have to go through its name every frame.
+	// NULL if there isn't one by that name
+	const Order* getOrder(const std::string& order) const;
 
 private:
 	std::map<std::string, Order> orders;
@@ -112,6 +340,8 @@ public:
 	// use this to supply AFrames for your Sprites. AFrames should
 	// never be modified outside of AssetManager!!!
 	const AFrame& getAFrame(std::string key);
+	// for checking names that come from files before getAFrame throws on them
+	bool hasAFrame(const std::string& key) const { return assets.count(key) != 0; }
 
 private:
 	std::map<std::string, AFrame> assets;
@@ -124,103 +354,325 @@ private:
 
 };
 
-// used by Sprites as args for the animation callback. Only spr is used right now as
-// a pointer to the Sprite to update.
-typedef struct sca_ {
-	Sprite* spr;
-	SDL_Rect* cam;
+// id for a Sprite that doesn't own a record (e.g. one that was moved from)
+#define SPRITE_NO_ID 0xFFFFFFFF
+// scenes with fewer Sprite records than this always build their DrawList on one thread
+#define PARALLEL_BUILD_MIN_SPRITES 4096
+
+// SpriteRecord::flags
+#define SPRITE_VISIBLE		0x01
+// false while the record is sitting on the free list
+#define SPRITE_ALIVE		0x02
+// plays in lockstep with everything else on the same Order, see Sprite::setSynchronized
+#define SPRITE_SYNCHRONIZED	0x04
+// reported by AnimationManager::getTouchedSprites when it changes, see watchSprite
+#define SPRITE_WATCHED		0x08
+// already in this build's list of touched Sprites
+#define SPRITE_TOUCHED		0x10
+
+// SpriteRecord::scale is 8.8 fixed point, so this is a scale of 1.0
+#define SPRITE_SCALE_ONE	256
+// order ids get 24 bits in a SpriteRecord
+#define SPRITE_MAX_ORDERS	0x01000000
+// how far AnimationManager::setZoom lets the camera zoom out, and in
+#define GE_MIN_ZOOM			(1.0 / 256)
+#define GE_MAX_ZOOM			4.0
 
-	sca_(Sprite* s, SDL_Rect* c) : spr{ s }, cam{ c } {}
-	sca_() : sca_(NULL, NULL) {};
-} SpriteCallbackArg;
+/// <summary>
+/// SpriteRecord -- the actual data behind a Sprite. These live in the AnimationManager,
+/// and a Sprite is just a handle to one of them, so moving a Sprite never touches this.
+/// 
+/// These are kept to 32 bytes (two to a cache line) since there can be a whole lot of
+/// them. Anything that's the same for lots of Sprites (the Order and its timing) lives
+/// in the scene and is looked up by id instead.
+/// </summary>
+typedef struct sr_ {
+	int x;
+	int y;
+	// Composite Sprites: a child is drawn right after its parent, at x,y relative
+	// to it, with the parent's zlayer, and only while the parent is visible. These
+	// are ids in the same store, or SPRITE_NO_ID. Children form a linked list.
+	Uint32 parent;
+	Uint32 firstChild;
+	Uint32 nextSibling;
+	// the tick this animation started on. The current frame is worked out from
+	// this and the clock, so nothing has to tick each Sprite forward.
+	Uint32 animStart;
+	// which Order this plays, as an id from AnimationManager::internOrder
+	Uint32 order : 24;
+	// SPRITE_VISIBLE and friends
+	Uint32 flags : 8;
+	// see GE_ZlayerToRecord
+	Sint16 zlayer;
+	// see SPRITE_SCALE_ONE
+	Uint16 scale;
+} SpriteRecord;
+
+static_assert(sizeof(SpriteRecord) <= 32, "SpriteRecord should fit in 32 bytes");
+
+// converting to and from SpriteRecord::scale. Scales are clamped to [0, 256).
+inline Uint16 GE_ScaleToFixed(double scale) {
+	double fixed = scale * SPRITE_SCALE_ONE + 0.5;
+	if (fixed <= 0) return 0;
+	if (fixed >= 0xFFFF) return 0xFFFF;
+	return (Uint16)fixed;
+}
+inline double GE_ScaleFromFixed(Uint16 scale) { return (double)scale / SPRITE_SCALE_ONE; }
+// SpriteRecord::zlayer only has 16 bits, so zlayers past that are clamped instead of wrapping
+// around to the other end of the draw order
+inline Sint16 GE_ZlayerToRecord(int zlayer) {
+	if (zlayer < SDL_MIN_SINT16) return SDL_MIN_SINT16;
+	if (zlayer > SDL_MAX_SINT16) return SDL_MAX_SINT16;
+	return (Sint16)zlayer;
+}
+
+/// <summary>
+/// SceneOrder -- an Order some Sprite in the scene is playing. Sprites only store an id into
+/// the scene's table of these.
+/// 
+/// Synchronized Sprites on the same Order all play it in lockstep (all the grass, say,
+/// or every idle infantry), so the frame is worked out once per Order per frame instead of
+/// once per Sprite. Since they all show the same texture at the same time, the sorted DrawList
+/// puts them all in one run, so they go out as one batched draw.
+/// </summary>
+typedef struct so_ {
+	const Order* order;
+	// the frame synchronized Sprites are showing, as of the last buildDrawList
+	int frame;
+} SceneOrder;
+
+// Anything besides Sprites that a scene draws (particles, say). It's called at the end of every
+// buildDrawList with the part of the world the camera sees (see AnimationManager::getView), and
+// should add itself to the list in screen coordinates, scaling by the scene's zoom. Its zlayers
+// sort in with the Sprites' like anything else in the list.
+typedef std::function<void(DrawList& list, const SDL_Rect& camera)> DrawSource;
 
 /// <summary>
 /// AnimationManager -- creates and manages memory used by Sprites, and bulk-renders
 /// all sprites under its control.
+/// 
+/// Each one of these is basically a scene (the battle map, a menu, etc.) with its own
+/// Sprites and camera. Every Sprite belongs to exactly one of them. Inactive scenes are
+/// skipped entirely when drawing, so a scene that isn't shown costs nothing per frame.
+/// 
+/// Nothing in here touches the renderer until updateSprites, so a scene can be built up
+/// on a loading thread and handed over to the game thread once it's done. Just don't
+/// use one from two threads at once.
 /// </summary>
 class AnimationManager {
 
 public:
 	AnimationManager(Uint32 msPerFrame = 17);
 	~AnimationManager();
-	// the Sprite copy methods use this one once they're done. TODO: encapsulate;
-	// there's no reason for the user to call this
-	void addSprite(const Sprite* s);
+	// the camera is a raw owned pointer, and Sprites point back at their
+	// manager anyway, so these can't be copied
+	AnimationManager(const AnimationManager&) = delete;
+	AnimationManager& operator=(const AnimationManager&) = delete;
+	// Sprites use these to get and give back their records. TODO: encapsulate;
+	// there's no reason for the user to call these
+	Uint32 addSprite(const SpriteRecord& record);
+	void removeSprite(Uint32 id);
+	// anything that changes a record gets it through here, so this one counts as a change (see
+	// getGeneration and watchSprite)
+	SpriteRecord& getSprite(Uint32 id) { ++generation; touchSprite(id); return records[id]; }
+	const SpriteRecord& getSprite(Uint32 id) const { return records[id]; }
+	// makes a new record that looks just like an existing one. It doesn't come with
+	// the original's parent or children, so it's placed at the original's world position.
+	// id has to be a live Sprite.
+	Uint32 cloneSprite(Uint32 id);
+	// copies everything but the parent/child links from one record to another. Both have to be live.
+	void copySprite(Uint32 dst, Uint32 src);
+	// parent/child links, see SpriteRecord. attach returns false if it would make a loop.
+	bool attachSprite(Uint32 child, Uint32 parent);
+	void detachSprite(Uint32 child);
+	// where a record actually draws, after adding up all its parents
+	void getWorldPosition(Uint32 id, int* x, int* y) const;
+	// how many Sprites currently hold a record here
+	size_t getSpriteCount() const { return records.size() - freeIds.size(); }
+	// one past the highest id a record has ever had, for going over all of them (dead ones included)
+	size_t getRecordCount() const { return records.size(); }
+	// goes up whenever a record might have changed (made, removed, attached, or written through the
+	// non-const getSprite), so anything built from the records can tell if it's out of date
+	Uint64 getGeneration() const { return generation; }
+	// From now on, id shows up in getTouchedSprites whenever it's written to, attached, detached or
+	// removed. It stays watched until it's removed.
+	void watchSprite(Uint32 id) { records[id].flags |= SPRITE_WATCHED; }
+	// how many times id's record has been removed. Ids get reused, so an id and this together
+	// name one Sprite for good.
+	Uint32 getSpriteGeneration(Uint32 id) const { return recordGenerations[id]; }
+	// the watched Sprites that changed since the last buildDrawList, each once. Draw sources see the
+	// ones for the build they're called from. Removed ones are in here too, no longer alive.
+	const std::vector<Uint32>& getTouchedSprites() const { return touched; }
 	// call this once per loop to render all Sprites this Manager manages
-	void updateSprites() const;
-	void removeSprite(const Sprite* sprite);
+	void updateSprites(SDL_Renderer* renderer);
+	// adds every visible Sprite, then every draw source, to the given DrawList (unsorted)
+	// Not const: it works out the synchronized frames (and keeps some bookkeeping) as it goes.
+	void buildDrawList(DrawList& list);
+	// counters from the last updateSprites call
+	const RenderStats& getRenderStats() const { return drawList.getStats(); }
 	// the memory address of the camera is unchanged after this operation (TODO: probably bad)
 	void setCamera(SDL_Rect* camera);
 	SDL_Rect* getCamera() const;
-
-	//static Uint32 callback_render(Uint32 interval, void* sp);
+	// Zoom: 1 is the world at its real size, less than 1 is zoomed out. The camera's x and y are
+	// still the world position at the top left of the screen and its w and h the screen's size,
+	// so it sees w / zoom by h / zoom of the world. Clamped to [GE_MIN_ZOOM, GE_MAX_ZOOM].
+	void setZoom(double zoom);
+	double getZoom() const { return zoom; }
+	// changes the zoom but keeps whatever's at (screenX, screenY) on screen there (under the mouse, say)
+	void zoomAt(double zoom, int screenX, int screenY);
+	// the same, but puts the world position (worldX, worldY) there, so a zoom eased over several frames
+	// can keep hold of one spot without the camera's rounding adding up
+	void zoomAt(double zoom, int screenX, int screenY, double worldX, double worldY);
+	// the part of the world the camera sees right now, in world pixels
+	SDL_Rect getView() const;
+	// the world pixel drawn at (screenX, screenY) on the backbuffer, at the current camera and zoom
+	void screenToWorld(int screenX, int screenY, int* worldX, int* worldY) const;
+	// inactive scenes don't draw anything. Safe to call from the game thread while the render thread draws
+	void setActive(bool isActive) { this->isActive = isActive; }
+	bool getActive() const { return isActive; }
+
+	// Animation LOD: Sprites drawn smaller than minPixelSize (on their longest side) only
+	// change frame every reducedIntervalMs. 0 for either turns this off. Sprites off camera
+	// are always skipped completely.
+	void setAnimationLOD(int minPixelSize, Uint32 reducedIntervalMs);
+	// Icon LOD: zoomed out past belowZoom, Sprites draw as the first frame of their Order
+	// shrunk to fit an iconSize pixel square, without their children. Every Sprite on an
+	// Order then shares a texture, so a whole army is a handful of batched draws at any
+	// zoom. 0 for either turns this off.
+	void setIconLOD(double belowZoom, int iconSize);
+	// how many Sprites the last buildDrawList skipped for being off camera
+	size_t getCulledCount() const { return culledCount; }
+	// Big scenes split buildDrawList over this pool's threads. The result is exactly the
+	// same as building it on one thread. NULL (the default) always builds on one thread.
+	void setWorkerPool(WorkerPool* pool) { workers = pool; }
+
+	// Adds something else to draw with this scene; see DrawSource. Returns an id for removing it.
+	// Sources get called in the order they were added, on whichever thread builds the DrawList.
+	Uint32 addDrawSource(DrawSource source);
+	void removeDrawSource(Uint32 id);
+
+	// which frame of its Order a record shows at the given tick (from SDL_GetTicks)
+	int getFrameIndex(const SpriteRecord& record, Uint32 now) const;
+	// the id for an Order in this scene, made if it doesn't have one yet
+	Uint32 internOrder(const Order* order);
+	// the Order behind an id from internOrder
+	const Order* getOrder(Uint32 orderId) const { return orders[orderId].order; }
 
 private:
-	// new design!! yay
-	// AnimationManagers now only store addresses of
-	// managed Sprite memory, and Sprites will auto
-	// add and remove themselves as necessary. should
-	// fix everything lol
-	std::list<const Sprite*> sprites;
+	// everything queueTree needs that's the same for the whole build
+	typedef struct bc_ {
+		Uint32 now;
+		Uint32 slowNow;
+		bool isCulling;
+		// what the camera sees, in world pixels, at zoom
+		SDL_Rect view;
+		double zoom;
+		bool isIcons;
+	} BuildContext;
+
+	// queueRange over everything, split up over the worker pool
+	void queueParallel(DrawList& list, const BuildContext& context);
+	// queues every root Sprite with an id in [begin, end), and their children
+	void queueRange(DrawList& list, size_t begin, size_t end, const BuildContext& context, size_t* culled) const;
+	// queues r at the given world position, then all of its children after it
+	void queueTree(DrawList& list, const SpriteRecord& r, int worldX, int worldY, int zlayer, int depth,
+		const BuildContext& context, size_t* culled) const;
+	// the top of id's parent chain
+	Uint32 getRoot(Uint32 id) const;
+	// adds id to touched, if it's watched and isn't in there already
+	void touchSprite(Uint32 id) {
+		SpriteRecord& r = records[id];
+		if ((r.flags & (SPRITE_WATCHED | SPRITE_TOUCHED)) != SPRITE_WATCHED) return;
+		r.flags |= SPRITE_TOUCHED;
+		touched.push_back(id);
+	}
+
+	// newer design!! yay
+	// All the Sprite data lives here in one flat array and
+	// Sprites only hold an index into it. Dead records go on
+	// the free list and get reused, so once this has grown
+	// making and destroying Sprites doesn't allocate.
+	std::vector<SpriteRecord> records;
+	std::vector<Uint32> freeIds;
+	// see getGeneration
+	Uint64 generation;
+	// see getSpriteGeneration, one per record
+	std::vector<Uint32> recordGenerations;
+	// see getTouchedSprites
+	std::vector<Uint32> touched;
+	// every Order any Sprite here has played. There aren't many, so these just grow.
+	std::vector<SceneOrder> orders;
+	std::map<const Order*, Uint32> orderIds;
+	// see addDrawSource, along with their ids
+	std::vector<DrawSource> drawSources;
+	std::vector<Uint32> drawSourceIds;
+	Uint32 nextDrawSourceId;
+	// kept around between frames so we don't reallocate it every time
+	DrawList drawList;
 	SDL_Rect* camera;
-	//SDL_TimerID callbackID;
+	double zoom;
 	Uint32 msPerUpdate;
+	// set by the game thread, read by buildDrawList on the render thread
+	std::atomic<bool> isActive;
+	// see setAnimationLOD
+	int lodMinPixelSize;
+	Uint32 lodInterval;
+	// see setIconLOD
+	double iconBelowZoom;
+	int iconSize;
+	// bookkeeping for buildDrawList
+	size_t culledCount;
+	WorkerPool* workers;
+	// one DrawList per job when building in parallel, kept so they don't reallocate
+	std::vector<DrawList> partialLists;
+	std::vector<size_t> partialCulled;
 
 };
 
 /// <summary>
-/// Sprite -- a container for an AFrame and other rendering data. Automatically
-/// updates the animation frame rendered to the screen via an SDL_Timer callback.
+/// Sprite -- a handle to an AFrame and other rendering data, which is stored in the
+/// AnimationManager. The animation frame shown is worked out from the clock whenever
+/// the Sprite is drawn.
+/// 
+/// Moving a Sprite is just a couple of word copies, so these are fine to keep in
+/// std::vectors and such. Copying one makes a new record with the same data.
+/// 
+/// A Sprite lives in whichever AnimationManager (scene) it was made with, and has to be
+/// destroyed before that manager is.
 /// </summary>
 class Sprite {
 
 public:
 	// x and y default to 0 in this case
-	Sprite(const AFrame& frames, std::string order, bool isVisible = true);
-	Sprite(const AFrame& frames, std::string order, int x, int y, int zlayer, double scale, bool isVisible = true);
+	Sprite(AnimationManager& scene, const AFrame& frames, std::string order, bool isVisible = true);
+	Sprite(AnimationManager& scene, const AFrame& frames, std::string order, int x, int y, int zlayer, double scale, bool isVisible = true);
 	~Sprite();
 
-	// Because Sprite has a non-static reference memeber, it doesn't
-	// really know how to copy itself. We need to tell it how to.
-	// God this was a headache to figure out
+	// a copy gets its own record in the same scene, with the same data as rhs
 	Sprite(const Sprite& rhs);
-	Sprite& operator=(Sprite rhs);
+	Sprite& operator=(const Sprite& rhs);
+	// a move just hands the record over. Don't use a moved-from
+	// Sprite for anything other than destroying or assigning to it.
+	Sprite(Sprite&& rhs) noexcept;
+	Sprite& operator=(Sprite&& rhs) noexcept;
 	// defining this here b/c idk this is confusing
 	// "friend" makes this more portable or smth
-	friend void swap(Sprite& a, Sprite& b) {
+	friend void swap(Sprite& a, Sprite& b) noexcept {
 		using std::swap;
-		
-		// swap all the elements now
-		swap(a.x, b.x);
-		swap(a.y, b.y);
-		swap(a.zlayer, b.zlayer);
-		swap(a.scale, b.scale);
-		swap(a.graphics, b.graphics);
-		swap(a.order, b.order);
-		swap(a.orderPosition, b.orderPosition);
-		swap(a.orderLength, b.orderLength);
-		swap(a.flags, b.flags);
-		swap(a.isVisible, b.isVisible);
-		// NOPE we don't want to swap those!!!
-		//swap(a.callbackID, b.callbackID);
-		//swap(a.callbackArg, b.callbackArg);
+		swap(a.scene, b.scene);
+		swap(a.id, b.id);
 	}
 
-	// Realize this creates a huge problem: Sprites can be constructed
-	// without being registered by the AnimationManager. Oops. But if
-	// we make the AnimationManager a static member of the Sprite class,
-	// then the Sprites can register themselves. Problem solved!
-	static AnimationManager& getAnimator() { return animator; }
-	static SDL_Rect* getAnimCamera() { return animator.getCamera(); }
-	// Ignore all the extra problems this causes, like how to even
-	// instantiate this thing in the first place ;)
+	// the scene this Sprite belongs to
+	AnimationManager& getScene() const { return *scene; }
+	// which record in the scene is ours
+	Uint32 getID() const { return id; }
 
 	// renders the Sprite using the given camera (TODO: is that right?)
 	void render(SDL_Rect* camera) const;
-	// called by the SDL_Timer to update the animation frame
-	static Uint32 callback_render(Uint32 interval, void* sp);
+	// adds the Sprite's current frame to a DrawList instead of drawing it
+	void queueDraw(DrawList& list, const SDL_Rect* camera) const;
 	// getters and setters
-	SpriteCallbackArg* getCallbackArg();
 	void setX(int newX);
 	void setY(int newY);
 	void setXY(int newX, int newY);
@@ -230,38 +682,47 @@ public:
 	int getX() const;
 	int getY() const;
 	int getZlayer() const;
+	// clamped to [-32768, 32767]
 	void setZlayer(int z);
 	void setScale(double scale);
 	double getScale() const;
 	void getScaledWidthHeight(int* w, int* h) const;
+	// the Order this Sprite is playing
+	const Order* getOrder() const;
 	void setVisible(bool isVisible);
-	bool getVisible() const { return isVisible; }
+	bool getVisible() const;
+	// Synchronized Sprites animate in lockstep with every other synchronized
+	// Sprite playing the same Order.
+	void setSynchronized(bool isSynchronized);
+	bool getSynchronized() const;
+	// Attaches this Sprite to parent as an overlay (an hp badge, a status icon...). It then
+	// draws at (offsetX, offsetY) from the parent, right after it, with the parent's zlayer,
+	// and only while the parent is visible. Moving the parent moves all of its children.
+	// While attached, x and y (and setX and friends) are relative to the parent.
+	// Both Sprites have to be in the same scene.
+	void attachTo(const Sprite& parent, int offsetX, int offsetY);
+	// back to a plain Sprite, left wherever it was drawing
+	void detach();
 
 private:
-	static AnimationManager animator;
+	SpriteRecord& record() { return scene->getSprite(id); }
+	const SpriteRecord& record() const { return scene->getSprite(id); }
 
-	int x;
-	int y;
-	int zlayer;
-	double scale;
-	// Even though I don't plan on changing
-	// it, making this a const & is problematic
-	// b/c of copy assignment so we make it a const
-	// * instead
-	const AFrame* graphics;
-	std::string order;
-	int orderPosition;
-	size_t orderLength;
-	// currently unused, but should basically be user data
-	int flags;
-	bool isVisible;
-	SDL_TimerID callbackID;
-	SpriteCallbackArg callbackArg;
+	// the AnimationManager our record lives in
+	AnimationManager* scene;
+	// index of our record in the scene
+	Uint32 id;
 
 };
 
 // renders the backbuffer to the window, adjusting scale and preventing stretching
 void GE_PushFromBackbuffer(SDL_Renderer* renderer, SDL_Texture* backbuffer, int screenHeight, int screenWidth);
+// where GE_PushFromBackbuffer puts a virtualWidth by virtualHeight backbuffer in a screenWidth by screenHeight window
+SDL_Rect GE_GetBackbufferRect(int virtualWidth, int virtualHeight, int screenWidth, int screenHeight);
+// The other way around: the backbuffer pixel under a window position (the mouse, say). Returns false
+// if it's on one of the black bars, and leaves x and y alone.
+bool GE_WindowToBackbuffer(int virtualWidth, int virtualHeight, int screenWidth, int screenHeight, int windowX, int windowY,
+	int* x, int* y);
 
 
 #endif
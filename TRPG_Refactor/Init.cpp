@@ -1,7 +1,15 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <math.h>
 #include <regex>
 #include <string>
 #include <functional>
+#include <fstream>
+#include <random>
+#include <algorithm>
 
 #include <SDL.h>
 #include <SDL_image.h>
@@ -9,14 +17,555 @@
 #include <SDL_mixer.h>
 
 #include "GraphicsEngine.h"
+#include "MapFile.h"
+#include "Autotile.h"
 #include "Tiles.h"
+#include "Minimap.h"
+#include "Tween.h"
+#include "Particles.h"
+#include "SceneGenerator.h"
+#include "SpritePicker.h"
 
 // this should be a good internal target (for now)
 const int SCREEN_WIDTH = 1280;
 const int SCREEN_HEIGHT = 720;
+// each click of the mouse wheel zooms by this much
+const double ZOOM_PER_CLICK = 1.25;
+// the zoom gets halfway to where the wheel sent it every this many ms
+const double ZOOM_HALF_LIFE_MS = 50;
 const int TILE_SIZE = 64;
 
+// everything the game thread needs. The render (main) thread owns this.
+typedef struct gtd_ {
+	// every scene that might be drawn; inactive ones are skipped
+	std::vector<AnimationManager*> scenes;
+	// motions to advance every tick
+	std::vector<TweenManager*> tweens;
+	// combat effects to advance every tick
+	std::vector<ParticleSystem*> particles;
+	DrawListExchange* exchange;
+	SDL_atomic_t isQuit;
+	// the scene the mouse wheel zooms, or NULL
+	AnimationManager* zoomScene;
+	// mouse wheel clicks (in is positive) the game thread hasn't seen yet, and where on the
+	// backbuffer the mouse was for the last of them
+	SDL_atomic_t wheelClicks;
+	SDL_atomic_t wheelX;
+	SDL_atomic_t wheelY;
+} GameThreadData;
+
+/// <summary>
+/// The game thread. All game logic goes here; it never touches the SDL_Renderer. Each loop it
+/// produces a DrawList for the frame and hands it to the render thread, which presents it while
+/// we get on with the next one.
+/// </summary>
+/// <param name="data">A GameThreadData*</param>
+/// <returns>0, always</returns>
+int gameLoop(void* data) {
+	GameThreadData* game = (GameThreadData*)data;
+	Uint32 lastTick = SDL_GetTicks();
+	// The wheel moves zoomTarget, and the zoom eases toward it, holding on to the world position
+	// that was under the mouse
+	double zoomTarget = (game->zoomScene != NULL) ? game->zoomScene->getZoom() : 1;
+	double zoomWorldX = 0, zoomWorldY = 0;
+	int zoomScreenX = 0, zoomScreenY = 0;
+
+	while (SDL_AtomicGet(&game->isQuit) == 0) {
+		Uint32 now = SDL_GetTicks();
+		Uint32 elapsed = now - lastTick;
+		lastTick = now;
+
+		int clicks = SDL_AtomicSet(&game->wheelClicks, 0);
+		if (game->zoomScene != NULL) {
+			AnimationManager* scene = game->zoomScene;
+			if (clicks != 0) {
+				zoomTarget = std::min(GE_MAX_ZOOM, std::max(GE_MIN_ZOOM, zoomTarget * pow(ZOOM_PER_CLICK, clicks)));
+				zoomScreenX = SDL_AtomicGet(&game->wheelX);
+				zoomScreenY = SDL_AtomicGet(&game->wheelY);
+				zoomWorldX = scene->getCamera()->x + zoomScreenX / scene->getZoom();
+				zoomWorldY = scene->getCamera()->y + zoomScreenY / scene->getZoom();
+			}
+			double zoom = scene->getZoom();
+			if (zoom != zoomTarget) {
+				// eased in log space, so zooming in and out go at the same speed
+				double left = log(zoom / zoomTarget) * pow(0.5, elapsed / ZOOM_HALF_LIFE_MS);
+				zoom = (fabs(left) < 0.001) ? zoomTarget : zoomTarget * exp(left);
+				scene->zoomAt(zoom, zoomScreenX, zoomScreenY, zoomWorldX, zoomWorldY);
+			}
+		}
+
+		// TODO: game logic goes here
+		for (TweenManager* tweens : game->tweens) {
+			tweens->update(elapsed);
+		}
+		for (ParticleSystem* particles : game->particles) {
+			particles->update(elapsed);
+		}
+
+		DrawList& frame = game->exchange->getBackList();
+		frame.clear();
+		for (AnimationManager* scene : game->scenes) {
+			scene->buildDrawList(frame);
+		}
+		frame.sort();
+		game->exchange->publish();
+	}
+
+	return 0;
+}
+
+// milliseconds since start, a value from SDL_GetPerformanceCounter. For the --bench modes.
+static double msSince(Uint64 start) {
+	return (double)(SDL_GetPerformanceCounter() - start) * 1000.0 / (double)SDL_GetPerformanceFrequency();
+}
+
+// SpriteRecord as it was before it got packed into 32 bytes, for --bench-records to compare against.
+// The pointers were an AFrame* and an Order*.
+typedef struct osr_ {
+	int x;
+	int y;
+	int zlayer;
+	double scale;
+	const void* graphics;
+	const void* order;
+	Uint32 animStart;
+	Uint32 phaseGroup;
+	Uint32 parent;
+	Uint32 firstChild;
+	Uint32 nextSibling;
+	int flags;
+	bool isVisible;
+	bool isAlive;
+} OldSpriteRecord;
+
+/// <summary>
+/// --bench-records: how much a million SpriteRecords take up next to the old layout, and how long a
+/// culling pass over all of them (the test buildDrawList does on every record each frame) takes with each.
+/// </summary>
+static int benchRecords(AssetManager& assets) {
+	const int recordCount = 1000000, columns = 1000, passes = 50;
+	const SDL_Rect view = { 0, 0, 100 * TILE_SIZE, 100 * TILE_SIZE };
+	// a real scene too, so the new numbers are for records made the usual way
+	AnimationManager scene;
+	std::vector<Sprite> sprites;
+	sprites.reserve(recordCount);
+	const AFrame& frames = assets.getAFrame("infantry");
+	std::vector<OldSpriteRecord> oldRecords(recordCount);
+	for (int i = 0; i < recordCount; ++i) {
+		int x = (i % columns) * TILE_SIZE, y = (i / columns) * TILE_SIZE;
+		sprites.emplace_back(scene, frames, "idle", x, y, 1, 1.0);
+		OldSpriteRecord& old = oldRecords[sprites.back().getID()];
+		old.x = x;
+		old.y = y;
+		old.zlayer = 1;
+		old.scale = 1.0;
+		old.graphics = &frames;
+		old.order = frames.getOrder("idle");
+		old.animStart = 0;
+		old.phaseGroup = SPRITE_NO_ID;
+		old.parent = SPRITE_NO_ID;
+		old.firstChild = SPRITE_NO_ID;
+		old.nextSibling = SPRITE_NO_ID;
+		old.flags = 0;
+		old.isVisible = true;
+		old.isAlive = true;
+	}
+
+	// both go through the ids in the same order, so the only difference is the layout
+	Uint32 oldHits = 0, newHits = 0;
+	Uint64 start = SDL_GetPerformanceCounter();
+	for (int pass = 0; pass < passes; ++pass) {
+		for (const Sprite& sprite : sprites) {
+			const OldSpriteRecord& r = oldRecords[sprite.getID()];
+			oldHits += (r.isAlive && r.isVisible && r.parent == SPRITE_NO_ID && r.x >= view.x && r.x < view.x + view.w &&
+				r.y >= view.y && r.y < view.y + view.h);
+		}
+	}
+	double oldMs = msSince(start) / passes;
+
+	start = SDL_GetPerformanceCounter();
+	for (int pass = 0; pass < passes; ++pass) {
+		for (const Sprite& sprite : sprites) {
+			const SpriteRecord& r = scene.getSprite(sprite.getID());
+			newHits += ((r.flags & (SPRITE_ALIVE | SPRITE_VISIBLE)) == (SPRITE_ALIVE | SPRITE_VISIBLE) && r.parent == SPRITE_NO_ID &&
+				r.x >= view.x && r.x < view.x + view.w && r.y >= view.y && r.y < view.y + view.h);
+		}
+	}
+	double newMs = msSince(start) / passes;
+
+	printf("%d records\n", recordCount);
+	printf("old layout: %u bytes each, %.1f MB, culling pass %.2f ms (%u hits)\n", (unsigned)sizeof(OldSpriteRecord),
+		sizeof(OldSpriteRecord) * (double)recordCount / (1024 * 1024), oldMs, oldHits / passes);
+	printf("SpriteRecord: %u bytes each, %.1f MB, culling pass %.2f ms (%u hits)\n", (unsigned)sizeof(SpriteRecord),
+		sizeof(SpriteRecord) * (double)recordCount / (1024 * 1024), newMs, newHits / passes);
+	return 0;
+}
+
+/// <summary>
+/// --bench-sprites: spawns 100k Sprites, moves every one of them once a "tick" and builds the tick's
+/// DrawList, then throws them all away and spawns them again (which reuses the freed records).
+/// </summary>
+static int benchSprites(AssetManager& assets) {
+	const int spriteCount = 100000, ticks = 60;
+	AnimationManager scene;
+	scene.getCamera()->w = SCREEN_WIDTH;
+	scene.getCamera()->h = SCREEN_HEIGHT;
+	std::vector<Sprite> sprites;
+	sprites.reserve(spriteCount);
+	const AFrame& frames = assets.getAFrame("infantry");
+
+	Uint64 start = SDL_GetPerformanceCounter();
+	for (int i = 0; i < spriteCount; ++i) {
+		sprites.emplace_back(scene, frames, "idle", (i % 1000) * TILE_SIZE, (i / 1000) * TILE_SIZE, 1, 1.0);
+	}
+	double spawnMs = msSince(start);
+
+	double moveMs = 0, drawListMs = 0;
+	DrawList list;
+	for (int tick = 0; tick < ticks; ++tick) {
+		start = SDL_GetPerformanceCounter();
+		for (Sprite& sprite : sprites) {
+			sprite.moveX((tick % 2 == 0) ? 1 : -1);
+		}
+		moveMs += msSince(start);
+
+		start = SDL_GetPerformanceCounter();
+		list.clear();
+		scene.buildDrawList(list);
+		drawListMs += msSince(start);
+	}
+
+	start = SDL_GetPerformanceCounter();
+	sprites.clear();
+	double destroyMs = msSince(start);
+
+	start = SDL_GetPerformanceCounter();
+	for (int i = 0; i < spriteCount; ++i) {
+		sprites.emplace_back(scene, frames, "idle", (i % 1000) * TILE_SIZE, (i / 1000) * TILE_SIZE, 1, 1.0);
+	}
+	double respawnMs = msSince(start);
+
+	printf("%d Sprites\n", spriteCount);
+	printf("spawn: %.2f ms (%.1f ns each)\n", spawnMs, spawnMs * 1000000.0 / spriteCount);
+	printf("move all: %.3f ms a tick\n", moveMs / ticks);
+	printf("buildDrawList (%dx%d camera): %.3f ms a tick\n", SCREEN_WIDTH, SCREEN_HEIGHT, drawListMs / ticks);
+	printf("destroy: %.2f ms\n", destroyMs);
+	printf("spawn again: %.2f ms\n", respawnMs);
+	return 0;
+}
+
+/// <summary>
+/// --bench-drawlist: how buildDrawList scales with threads. Builds the same 200k Sprite scene (all of
+/// it on camera, so nothing gets culled) with no WorkerPool, then with pools of 2 to 16 threads.
+/// </summary>
+static int benchDrawList(AssetManager& assets) {
+	const int spriteCount = 200000, columns = 500, runs = 20;
+	const int threadCounts[] = { 1, 2, 4, 8, 12, 16 };
+	AnimationManager scene;
+	scene.getCamera()->w = columns * TILE_SIZE;
+	scene.getCamera()->h = (spriteCount / columns) * TILE_SIZE;
+	std::vector<Sprite> sprites;
+	sprites.reserve(spriteCount);
+	const AFrame& frames = assets.getAFrame("infantry");
+	for (int i = 0; i < spriteCount; ++i) {
+		sprites.emplace_back(scene, frames, "idle", (i % columns) * TILE_SIZE, (i / columns) * TILE_SIZE, i % 4, 1.0);
+	}
+
+	printf("%d Sprites, %d cores\n", spriteCount, SDL_GetCPUCount());
+	double singleMs = 0;
+	DrawList list;
+	for (int threads : threadCounts) {
+		// a pool of 1 would just be the caller, which is the same as not having one
+		WorkerPool* pool = (threads > 1) ? new WorkerPool(threads - 1) : NULL;
+		scene.setWorkerPool(pool);
+		list.clear();
+		scene.buildDrawList(list);
+
+		Uint64 start = SDL_GetPerformanceCounter();
+		for (int i = 0; i < runs; ++i) {
+			list.clear();
+			scene.buildDrawList(list);
+		}
+		double ms = msSince(start) / runs;
+		if (threads == 1) singleMs = ms;
+		printf("%2d thread%s: %.2f ms (%.2fx), %u draws\n", threads, (threads == 1) ? " " : "s", ms, singleMs / ms,
+			(unsigned)list.size());
+
+		scene.setWorkerPool(NULL);
+		delete pool;
+	}
+	return 0;
+}
+
+/// <summary>
+/// --bench-map-load: writes a 4096x4096 text map, converts it to a binary one, and times loading each
+/// (MapFile on its own, then a whole Layer). The files go next to the executable and get deleted after.
+/// </summary>
+static int benchMapLoad(AssetManager& assets, SDL_Renderer* renderer, const std::string& basePath) {
+	const int size = 4096, runs = 3;
+	const char* paletteNames[] = { "grass0", "infantry", "mech", "recon", "apc", "artillery", "light_tank", "heavy_tank" };
+	const int paletteSize = (int)(sizeof(paletteNames) / sizeof(paletteNames[0]));
+	std::string textPath = basePath + "bench_map.txt", binaryPath = basePath + "bench_map.map";
+
+	// patches of 8x8 Tiles, so it's not all one palette entry
+	std::string text = "MAPFILE\nBenchmark\n" + std::to_string(size) + " x " + std::to_string(size) + "\nzlayer -1\nPalette {\n";
+	for (int i = 0; i < paletteSize; ++i) {
+		text += std::to_string(i) + "\t" + paletteNames[i] + "::idle\n";
+	}
+	// the closing brace has a tab after it, like the hand-made maps
+	text += "}\t\n";
+	for (int y = 0; y < size; ++y) {
+		for (int x = 0; x < size; ++x) {
+			text += (char)('0' + ((x / 8) * 7 + (y / 8) * 3) % paletteSize);
+			text += (x + 1 < size) ? '\t' : '\n';
+		}
+	}
+	std::ofstream textFile(textPath, std::ios::binary);
+	textFile.write(text.data(), text.size());
+	textFile.close();
+	MapFile map;
+	if (!textFile || !map.loadText(textPath) || !map.saveBinary(binaryPath)) {
+		printf("Could not make a map to benchmark with.\n");
+		return 1;
+	}
+
+	bool isLoaded = true;
+	auto timeLoads = [&isLoaded, runs](const std::function<bool(MapFile&)>& load) {
+		double ms = 0;
+		// once first so both formats start with the file cached
+		MapFile warm;
+		isLoaded = load(warm) && isLoaded;
+		for (int i = 0; i < runs; ++i) {
+			MapFile map;
+			Uint64 start = SDL_GetPerformanceCounter();
+			isLoaded = load(map) && isLoaded;
+			ms += msSince(start);
+		}
+		return ms / runs;
+	};
+	double textMs = timeLoads([&textPath](MapFile& map) { return map.loadText(textPath); });
+	double binaryMs = timeLoads([&binaryPath](MapFile& map) { return map.loadBinary(binaryPath); });
+
+	AnimationManager scene;
+	Uint64 start = SDL_GetPerformanceCounter();
+	{
+		Layer layer(assets, scene, renderer, textPath);
+	}
+	double textLayerMs = msSince(start);
+	start = SDL_GetPerformanceCounter();
+	{
+		Layer layer(assets, scene, renderer, binaryPath);
+	}
+	double binaryLayerMs = msSince(start);
+
+	remove(textPath.c_str());
+	remove(binaryPath.c_str());
+	if (!isLoaded) {
+		printf("Could not load the benchmark map back.\n");
+		return 1;
+	}
+
+	printf("%dx%d map, %u palette entries\n", size, size, (unsigned)map.getPalette().size());
+	printf("MapFile::loadText (from_chars): %.1f ms\n", textMs);
+	printf("MapFile::loadBinary (mapped): %.2f ms\n", binaryMs);
+	printf("Layer from the text map: %.1f ms\n", textLayerMs);
+	printf("Layer from the binary map: %.1f ms\n", binaryLayerMs);
+	return 0;
+}
+
+/// <summary>
+/// --bench-picking: a 200k Sprite scene, plus a few Sprites big enough to skip SpritePicker's grid.
+/// Times a full (unculled) buildDrawList next to a SpritePicker::rebuild, since both happen once a
+/// tick, then a rebuild with nothing changed, and then how long one pick takes on average.
+/// </summary>
+static int benchPicking(AssetManager& assets) {
+	const int spriteCount = 200000, largeCount = 30, worldSize = 64000, runs = 10, picks = 1000000;
+	AnimationManager scene;
+	std::vector<Sprite> sprites;
+	sprites.reserve(spriteCount + largeCount);
+	std::mt19937 random(7);
+	const AFrame& frames = assets.getAFrame("infantry");
+	for (int i = 0; i < spriteCount; ++i) {
+		sprites.emplace_back(scene, frames, "idle", (int)(random() % worldSize), (int)(random() % worldSize), (int)(random() % 3),
+			0.5 + (random() % 3) * 0.5);
+	}
+	for (int i = 0; i < largeCount; ++i) {
+		sprites.emplace_back(scene, frames, "idle", (int)(random() % worldSize), (int)(random() % worldSize), (int)(random() % 3),
+			10.0 + random() % 40);
+	}
+	scene.getCamera()->w = worldSize;
+	scene.getCamera()->h = worldSize;
+
+	DrawList list;
+	scene.buildDrawList(list);
+	Uint64 start = SDL_GetPerformanceCounter();
+	for (int i = 0; i < runs; ++i) {
+		list.clear();
+		scene.buildDrawList(list);
+	}
+	double drawListMs = msSince(start) / runs;
+
+	// one Sprite moves before each rebuild, or it wouldn't do anything
+	SpritePicker picker(scene);
+	picker.rebuild();
+	start = SDL_GetPerformanceCounter();
+	for (int i = 0; i < runs; ++i) {
+		sprites[i].moveX((i % 2 == 0) ? 1 : -1);
+		picker.rebuild();
+	}
+	double rebuildMs = msSince(start) / runs;
+
+	start = SDL_GetPerformanceCounter();
+	for (int i = 0; i < runs; ++i) {
+		picker.rebuild();
+	}
+	double unchangedMs = msSince(start) / runs;
+
+	Uint32 hits = 0;
+	start = SDL_GetPerformanceCounter();
+	for (int i = 0; i < picks; ++i) {
+		hits += (picker.pick((int)(random() % worldSize), (int)(random() % worldSize)) != SPRITE_NO_ID);
+	}
+	double pickNs = msSince(start) * 1000000.0 / picks;
+
+	printf("%d Sprites (%d of them large), cells %dpx\n", (int)picker.getSpriteCount(), largeCount, picker.getCellSize());
+	printf("buildDrawList: %.2f ms\n", drawListMs);
+	printf("SpritePicker::rebuild: %.2f ms (%.4f ms with nothing changed)\n", rebuildMs, unchangedMs);
+	printf("SpritePicker::pick: %.1f ns (%u of %d hit something)\n", pickNs, hits, picks);
+	return 0;
+}
+
+/// <summary>
+/// Runs one of the --bench modes. They need real textures, so this starts SDL with a hidden window and
+/// a software renderer (so it's the same on any machine) and loads the assets like the game does.
+/// </summary>
+static int runBenchmark(const std::string& mode) {
+	if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_TIMER) < 0) {
+		printf("SDL could not initialize. SDL_Error: %s\n", SDL_GetError());
+		return 1;
+	}
+	IMG_Init(IMG_INIT_PNG);
+
+	int result = 1;
+	SDL_Window* window = SDL_CreateWindow("Benchmark", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, SCREEN_WIDTH, SCREEN_HEIGHT, SDL_WINDOW_HIDDEN);
+	SDL_Renderer* renderer = (window == NULL) ? NULL : SDL_CreateRenderer(window, -1, SDL_RENDERER_SOFTWARE);
+	if (renderer == NULL) {
+		printf("Could not make a renderer to benchmark with. SDL_Error: %s\n", SDL_GetError());
+	}
+	else {
+		char* c_basePath = SDL_GetBasePath();
+		std::string basePath = (c_basePath == NULL) ? "" : c_basePath;
+		SDL_free(c_basePath);
+
+		// in its own scope so the textures go before the renderer does
+		AssetManager assets;
+		if (assets.loadAssets(renderer, basePath + "assets\\") != 0) {
+			printf("Could not load assets to benchmark with.\n");
+		}
+		else if (mode == "--bench-map-load") {
+			result = benchMapLoad(assets, renderer, basePath);
+		}
+		else if (mode == "--bench-sprites") {
+			result = benchSprites(assets);
+		}
+		else if (mode == "--bench-drawlist") {
+			result = benchDrawList(assets);
+		}
+		else if (mode == "--bench-records") {
+			result = benchRecords(assets);
+		}
+		else if (mode == "--bench-picking") {
+			result = benchPicking(assets);
+		}
+		else {
+			printf("Unknown benchmark %s.\n", mode.c_str());
+		}
+	}
+
+	if (renderer != NULL) SDL_DestroyRenderer(renderer);
+	if (window != NULL) SDL_DestroyWindow(window);
+	IMG_Quit();
+	SDL_Quit();
+	return result;
+}
+
+/// <summary>
+/// Reads a whole command line argument as a base 10 number in [min, max]. Anything else (empty,
+/// trailing junk, out of range) is false, unlike atoi, which makes 0 out of garbage.
+/// </summary>
+static bool parseArgument(const char* text, long long min, long long max, long long* value) {
+	char* end = NULL;
+	errno = 0;
+	long long parsed = std::strtoll(text, &end, 10);
+	if (end == text || *end != '\0' || errno == ERANGE || parsed < min || parsed > max) return false;
+	*value = parsed;
+	return true;
+}
+
 int main(int argc, char* args[]) {
+
+	// TRPG_Refactor --convert-map <text map> <binary map>
+	// turns a text map into a binary one, which loads a lot faster. Doesn't need SDL started.
+	if (argc == 4 && std::string(args[1]) == "--convert-map") {
+		MapFile map;
+		if (!map.loadText(args[2]) || !map.saveBinary(args[3])) {
+			printf("Could not convert %s.\n", args[2]);
+			return 1;
+		}
+		printf("Converted %s (%dx%d, %u palette entries) to %s.\n", args[2], map.getWidth(), map.getHeight(),
+			(unsigned)map.getPalette().size(), args[3]);
+		return 0;
+	}
+
+	// TRPG_Refactor --generate-scene <width> <height> <units> <seed> <map> [<units file>]
+	// makes a random map (and units) out of everything in objects.txt, for stress testing. Maps ending
+	// in .txt are written as text, anything else as binary. Doesn't need SDL started either.
+	if ((argc == 7 || argc == 8) && std::string(args[1]) == "--generate-scene") {
+		long long width, height, unitCount, seed;
+		if (!parseArgument(args[2], 1, INT_MAX, &width) || !parseArgument(args[3], 1, INT_MAX, &height) ||
+			!parseArgument(args[4], 0, INT_MAX, &unitCount) || !parseArgument(args[5], 0, UINT32_MAX, &seed) ||
+			(Uint64)width * height > MAPFILE_MAX_CELLS) {
+			printf("Usage: %s --generate-scene <width> <height> <units> <seed> <map> [<units file>]\n", args[0]);
+			printf("width and height have to be at least 1, with width * height at most %llu, units at least 0, and seed a number from 0 to %u.\n",
+				(unsigned long long)MAPFILE_MAX_CELLS, (unsigned)UINT32_MAX);
+			return 1;
+		}
+
+		SceneSettings settings;
+		settings.width = (int)width;
+		settings.height = (int)height;
+		settings.unitCount = (int)unitCount;
+		settings.seed = (Uint32)seed;
+		settings.name = "Generated " + std::to_string(settings.width) + "x" + std::to_string(settings.height);
+		settings.zlayer = -1;
+		settings.paletteSize = 8;
+		settings.patchSize = 8;
+		settings.noise = 0.1;
+
+		char* c_basePath = SDL_GetBasePath();
+		std::string basePath = (c_basePath == NULL) ? "" : c_basePath;
+		SDL_free(c_basePath);
+
+		SceneGenerator generator;
+		MapFile map;
+		std::vector<SceneUnit> units;
+		std::string mapPath = args[6];
+		bool isText = mapPath.size() >= 4 && mapPath.compare(mapPath.size() - 4, 4, ".txt") == 0;
+		if (!generator.loadCandidates(basePath + "assets\\objects.txt") || !generator.generate(settings, map, units) ||
+			!(isText ? map.saveText(mapPath) : map.saveBinary(mapPath)) || (argc == 8 && !SceneGenerator::saveUnits(args[7], units))) {
+			printf("Could not generate a scene.\n");
+			return 1;
+		}
+		printf("Generated a %dx%d map with %u palette entries and %d units.\n", map.getWidth(), map.getHeight(),
+			(unsigned)map.getPalette().size(), (int)units.size());
+		return 0;
+	}
+
+	// TRPG_Refactor --bench-<name>
+	// times something on a made up scene and prints the results. See runBenchmark for the names.
+	if (argc == 2 && std::string(args[1]).compare(0, 8, "--bench-") == 0) {
+		return runBenchmark(args[1]);
+	}
 	
 	SDL_Window* window = NULL;
 	SDL_Renderer* renderer = NULL;
@@ -29,6 +578,11 @@ int main(int argc, char* args[]) {
 	}
 	else {
 
+		// we submit sprites grouped by texture, so let SDL merge those runs into single draws
+		if (SDL_SetHint(SDL_HINT_RENDER_BATCHING, "1") == SDL_FALSE) {
+			printf("Render batching hint could not be set.\n");
+		}
+
 		if ((window = SDL_CreateWindow("Witty title", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, SCREEN_WIDTH, SCREEN_HEIGHT, SDL_WINDOW_SHOWN | SDL_WINDOW_RESIZABLE)) == NULL) {
 			printf("Window could not be created. SDL_Error: %s\n", SDL_GetError());
 		}
@@ -66,33 +620,43 @@ int main(int argc, char* args[]) {
 				return -1;
 			}
 
+			// helpers for splitting up draw-list building once scenes get big
+			WorkerPool workers;
+
+			// the battle map scene. Declared before anything that lives in it,
+			// so it outlives all of its Sprites
+			AnimationManager battleScene;
+			battleScene.setWorkerPool(&workers);
+			TweenManager battleTweens(battleScene);
+			ParticleSystem battleParticles(battleScene);
+
 			std::vector<Sprite> sprites;
 
 			//printf("Assets loaded. Preparing to create Sprites...\n");
 			
-			sprites.emplace_back(assets.getAFrame("anti_air"), "idle");
-			sprites.emplace_back(assets.getAFrame("apc"),"idle");
-			sprites.emplace_back(assets.getAFrame("artillery"),"idle");
-			sprites.emplace_back(assets.getAFrame("battle_copter"),"idle");
-			sprites.emplace_back(assets.getAFrame("battleship"),"idle");
-			sprites.emplace_back(assets.getAFrame("bomber"),"idle");
-			sprites.emplace_back(assets.getAFrame("carrier"),"idle");
-			sprites.emplace_back(assets.getAFrame("cruiser"),"idle");
-			sprites.emplace_back(assets.getAFrame("fighter"),"idle");
-			sprites.emplace_back(assets.getAFrame("heavy_tank"),"idle");
-			sprites.emplace_back(assets.getAFrame("hidden_stealth_fighter"),"idle");
-			sprites.emplace_back(assets.getAFrame("infantry"),"idle");
-			sprites.emplace_back(assets.getAFrame("lander"),"idle");
-			sprites.emplace_back(assets.getAFrame("light_tank"),"idle");
-			sprites.emplace_back(assets.getAFrame("mech"),"idle");
-			sprites.emplace_back(assets.getAFrame("medium_tank"),"idle");
-			sprites.emplace_back(assets.getAFrame("missile"),"idle");
-			sprites.emplace_back(assets.getAFrame("recon"),"idle");
-			sprites.emplace_back(assets.getAFrame("rocket"),"idle");
-			sprites.emplace_back(assets.getAFrame("stealth_fighter"),"idle");
-			sprites.emplace_back(assets.getAFrame("submarine"),"idle");
-			sprites.emplace_back(assets.getAFrame("submerged_submarine"),"idle");
-			sprites.emplace_back(assets.getAFrame("transport_copter"),"idle");
+			sprites.emplace_back(battleScene, assets.getAFrame("anti_air"), "idle");
+			sprites.emplace_back(battleScene, assets.getAFrame("apc"),"idle");
+			sprites.emplace_back(battleScene, assets.getAFrame("artillery"),"idle");
+			sprites.emplace_back(battleScene, assets.getAFrame("battle_copter"),"idle");
+			sprites.emplace_back(battleScene, assets.getAFrame("battleship"),"idle");
+			sprites.emplace_back(battleScene, assets.getAFrame("bomber"),"idle");
+			sprites.emplace_back(battleScene, assets.getAFrame("carrier"),"idle");
+			sprites.emplace_back(battleScene, assets.getAFrame("cruiser"),"idle");
+			sprites.emplace_back(battleScene, assets.getAFrame("fighter"),"idle");
+			sprites.emplace_back(battleScene, assets.getAFrame("heavy_tank"),"idle");
+			sprites.emplace_back(battleScene, assets.getAFrame("hidden_stealth_fighter"),"idle");
+			sprites.emplace_back(battleScene, assets.getAFrame("infantry"),"idle");
+			sprites.emplace_back(battleScene, assets.getAFrame("lander"),"idle");
+			sprites.emplace_back(battleScene, assets.getAFrame("light_tank"),"idle");
+			sprites.emplace_back(battleScene, assets.getAFrame("mech"),"idle");
+			sprites.emplace_back(battleScene, assets.getAFrame("medium_tank"),"idle");
+			sprites.emplace_back(battleScene, assets.getAFrame("missile"),"idle");
+			sprites.emplace_back(battleScene, assets.getAFrame("recon"),"idle");
+			sprites.emplace_back(battleScene, assets.getAFrame("rocket"),"idle");
+			sprites.emplace_back(battleScene, assets.getAFrame("stealth_fighter"),"idle");
+			sprites.emplace_back(battleScene, assets.getAFrame("submarine"),"idle");
+			sprites.emplace_back(battleScene, assets.getAFrame("submerged_submarine"),"idle");
+			sprites.emplace_back(battleScene, assets.getAFrame("transport_copter"),"idle");
 
 			sprites[1].setX(64);
 			sprites[2].setX(128);
@@ -131,30 +695,65 @@ int main(int argc, char* args[]) {
 			sprites[21].setY(192);
 			sprites[22].setY(192);
 
+			// idle units of the same type bob up and down together
+			for (Sprite& s : sprites) {
+				s.setSynchronized(true);
+			}
+
 			//printf("All sprites set. Preparing Layer test...\n");
 
 			// Layer test
-			Layer testLayer(assets, basePath + "assets\\testmap1.txt");
+			// roads, rivers and shores pick their look from their neighbors. Has to outlive the Layers using it.
+			AutotileSet autotiles;
+			Layer testLayer(assets, battleScene, renderer, basePath + "assets\\testmap1.txt");
+			if (autotiles.load(assets, basePath + "assets\\autotiles.txt")) testLayer.setAutotiles(&autotiles);
+			// the map's Layers get flattened into one texture that's only redrawn where it changes
+			LayerStack battleMap(battleScene, renderer, SCREEN_WIDTH, SCREEN_HEIGHT, -1);
+			battleMap.addLayer(testLayer);
+			// one texel per Tile (or square of Tiles, on big maps) in the top right corner, with a dot for each unit
+			Minimap battleMinimap(battleScene, renderer, testLayer, { SCREEN_WIDTH - 210, 10, 200, 180 }, 1000);
+			for (Sprite& s : sprites) {
+				battleMinimap.addUnit(s, { 255, 255, 255, 255 });
+			}
 
-			SDL_Rect* camera = Sprite::getAnimCamera();
+			SDL_Rect* camera = battleScene.getCamera();
 			camera->x = 0;
 			camera->y = 0;
 			camera->w = SCREEN_WIDTH;
 			camera->h = SCREEN_HEIGHT;
+			// anything drawn smaller than a quarter tile doesn't need smooth animation
+			battleScene.setAnimationLOD(TILE_SIZE / 4, 500);
+			// zoomed out to where units would be that small anyway, they turn into plain icons
+			battleScene.setIconLOD(0.25, TILE_SIZE / 4);
 
 			int displayHeight = SCREEN_HEIGHT, displayWidth = SCREEN_WIDTH;
 
 			SDL_SetRenderTarget(renderer, resBuffer);
 
-			// TODO: the goal is to make this class invisible to
-			// the caller. That will come with removing rendering
-			// from the game loop and putting it somewhere else!
-			AnimationManager& animator{ Sprite::getAnimator() };
-
 			// isVisible test
 			// sprites[3].setVisible(false);
 			// testLayer.setVisible(false);
 
+			// From here on the game thread owns all the Sprites and Layers above; this thread
+			// just polls events and presents whatever DrawList it was last handed.
+			DrawListExchange exchange;
+			GameThreadData gameData;
+			gameData.scenes.push_back(&battleScene);
+			gameData.tweens.push_back(&battleTweens);
+			gameData.particles.push_back(&battleParticles);
+			gameData.exchange = &exchange;
+			SDL_AtomicSet(&gameData.isQuit, 0);
+			gameData.zoomScene = &battleScene;
+			SDL_AtomicSet(&gameData.wheelClicks, 0);
+			SDL_AtomicSet(&gameData.wheelX, 0);
+			SDL_AtomicSet(&gameData.wheelY, 0);
+
+			SDL_Thread* gameThread = SDL_CreateThread(gameLoop, "game", &gameData);
+			if (gameThread == NULL) {
+				printf("Game thread could not be created. SDL_Error: %s\n", SDL_GetError());
+				return -1;
+			}
+
 			while (true) {
 				// poll event
 				SDL_Event event;
@@ -162,6 +761,17 @@ int main(int argc, char* args[]) {
 				while (SDL_PollEvent(&event)) {
 					if (event.type == SDL_KEYDOWN && event.key.keysym.sym == SDLK_ESCAPE)
 						isQuit = true;
+					// the game thread does the zooming; we just pass the wheel on, with where the mouse is
+					// on the backbuffer (the middle, if it's on the black bars)
+					if (event.type == SDL_MOUSEWHEEL && event.wheel.y != 0) {
+						int clicks = (event.wheel.direction == SDL_MOUSEWHEEL_FLIPPED) ? -event.wheel.y : event.wheel.y;
+						int windowX, windowY, x = SCREEN_WIDTH / 2, y = SCREEN_HEIGHT / 2;
+						SDL_GetMouseState(&windowX, &windowY);
+						GE_WindowToBackbuffer(SCREEN_WIDTH, SCREEN_HEIGHT, displayWidth, displayHeight, windowX, windowY, &x, &y);
+						SDL_AtomicSet(&gameData.wheelX, x);
+						SDL_AtomicSet(&gameData.wheelY, y);
+						SDL_AtomicAdd(&gameData.wheelClicks, clicks);
+					}
 					if (event.type == SDL_WINDOWEVENT && event.window.event == SDL_WINDOWEVENT_RESIZED) {
 						displayHeight = event.window.data2;
 						displayWidth = event.window.data1;
@@ -171,20 +781,19 @@ int main(int argc, char* args[]) {
 				SDL_SetRenderDrawColor(renderer, 50, 20, 20, 255);
 				SDL_RenderClear(renderer);
 
-				//printf("Preparing to update Sprites...\n");
-
-				// TODO: Ideally rendering should happen independently of game logic
-				// at some point. One step (though only *one* step!) is putting this
-				// into an SDL_Timer callback.
-				animator.updateSprites();
-
-				//printf("Done. Rendering backbuffer...\n");
+				// if the game thread is busy this just redraws the last frame it gave us,
+				// so a slow game step never stalls presentation (and vice versa)
+				exchange.submitLatest(renderer);
 
 				GE_PushFromBackbuffer(renderer, resBuffer, displayHeight, displayWidth);
 
 				if (isQuit) break;
 			}
 
+			SDL_AtomicSet(&gameData.isQuit, 1);
+			exchange.stop();
+			SDL_WaitThread(gameThread, NULL);
+
 			SDL_DestroyTexture(resBuffer);
 			SDL_DestroyRenderer(renderer);
 			SDL_DestroyWindow(window);
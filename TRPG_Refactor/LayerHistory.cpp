@@ -0,0 +1,193 @@
+#include <stdio.h>
+#include <vector>
+#include <deque>
+#include <algorithm>
+#include <iterator>
+
+#include <SDL.h>
+
+#include "Tiles.h"
+#include "LayerHistory.h"
+
+/// <summary>
+/// Starts recording every edit made to layer.
+/// </summary>
+/// <param name="layer">The Layer to record. Can only have one LayerHistory at a time.</param>
+/// <param name="maxBytes">Roughly how much memory the steps can take before old ones get merged.</param>
+LayerHistory::LayerHistory(Layer& layer, size_t maxBytes) :
+	layer{ layer },
+	maxBytes{ maxBytes },
+	usedBytes{ 0 },
+	done{ },
+	undone{ },
+	open{ },
+	isStepOpen{ false }
+{
+	layer.setEditRecorder([this](const std::vector<LayerCellChange>& changes) {
+		onEdit(changes);
+		});
+}
+
+LayerHistory::~LayerHistory() {
+	layer.setEditRecorder(LayerEditRecorder());
+}
+
+void LayerHistory::beginStep() {
+	// steps don't nest
+	if (isStepOpen) endStep();
+	isStepOpen = true;
+}
+
+void LayerHistory::endStep() {
+	if (!isStepOpen) return;
+	isStepOpen = false;
+	if (open.empty()) return;
+	LayerHistoryStep step = encode(open);
+	open.clear();
+	pushDone(step);
+}
+
+bool LayerHistory::undo() {
+	// a stroke that's still going gets undone as far as it got
+	endStep();
+	if (done.empty()) return false;
+
+	LayerHistoryStep step = std::move(done.back());
+	done.pop_back();
+	std::vector<LayerCellChange> changes;
+	decode(step, changes);
+	layer.applyChanges(changes, true);
+	undone.push_back(std::move(step));
+	return true;
+}
+
+bool LayerHistory::redo() {
+	endStep();
+	if (undone.empty()) return false;
+
+	LayerHistoryStep step = std::move(undone.back());
+	undone.pop_back();
+	std::vector<LayerCellChange> changes;
+	decode(step, changes);
+	layer.applyChanges(changes, false);
+	done.push_back(std::move(step));
+	return true;
+}
+
+void LayerHistory::clear() {
+	done.clear();
+	undone.clear();
+	open.clear();
+	usedBytes = 0;
+}
+
+void LayerHistory::onEdit(const std::vector<LayerCellChange>& changes) {
+	// anything undone is gone for good once something new happens
+	for (const LayerHistoryStep& step : undone) {
+		usedBytes -= getSize(step);
+	}
+	undone.clear();
+
+	open.insert(open.end(), changes.begin(), changes.end());
+	if (isStepOpen) return;
+	LayerHistoryStep step = encode(open);
+	open.clear();
+	pushDone(step);
+}
+
+void LayerHistory::pushDone(LayerHistoryStep& step) {
+	if (step.runs.empty()) return;
+	usedBytes += getSize(step);
+	done.push_back(std::move(step));
+	trim();
+}
+
+/// <summary>
+/// Turns changes into a step. A cell that changed more than once goes from what it was before the first
+/// change to what it was after the last, and a cell that ended up back where it started is left out.
+/// </summary>
+/// <param name="changes">In the order they happened. Gets sorted.</param>
+LayerHistoryStep LayerHistory::encode(std::vector<LayerCellChange>& changes) const {
+	int width = layer.getWidth();
+	// stable, so changes to the same cell stay in the order they happened
+	std::stable_sort(changes.begin(), changes.end(), [width](const LayerCellChange& a, const LayerCellChange& b) {
+		return (Uint32)a.y * width + a.x < (Uint32)b.y * width + b.x;
+		});
+
+	LayerHistoryStep step;
+	step.cellCount = 0;
+	for (size_t i = 0; i < changes.size();) {
+		Uint32 cell = (Uint32)changes[i].y * width + changes[i].x;
+		Uint16 from = changes[i].from, to = changes[i].to;
+		size_t next = i + 1;
+		while (next < changes.size() && (Uint32)changes[next].y * width + changes[next].x == cell) {
+			to = changes[next].to;
+			++next;
+		}
+		i = next;
+		if (from == to) continue;
+
+		if (!step.runs.empty()) {
+			LayerHistoryRun& last = step.runs.back();
+			if (last.start + last.length == cell && last.from == from && last.to == to && last.length < LAYERHISTORY_MAX_RUN) {
+				++last.length;
+				++step.cellCount;
+				continue;
+			}
+		}
+		step.runs.push_back(LayerHistoryRun{ cell, 1, from, to });
+		++step.cellCount;
+	}
+	step.runs.shrink_to_fit();
+	return step;
+}
+
+void LayerHistory::decode(const LayerHistoryStep& step, std::vector<LayerCellChange>& changes) const {
+	int width = layer.getWidth();
+	changes.reserve(changes.size() + step.cellCount);
+	for (const LayerHistoryRun& run : step.runs) {
+		for (Uint32 cell = run.start; cell < run.start + run.length; ++cell) {
+			changes.push_back(LayerCellChange{ (int)(cell % width), (int)(cell / width), run.from, run.to });
+		}
+	}
+}
+
+/// <summary>
+/// Both steps' cells are already in order, so this is one pass over the two of them side by side.
+/// </summary>
+LayerHistoryStep LayerHistory::merge(const LayerHistoryStep& first, const LayerHistoryStep& second) const {
+	std::vector<LayerCellChange> a, b, both;
+	decode(first, a);
+	decode(second, b);
+	both.reserve(a.size() + b.size());
+	// equal cells come out first then second, which is what encode folds together
+	std::merge(a.begin(), a.end(), b.begin(), b.end(), std::back_inserter(both),
+		[](const LayerCellChange& l, const LayerCellChange& r) {
+			return (l.y != r.y) ? l.y < r.y : l.x < r.x;
+		});
+	return encode(both);
+}
+
+size_t LayerHistory::getSize(const LayerHistoryStep& step) {
+	return sizeof(LayerHistoryStep) + step.runs.capacity() * sizeof(LayerHistoryRun);
+}
+
+void LayerHistory::trim() {
+	// the newest step always stays, so the edit that was just made can be undone
+	while (usedBytes > maxBytes && done.size() > 1) {
+		size_t pairSize = getSize(done[0]) + getSize(done[1]);
+		if (done.size() > 2) {
+			LayerHistoryStep merged = merge(done[0], done[1]);
+			// steps that barely overlap would just snowball into one huge step, so those get dropped instead
+			if (getSize(merged) <= pairSize - pairSize / LAYERHISTORY_MIN_MERGE_SAVING) {
+				usedBytes -= pairSize;
+				usedBytes += getSize(merged);
+				done.pop_front();
+				done.front() = std::move(merged);
+				continue;
+			}
+		}
+		usedBytes -= getSize(done.front());
+		done.pop_front();
+	}
+}
@@ -0,0 +1,103 @@
+#ifndef LAYERHISTORY_H
+#define LAYERHISTORY_H
+
+#include <vector>
+#include <deque>
+
+#include <SDL.h>
+
+#include "Tiles.h"
+
+// how much memory a LayerHistory lets its undo steps take by default, in bytes
+#define LAYERHISTORY_DEFAULT_MAX_BYTES	(4 * 1024 * 1024)
+// the oldest two steps are only merged if that saves at least 1 / this of what they take; otherwise
+// the oldest is dropped
+#define LAYERHISTORY_MIN_MERGE_SAVING	4
+// longest LayerHistoryRun, so lengths fit in 16 bits
+#define LAYERHISTORY_MAX_RUN			0xFFFF
+
+/// <summary>
+/// LayerHistoryRun -- length cells in a row (going by [y * width + x], so runs can wrap onto the next
+/// row) that all went from one palette index to the same other one.
+/// </summary>
+typedef struct lhr_ {
+	Uint32 start;
+	Uint16 length;
+	Uint16 from;
+	Uint16 to;
+} LayerHistoryRun;
+
+/// <summary>
+/// LayerHistoryStep -- everything one undo puts back, as runs sorted by start that don't overlap.
+/// </summary>
+typedef struct lhs_ {
+	std::vector<LayerHistoryRun> runs;
+	// how many cells the runs cover
+	size_t cellCount;
+} LayerHistoryStep;
+
+/// <summary>
+/// LayerHistory -- unlimited (well, up to a memory cap) undo and redo for a Layer, for map editors.
+///
+/// Instead of snapshotting the map, each step keeps only the cells it changed, as run-length encoded
+/// diffs between palette indices. A brush stroke across plain grass is a run or two per row, so a step
+/// costs about as much as the stroke, however big the map is, and undoing or redoing one only touches
+/// the cells it changed. Autotiling the edit caused is part of the step too, so undo puts back exactly
+/// what was there.
+///
+/// Once the steps take more than maxBytes, the oldest two are merged into one, which is smaller
+/// whenever they changed some of the same cells (painting over the same area again and again, say).
+/// So old history gets coarser rather than vanishing. Steps that don't overlap enough for merging to
+/// save much are dropped instead, oldest first.
+///
+/// Edits to pages that aren't loaded yet aren't recorded (see Layer::setEditRecorder). Has to go away
+/// before its Layer does, and everything runs on the game thread, like Layer edits.
+/// </summary>
+class LayerHistory {
+
+public:
+	LayerHistory(Layer& layer, size_t maxBytes = LAYERHISTORY_DEFAULT_MAX_BYTES);
+	~LayerHistory();
+	// we're registered with the layer by address
+	LayerHistory(const LayerHistory&) = delete;
+	LayerHistory& operator=(const LayerHistory&) = delete;
+
+	// every edit until endStep is one step, for brush strokes and the like. Otherwise each edit is its own.
+	void beginStep();
+	void endStep();
+	// each returns false if there was nothing to undo (or redo)
+	bool undo();
+	bool redo();
+	bool canUndo() const { return !done.empty() || !open.empty(); }
+	bool canRedo() const { return !undone.empty(); }
+	void clear();
+	// how many bytes the steps take up right now
+	size_t getMemoryUsage() const { return usedBytes; }
+	size_t getUndoCount() const { return done.size(); }
+
+private:
+	// our LayerEditRecorder
+	void onEdit(const std::vector<LayerCellChange>& changes);
+	// sorts changes, folds together ones to the same cell, and run-length encodes them
+	LayerHistoryStep encode(std::vector<LayerCellChange>& changes) const;
+	void decode(const LayerHistoryStep& step, std::vector<LayerCellChange>& changes) const;
+	// one step that does what first and then second do
+	LayerHistoryStep merge(const LayerHistoryStep& first, const LayerHistoryStep& second) const;
+	static size_t getSize(const LayerHistoryStep& step);
+	// merges (or drops) the oldest steps until we're under maxBytes
+	void trim();
+	void pushDone(LayerHistoryStep& step);
+
+	Layer& layer;
+	size_t maxBytes;
+	size_t usedBytes;
+	// oldest first
+	std::deque<LayerHistoryStep> done;
+	std::vector<LayerHistoryStep> undone;
+	// what's been recorded since beginStep
+	std::vector<LayerCellChange> open;
+	bool isStepOpen;
+
+};
+
+#endif
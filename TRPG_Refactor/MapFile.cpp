@@ -0,0 +1,856 @@
+#include <stdio.h>
+#include <string>
+#include <fstream>
+#include <vector>
+#include <cstring>
+#include <unordered_map>
+#include <algorithm>
+#include <charconv>
+
+#include <SDL.h>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include "MapFile.h"
+
+// text maps with palette indices up to this (or up to 4 per entry, whichever's more) look them up
+// in a flat table instead of a hash map
+#define MAPR_DIRECT_INDEX_MAX	0x10000
+
+/// <summary>
+/// MapTextReader -- walks a text map that's been read into memory in one piece, keeping track of
+/// the line and column so errors can say exactly where things went wrong.
+/// </summary>
+class MapTextReader {
+
+public:
+	MapTextReader(const std::string& text, const std::string& path) :
+		at{ text.data() },
+		end{ text.data() + text.size() },
+		lineStart{ text.data() },
+		lastInt{ text.data() },
+		line{ 1 },
+		path{ path }
+	{}
+
+	// prints what went wrong and where, and returns false so callers can just return this
+	bool fail(const char* what) const {
+		return failAt(at, what);
+	}
+	// same, but points at the start of the number readInt just read
+	bool failAtLastInt(const char* what) const {
+		return failAt(lastInt, what);
+	}
+
+	bool isDone() const { return at == end; }
+	char peek() const { return (at == end) ? '\0' : *at; }
+
+	// skips literal if it's next; returns false (without moving) if it isn't
+	bool skip(const char* literal) {
+		size_t length = std::strlen(literal);
+		if ((size_t)(end - at) < length || std::memcmp(at, literal, length) != 0) return false;
+		at += length;
+		return true;
+	}
+
+	// spaces and tabs, but not newlines
+	void skipBlanks() {
+		while (at != end && (*at == ' ' || *at == '\t')) ++at;
+	}
+
+	// anything left on the line has to be blanks. Then moves to the start of the next one.
+	bool endLine() {
+		skipBlanks();
+		if (at != end && *at == '\r') ++at;
+		if (at == end) return true;
+		if (*at != '\n') return fail("expected the end of the line");
+		nextLine();
+		return true;
+	}
+
+	// the rest of the line, minus any blanks or \r at the end. Moves to the start of the next line.
+	std::string readLine() {
+		const char* start = at;
+		const char* newline = (const char*)std::memchr(at, '\n', end - at);
+		const char* stop = (newline == NULL) ? end : newline;
+		const char* last = stop;
+		while (last != start && (last[-1] == ' ' || last[-1] == '\t' || last[-1] == '\r')) --last;
+		at = stop;
+		if (at != end) nextLine();
+		return std::string(start, last);
+	}
+
+	bool readInt(int* value, const char* what) {
+		lastInt = at;
+		std::from_chars_result result = std::from_chars(at, end, *value);
+		// covers numbers too big for an int, too
+		if (result.ec != std::errc()) return fail(what);
+		at = result.ptr;
+		return true;
+	}
+
+	// skips empty lines; true if that was the rest of the file
+	bool isOnlyBlankLeft() {
+		while (at != end && (*at == ' ' || *at == '\t' || *at == '\r' || *at == '\n')) {
+			if (*at == '\n') nextLine();
+			else ++at;
+		}
+		return at == end;
+	}
+
+private:
+	bool failAt(const char* where, const char* what) const {
+		printf("ERROR: MapFile::loadText %s at %s:%d:%d.\n", what, path.c_str(), line, (int)(where - lineStart) + 1);
+		return false;
+	}
+
+	void nextLine() {
+		++at;
+		++line;
+		lineStart = at;
+	}
+
+	const char* at;
+	const char* end;
+	const char* lineStart;
+	const char* lastInt;
+	int line;
+	const std::string& path;
+
+};
+
+MapFile::MapFile() :
+	name{ },
+	width{ 0 },
+	height{ 0 },
+	zlayer{ 0 },
+	palette{ },
+	cells{ NULL },
+	ownedCells{ },
+	cellsOffset{ 0 },
+	mapping{ NULL },
+	mappingSize{ 0 }
+#ifdef _WIN32
+	, fileHandle{ NULL },
+	mappingHandle{ NULL }
+#endif
+{}
+
+MapFile::~MapFile() {
+	unmapFile();
+}
+
+void MapFile::clear() {
+	unmapFile();
+	name.clear();
+	width = 0;
+	height = 0;
+	zlayer = 0;
+	palette.clear();
+	cells = NULL;
+	ownedCells.clear();
+	cellsOffset = 0;
+}
+
+/// <summary>
+/// Loads a map in either format. Binary maps start with MAPFILE_MAGIC; anything else is treated as text.
+/// </summary>
+/// <param name="path">The map file.</param>
+/// <returns>true if it loaded.</returns>
+bool MapFile::load(const std::string& path) {
+	char magic[sizeof(MAPFILE_MAGIC)] = { 0 };
+	std::ifstream file{ path.c_str(), std::ios::binary };
+	if (!file) {
+		printf("ERROR: MapFile::load could not open map file at %s.\n", path.c_str());
+		return false;
+	}
+	file.read(magic, sizeof(magic));
+	file.close();
+
+	if (std::memcmp(magic, MAPFILE_MAGIC, sizeof(magic)) == 0) return loadBinary(path);
+	return loadText(path);
+}
+
+/// <summary>
+/// Loads a text MAPFILE. The whole file is read in one go and parsed in place, and the cells are
+/// allocated once, so this is about as fast as the disk. Palette indices in the file can be any
+/// non-negative numbers (and as many as 65536 of them); they're renumbered from 0 in the order
+/// they're listed. Anything malformed is reported with its line and column.
+/// </summary>
+/// <param name="path">The map file.</param>
+/// <returns>true if it loaded.</returns>
+bool MapFile::loadText(const std::string& path) {
+	clear();
+	if (!parseText(path)) {
+		// don't leave half a map lying around
+		clear();
+		return false;
+	}
+	return true;
+}
+
+bool MapFile::parseText(const std::string& path) {
+	std::string text;
+	std::ifstream mapFile{ path.c_str(), std::ios::binary };
+	if (!mapFile) {
+		printf("ERROR: MapFile::loadText could not load map file at %s.\n", path.c_str());
+		return false;
+	}
+	mapFile.seekg(0, std::ios::end);
+	std::streamoff size = mapFile.tellg();
+	mapFile.seekg(0, std::ios::beg);
+	if (size < 0) {
+		printf("ERROR: MapFile::loadText could not get the size of %s.\n", path.c_str());
+		return false;
+	}
+	text.resize((size_t)size);
+	if (!mapFile.read(&text[0], size)) {
+		printf("ERROR: MapFile::loadText could not read %s.\n", path.c_str());
+		return false;
+	}
+	mapFile.close();
+
+	MapTextReader reader{ text, path };
+	// editors like to put a BOM on the front
+	reader.skip("\xEF\xBB\xBF");
+
+	// make sure we're working with a real map file
+	if (!reader.skip("MAPFILE")) return reader.fail("didn't find the MAPFILE header");
+	if (!reader.endLine()) return false;
+
+	name = reader.readLine();
+
+	if (!reader.readInt(&width, "expected the map width")) return false;
+	reader.skipBlanks();
+	if (!reader.skip("x")) return reader.fail("expected an x between the width and height");
+	reader.skipBlanks();
+	if (!reader.readInt(&height, "expected the map height")) return false;
+	if (!reader.endLine()) return false;
+	if (width <= 0 || height <= 0) {
+		printf("ERROR: MapFile::loadText got a map with no Tiles at %s.\n", path.c_str());
+		return false;
+	}
+	// every Tile takes at least two characters, so this catches nonsense sizes before we try to allocate them
+	if ((Uint64)width * height > text.size() / 2 + 1) {
+		printf("ERROR: MapFile::loadText got a %d x %d map, which is bigger than the file at %s.\n", width, height, path.c_str());
+		return false;
+	}
+
+	if (!reader.skip("zlayer")) return reader.fail("expected the zlayer line");
+	reader.skipBlanks();
+	if (!reader.readInt(&zlayer, "expected the zlayer")) return false;
+	if (!reader.endLine()) return false;
+
+	if (!reader.skip("Palette")) return reader.fail("expected the palette");
+	reader.skipBlanks();
+	if (!reader.skip("{")) return reader.fail("expected a { to start the palette");
+	if (!reader.endLine()) return false;
+
+	// read palette entries, keeping track of which of our indices each of the file's is
+	std::vector<int> fileIndices;
+	while (!reader.skip("}")) {
+		if (reader.isDone()) return reader.fail("hit the end of the file inside the palette");
+		if (palette.size() >= 0x10000) return reader.fail("has more palette entries than 16 bit cells can use");
+
+		int index;
+		if (!reader.readInt(&index, "expected a palette index")) return false;
+		if (index < 0) return reader.failAtLastInt("got a negative palette index");
+		reader.skipBlanks();
+		std::string entry = reader.readLine();
+		size_t colonIndex = entry.find("::");
+		if (colonIndex == std::string::npos || colonIndex == 0 || colonIndex + 2 == entry.size()) {
+			// the line's already been read, so the position would be the start of the next one
+			printf("ERROR: MapFile::loadText hit invalid palette entry \"%s\" (should be asset::order) in %s.\n",
+				entry.c_str(), path.c_str());
+			return false;
+		}
+
+		MapPaletteName paletteName;
+		paletteName.asset = entry.substr(0, colonIndex);
+		paletteName.order = entry.substr(colonIndex + 2);
+		palette.push_back(paletteName);
+		fileIndices.push_back(index);
+	}
+	if (!reader.endLine()) return false;
+	if (palette.empty()) return reader.fail("got an empty palette");
+
+	// most maps number their palette 0, 1, 2..., so a flat table does the job. Otherwise, hash.
+	int highest = *std::max_element(fileIndices.begin(), fileIndices.end());
+	bool isDirect = highest < std::max<int>(MAPR_DIRECT_INDEX_MAX, 4 * (int)palette.size());
+	std::vector<Uint16> directIndices;
+	std::unordered_map<int, Uint16> hashedIndices;
+	if (isDirect) directIndices.assign((size_t)highest + 1, 0xFFFF);
+	for (size_t i = 0; i < fileIndices.size(); ++i) {
+		bool isNew = isDirect ? (directIndices[fileIndices[i]] == 0xFFFF) :
+			(hashedIndices.find(fileIndices[i]) == hashedIndices.end());
+		if (!isNew) {
+			printf("ERROR: MapFile::loadText got palette index %d twice in %s.\n", fileIndices[i], path.c_str());
+			return false;
+		}
+		if (isDirect) directIndices[fileIndices[i]] = (Uint16)i;
+		else hashedIndices.emplace(fileIndices[i], (Uint16)i);
+	}
+
+	// the only allocation the cells get
+	ownedCells.resize((size_t)width * height);
+	Uint16* cell = ownedCells.data();
+	for (int y = 0; y < height; ++y) {
+		if (reader.isDone()) return reader.fail("ran out of rows");
+		for (int x = 0; x < width; ++x) {
+			reader.skipBlanks();
+			int index;
+			if (!reader.readInt(&index, (x == 0) ? "expected a row of palette indices" : "ran out of Tiles in this row")) {
+				return false;
+			}
+			if (isDirect) {
+				if (index < 0 || index > highest || directIndices[index] == 0xFFFF) {
+					return reader.failAtLastInt("got a palette index that isn't in the palette");
+				}
+				*cell++ = directIndices[index];
+			}
+			else {
+				std::unordered_map<int, Uint16>::const_iterator found = hashedIndices.find(index);
+				if (found == hashedIndices.end()) return reader.failAtLastInt("got a palette index that isn't in the palette");
+				*cell++ = found->second;
+			}
+		}
+		if (!reader.endLine()) return false;
+	}
+	if (!reader.isOnlyBlankLeft()) return reader.fail("got more rows than the map's height");
+	cells = ownedCells.data();
+
+	return true;
+}
+
+/// <summary>
+/// Loads a binary map by mapping it into memory. The header and palette are checked and copied out;
+/// the cells are used where they are.
+/// </summary>
+/// <param name="path">The map file.</param>
+/// <returns>true if it loaded.</returns>
+bool MapFile::loadBinary(const std::string& path) {
+	clear();
+
+	size_t size = 0;
+	Uint8* data = (Uint8*)mapFile(path, &size);
+	if (data == NULL) return false;
+	if (!parseBinaryHeader(data, size, size, path)) {
+		clear();
+		return false;
+	}
+	Uint64 cellCount = (Uint64)width * height;
+
+#if SDL_BYTEORDER == SDL_LIL_ENDIAN
+	cells = (Uint16*)(data + cellsOffset);
+#else
+	// the cells are little endian, so they can't be used in place here
+	ownedCells.resize((size_t)cellCount);
+	std::memcpy(ownedCells.data(), data + cellsOffset, (size_t)cellCount * sizeof(Uint16));
+	for (Uint16& cell : ownedCells) {
+		cell = SDL_SwapLE16(cell);
+	}
+	cells = ownedCells.data();
+	unmapFile();
+#endif
+
+	// a bad index would have us reading off the end of the palette later, so check them all now.
+	// This is one pass over memory we were about to touch anyway.
+	Uint16 highest = 0;
+	for (Uint64 i = 0; i < cellCount; ++i) {
+		if (cells[i] > highest) highest = cells[i];
+	}
+	if (highest >= palette.size()) {
+		printf("ERROR: MapFile::loadBinary got a cell with palette index %u, but the palette only has %u entries, at %s.\n",
+			(unsigned)highest, (unsigned)palette.size(), path.c_str());
+		clear();
+		return false;
+	}
+
+	return true;
+}
+
+/// <summary>
+/// Reads and checks a binary map's header and palette, and fills in everything but the cells.
+/// </summary>
+/// <param name="data">The start of the file.</param>
+/// <param name="available">How much of the file data has. Has to reach at least to the cells.</param>
+/// <param name="fileSize">How big the whole file is, to check the cells fit.</param>
+/// <param name="path">Just for error messages.</param>
+/// <returns>true if it all makes sense.</returns>
+bool MapFile::parseBinaryHeader(const Uint8* data, size_t available, Uint64 fileSize, const std::string& path) {
+	MapFileHeader header;
+	if (available < sizeof(header)) {
+		printf("ERROR: MapFile::loadBinary got a file too small to be a map at %s.\n", path.c_str());
+		return false;
+	}
+	std::memcpy(&header, data, sizeof(header));
+	header.version = SDL_SwapLE32(header.version);
+	header.width = SDL_SwapLE32(header.width);
+	header.height = SDL_SwapLE32(header.height);
+	header.zlayer = (Sint32)SDL_SwapLE32((Uint32)header.zlayer);
+	header.paletteCount = SDL_SwapLE32(header.paletteCount);
+	header.paletteOffset = SDL_SwapLE32(header.paletteOffset);
+	header.cellsOffset = SDL_SwapLE32(header.cellsOffset);
+
+	if (std::memcmp(header.magic, MAPFILE_MAGIC, sizeof(header.magic)) != 0) {
+		printf("ERROR: MapFile::loadBinary loaded invalid map file at %s.\n", path.c_str());
+		return false;
+	}
+	if (header.version != MAPFILE_VERSION) {
+		printf("ERROR: MapFile::loadBinary got version %u, but only knows version %d, at %s.\n",
+			header.version, MAPFILE_VERSION, path.c_str());
+		return false;
+	}
+	Uint64 cellCount = (Uint64)header.width * header.height;
+	if (header.width == 0 || header.height == 0 || header.width > 0x7FFFFFFF || header.height > 0x7FFFFFFF ||
+		header.cellsOffset % sizeof(Uint16) != 0 || header.cellsOffset > fileSize || header.cellsOffset > available ||
+		cellCount > (fileSize - header.cellsOffset) / sizeof(Uint16)) {
+		printf("ERROR: MapFile::loadBinary got a map whose cells don't fit in the file at %s.\n", path.c_str());
+		return false;
+	}
+
+	// palette entries are variable length, so we walk them with a bounds check each step
+	size_t at = header.paletteOffset;
+	for (Uint32 i = 0; i < header.paletteCount; ++i) {
+		Uint16 lengths[2];
+		if (at > header.cellsOffset || header.cellsOffset - at < sizeof(lengths)) break;
+		std::memcpy(lengths, data + at, sizeof(lengths));
+		at += sizeof(lengths);
+		size_t assetLength = SDL_SwapLE16(lengths[0]), orderLength = SDL_SwapLE16(lengths[1]);
+		if (header.cellsOffset - at < assetLength + orderLength) break;
+
+		MapPaletteName entry;
+		entry.asset.assign((const char*)data + at, assetLength);
+		entry.order.assign((const char*)data + at + assetLength, orderLength);
+		at += assetLength + orderLength;
+		palette.push_back(entry);
+	}
+	if (palette.size() != header.paletteCount) {
+		printf("ERROR: MapFile::loadBinary got a palette that runs past its end at %s.\n", path.c_str());
+		return false;
+	}
+
+	header.name[MAPFILE_NAME_SIZE - 1] = '\0';
+	name.assign(header.name);
+	width = (int)header.width;
+	height = (int)header.height;
+	zlayer = header.zlayer;
+	cellsOffset = header.cellsOffset;
+	return true;
+}
+
+/// <summary>
+/// Loads everything from a binary map except the cells, for reading them a piece at a time with MapPager.
+/// Only reads up to where the cells start.
+/// </summary>
+/// <param name="path">The map file.</param>
+/// <returns>true if it loaded. getCells stays NULL either way.</returns>
+bool MapFile::loadBinaryHeader(const std::string& path) {
+	clear();
+
+	std::ifstream file{ path.c_str(), std::ios::binary };
+	if (!file) {
+		printf("ERROR: MapFile::loadBinaryHeader could not open map file at %s.\n", path.c_str());
+		return false;
+	}
+	file.seekg(0, std::ios::end);
+	std::streamoff fileSize = file.tellg();
+	file.seekg(0, std::ios::beg);
+
+	MapFileHeader header;
+	std::vector<Uint8> data(sizeof(header));
+	if (fileSize < (std::streamoff)sizeof(header) || !file.read((char*)data.data(), sizeof(header))) {
+		printf("ERROR: MapFile::loadBinaryHeader got a file too small to be a map at %s.\n", path.c_str());
+		return false;
+	}
+	// everything up to the cells, so the palette comes along too
+	std::memcpy(&header, data.data(), sizeof(header));
+	Uint32 headerEnd = SDL_SwapLE32(header.cellsOffset);
+	if (headerEnd > sizeof(header) && headerEnd <= fileSize) {
+		data.resize(headerEnd);
+		if (!file.read((char*)data.data() + sizeof(header), headerEnd - sizeof(header))) {
+			printf("ERROR: MapFile::loadBinaryHeader could not read %s.\n", path.c_str());
+			return false;
+		}
+	}
+
+	if (!parseBinaryHeader(data.data(), data.size(), (Uint64)fileSize, path)) {
+		clear();
+		return false;
+	}
+	return true;
+}
+
+/// <summary>
+/// Writes whatever's loaded as a binary map.
+/// </summary>
+/// <param name="path">Where to write it. Anything there is replaced.</param>
+/// <returns>true if it was written.</returns>
+bool MapFile::saveBinary(const std::string& path) const {
+	if (cells == NULL) {
+		printf("ERROR: MapFile::saveBinary has no map loaded to save.\n");
+		return false;
+	}
+	if (palette.size() > 0x10000) {
+		printf("ERROR: MapFile::saveBinary has too many palette entries (%u) for 16 bit cells.\n", (unsigned)palette.size());
+		return false;
+	}
+
+	MapFileHeader header;
+	std::memset(&header, 0, sizeof(header));
+	std::memcpy(header.magic, MAPFILE_MAGIC, sizeof(header.magic));
+	header.version = SDL_SwapLE32(MAPFILE_VERSION);
+	header.width = SDL_SwapLE32((Uint32)width);
+	header.height = SDL_SwapLE32((Uint32)height);
+	header.zlayer = (Sint32)SDL_SwapLE32((Uint32)zlayer);
+	header.paletteCount = SDL_SwapLE32((Uint32)palette.size());
+	header.paletteOffset = SDL_SwapLE32((Uint32)sizeof(header));
+	// longer names get cut off. SDL's version, since MSVC won't take strncpy.
+	SDL_strlcpy(header.name, name.c_str(), MAPFILE_NAME_SIZE);
+
+	std::vector<char> paletteData;
+	for (const MapPaletteName& entry : palette) {
+		Uint16 lengths[2] = { SDL_SwapLE16((Uint16)entry.asset.size()), SDL_SwapLE16((Uint16)entry.order.size()) };
+		const char* raw = (const char*)lengths;
+		paletteData.insert(paletteData.end(), raw, raw + sizeof(lengths));
+		paletteData.insert(paletteData.end(), entry.asset.begin(), entry.asset.end());
+		paletteData.insert(paletteData.end(), entry.order.begin(), entry.order.end());
+	}
+	// pad so the cells start aligned
+	size_t cellsOffset = sizeof(header) + paletteData.size();
+	cellsOffset = (cellsOffset + MAPFILE_CELL_ALIGN - 1) / MAPFILE_CELL_ALIGN * MAPFILE_CELL_ALIGN;
+	paletteData.resize(cellsOffset - sizeof(header), '\0');
+	header.cellsOffset = SDL_SwapLE32((Uint32)cellsOffset);
+
+	std::ofstream file{ path.c_str(), std::ios::binary | std::ios::trunc };
+	if (!file) {
+		printf("ERROR: MapFile::saveBinary could not open %s for writing.\n", path.c_str());
+		return false;
+	}
+	file.write((const char*)&header, sizeof(header));
+	file.write(paletteData.data(), paletteData.size());
+
+	size_t cellCount = (size_t)width * height;
+#if SDL_BYTEORDER == SDL_LIL_ENDIAN
+	file.write((const char*)cells, cellCount * sizeof(Uint16));
+#else
+	for (size_t i = 0; i < cellCount; ++i) {
+		Uint16 cell = SDL_SwapLE16(cells[i]);
+		file.write((const char*)&cell, sizeof(cell));
+	}
+#endif
+
+	if (!file) {
+		printf("ERROR: MapFile::saveBinary failed writing %s.\n", path.c_str());
+		return false;
+	}
+	return true;
+}
+
+/// <summary>
+/// Writes whatever's loaded as a text MAPFILE, palette indices tab separated, one row per line.
+/// Each row is put together in memory and written in one go, so even huge maps write quickly.
+/// </summary>
+/// <param name="path">Where to write it. Anything there is replaced.</param>
+/// <returns>true if it was written.</returns>
+bool MapFile::saveText(const std::string& path) const {
+	if (cells == NULL) {
+		printf("ERROR: MapFile::saveText has no map loaded to save.\n");
+		return false;
+	}
+	std::ofstream file{ path.c_str(), std::ios::binary | std::ios::trunc };
+	if (!file) {
+		printf("ERROR: MapFile::saveText could not open %s for writing.\n", path.c_str());
+		return false;
+	}
+	file << "MAPFILE\n" << name << "\n" << width << " x " << height << "\nzlayer " << zlayer << "\nPalette {\n";
+	for (size_t i = 0; i < palette.size(); ++i) {
+		file << i << "\t" << palette[i].asset << "::" << palette[i].order << "\n";
+	}
+	file << "}\n";
+
+	// at most 5 digits and a separator per Tile
+	std::vector<char> row((size_t)width * 6);
+	for (int y = 0; y < height; ++y) {
+		char* at = row.data();
+		const Uint16* cell = cells + (size_t)y * width;
+		for (int x = 0; x < width; ++x) {
+			at = std::to_chars(at, row.data() + row.size(), cell[x]).ptr;
+			*at++ = (x + 1 < width) ? '\t' : '\n';
+		}
+		file.write(row.data(), at - row.data());
+	}
+
+	if (!file) {
+		printf("ERROR: MapFile::saveText failed writing %s.\n", path.c_str());
+		return false;
+	}
+	return true;
+}
+
+/// <summary>
+/// Starts a new map in memory, every Tile set to palette entry 0. Fill in the cells with getCells.
+/// </summary>
+/// <returns>false if the size or palette doesn't make a valid map.</returns>
+bool MapFile::create(const std::string& name, int width, int height, int zlayer, const std::vector<MapPaletteName>& palette) {
+	clear();
+	if (width <= 0 || height <= 0 || (Uint64)width * height > MAPFILE_MAX_CELLS) {
+		printf("ERROR: MapFile::create can't make a %d x %d map.\n", width, height);
+		return false;
+	}
+	if (palette.empty() || palette.size() > 0x10000) {
+		printf("ERROR: MapFile::create needs between 1 and 65536 palette entries, not %u.\n", (unsigned)palette.size());
+		return false;
+	}
+	this->name = name;
+	this->width = width;
+	this->height = height;
+	this->zlayer = zlayer;
+	this->palette = palette;
+	ownedCells.assign((size_t)width * height, 0);
+	cells = ownedCells.data();
+	return true;
+}
+
+void* MapFile::mapFile(const std::string& path, size_t* size) {
+#ifdef _WIN32
+	HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE) {
+		printf("ERROR: MapFile::mapFile could not open %s.\n", path.c_str());
+		return NULL;
+	}
+	LARGE_INTEGER fileSize;
+	if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart == 0) {
+		printf("ERROR: MapFile::mapFile could not get the size of %s.\n", path.c_str());
+		CloseHandle(file);
+		return NULL;
+	}
+	// copy-on-write, so changing cells never touches the file
+	HANDLE mappingObject = CreateFileMappingA(file, NULL, PAGE_WRITECOPY, 0, 0, NULL);
+	void* view = (mappingObject == NULL) ? NULL : MapViewOfFile(mappingObject, FILE_MAP_COPY, 0, 0, 0);
+	if (view == NULL) {
+		printf("ERROR: MapFile::mapFile could not map %s.\n", path.c_str());
+		if (mappingObject != NULL) CloseHandle(mappingObject);
+		CloseHandle(file);
+		return NULL;
+	}
+	fileHandle = file;
+	mappingHandle = mappingObject;
+	mapping = view;
+	mappingSize = (size_t)fileSize.QuadPart;
+#else
+	int file = open(path.c_str(), O_RDONLY);
+	if (file < 0) {
+		printf("ERROR: MapFile::mapFile could not open %s.\n", path.c_str());
+		return NULL;
+	}
+	struct stat info;
+	if (fstat(file, &info) != 0 || info.st_size == 0) {
+		printf("ERROR: MapFile::mapFile could not get the size of %s.\n", path.c_str());
+		close(file);
+		return NULL;
+	}
+	// copy-on-write, so changing cells never touches the file
+	void* view = mmap(NULL, (size_t)info.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, file, 0);
+	// the mapping keeps the file alive on its own
+	close(file);
+	if (view == MAP_FAILED) {
+		printf("ERROR: MapFile::mapFile could not map %s.\n", path.c_str());
+		return NULL;
+	}
+	mapping = view;
+	mappingSize = (size_t)info.st_size;
+#endif
+	*size = mappingSize;
+	return mapping;
+}
+
+void MapFile::unmapFile() {
+	if (mapping == NULL) return;
+	if (cells != NULL && cells != ownedCells.data()) cells = NULL;
+#ifdef _WIN32
+	UnmapViewOfFile(mapping);
+	CloseHandle((HANDLE)mappingHandle);
+	CloseHandle((HANDLE)fileHandle);
+	mappingHandle = NULL;
+	fileHandle = NULL;
+#else
+	munmap(mapping, mappingSize);
+#endif
+	mapping = NULL;
+	mappingSize = 0;
+}
+
+
+/// <summary>
+/// Opens the map and starts the loader thread, which sleeps until something's requested.
+/// </summary>
+/// <param name="path">The binary map file.</param>
+/// <param name="map">The same map, with at least its header loaded.</param>
+/// <param name="pageTiles">How many Tiles on a side each page is.</param>
+MapPager::MapPager(const std::string& path, const MapFile& map, int pageTiles) :
+	path{ path },
+	file{ path.c_str(), std::ios::binary },
+	cellsOffset{ map.getCellsOffset() },
+	width{ map.getWidth() },
+	height{ map.getHeight() },
+	paletteSize{ map.getPalette().size() },
+	pageTiles{ pageTiles },
+	pagesWide{ 0 },
+	pagesHigh{ 0 },
+	thread{ NULL },
+	lock{ SDL_CreateMutex() },
+	wake{ SDL_CreateCond() },
+	wanted{ },
+	reading{ -1 },
+	finished{ },
+	isQuitting{ false }
+{
+	if (pageTiles <= 0 || cellsOffset == 0) {
+		printf("ERROR: MapPager::MapPager needs a binary map and a page size above 0 (%s).\n", path.c_str());
+		return;
+	}
+	pagesWide = (width + pageTiles - 1) / pageTiles;
+	pagesHigh = (height + pageTiles - 1) / pageTiles;
+	if (!file) {
+		printf("ERROR: MapPager::MapPager could not open map file at %s.\n", path.c_str());
+		return;
+	}
+	if (lock == NULL || wake == NULL) {
+		printf("ERROR: MapPager::MapPager couldn't create sync objects. SDL_Error: %s\n", SDL_GetError());
+		return;
+	}
+	thread = SDL_CreateThread(MapPager::loaderMain, "map pager", this);
+	if (thread == NULL) {
+		printf("ERROR: MapPager::MapPager couldn't start its thread. SDL_Error: %s\n", SDL_GetError());
+	}
+}
+
+MapPager::~MapPager() {
+	if (lock != NULL) {
+		SDL_LockMutex(lock);
+		isQuitting = true;
+		if (wake != NULL) SDL_CondSignal(wake);
+		SDL_UnlockMutex(lock);
+	}
+	if (thread != NULL) SDL_WaitThread(thread, NULL);
+	if (wake != NULL) SDL_DestroyCond(wake);
+	if (lock != NULL) SDL_DestroyMutex(lock);
+}
+
+void MapPager::request(const std::vector<int>& pages) {
+	if (lock == NULL) return;
+	SDL_LockMutex(lock);
+	wanted.clear();
+	for (int page : pages) {
+		if (page == reading) continue;
+		// there are only ever a few of these, since the owner takes them every frame
+		bool isFinished = false;
+		for (const MapPage& done : finished) {
+			if (done.index == page) {
+				isFinished = true;
+				break;
+			}
+		}
+		if (!isFinished) wanted.push_back(page);
+	}
+	if (!wanted.empty()) SDL_CondSignal(wake);
+	SDL_UnlockMutex(lock);
+}
+
+void MapPager::takeLoaded(std::vector<MapPage>& loaded) {
+	if (lock == NULL) return;
+	SDL_LockMutex(lock);
+	for (MapPage& page : finished) {
+		loaded.push_back(std::move(page));
+	}
+	finished.clear();
+	SDL_UnlockMutex(lock);
+}
+
+int MapPager::loaderMain(void* data) {
+	MapPager* pager = (MapPager*)data;
+	SDL_LockMutex(pager->lock);
+	while (true) {
+		while (!pager->isQuitting && pager->wanted.empty()) {
+			SDL_CondWait(pager->wake, pager->lock);
+		}
+		if (pager->isQuitting) break;
+		int index = pager->wanted.front();
+		pager->wanted.pop_front();
+		pager->reading = index;
+
+		// the disk is the slow part, so nobody waits on us while we're at it
+		SDL_UnlockMutex(pager->lock);
+		MapPage page;
+		bool isRead = pager->readPage(index, &page);
+		SDL_LockMutex(pager->lock);
+		pager->reading = -1;
+		if (isRead) pager->finished.push_back(std::move(page));
+	}
+	SDL_UnlockMutex(pager->lock);
+	return 0;
+}
+
+bool MapPager::readPage(int index, MapPage* page) {
+	if (index < 0 || index >= pagesWide * pagesHigh) {
+		printf("ERROR: MapPager::readPage got page %d, which isn't in the map.\n", index);
+		return false;
+	}
+	int startX = (index % pagesWide) * pageTiles, startY = (index / pagesWide) * pageTiles;
+	int rowLength = std::min(pageTiles, width - startX), rows = std::min(pageTiles, height - startY);
+
+	page->index = index;
+	page->cells.assign((size_t)pageTiles * pageTiles, 0);
+	if (rowLength == width) {
+		// the page is as wide as the map, so its rows sit back to back in the file and go in one read
+		file.seekg((std::streamoff)cellsOffset + (std::streamoff)startY * width * (std::streamoff)sizeof(Uint16));
+		if (!file.read((char*)page->cells.data(), (std::streamsize)rows * width * sizeof(Uint16))) {
+			printf("ERROR: MapPager::readPage could not read page %d of %s.\n", index, path.c_str());
+			file.clear();
+			return false;
+		}
+		// then spread them out to pageTiles apart, last first so nothing gets written over before it's moved
+		if (width < pageTiles) {
+			for (int row = rows; row-- > 0;) {
+				Uint16* out = &page->cells[(size_t)row * pageTiles];
+				std::memmove(out, &page->cells[(size_t)row * width], width * sizeof(Uint16));
+				std::fill(out + width, out + pageTiles, 0);
+			}
+		}
+	}
+	else {
+		for (int row = 0; row < rows; ++row) {
+			Uint16* out = &page->cells[(size_t)row * pageTiles];
+			file.seekg((std::streamoff)cellsOffset + ((std::streamoff)(startY + row) * width + startX) * (std::streamoff)sizeof(Uint16));
+			if (!file.read((char*)out, rowLength * sizeof(Uint16))) {
+				printf("ERROR: MapPager::readPage could not read page %d of %s.\n", index, path.c_str());
+				file.clear();
+				return false;
+			}
+		}
+	}
+
+	bool isBad = false;
+	for (Uint16& cell : page->cells) {
+		cell = SDL_SwapLE16(cell);
+		if (cell >= paletteSize) {
+			cell = 0;
+			isBad = true;
+		}
+	}
+	if (isBad) {
+		printf("ERROR: MapPager::readPage got palette indices past the end of the palette in page %d of %s. They're 0 now.\n",
+			index, path.c_str());
+	}
+	return true;
+}
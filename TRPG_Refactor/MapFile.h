@@ -0,0 +1,189 @@
+#ifndef MAPFILE_H
+#define MAPFILE_H
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <fstream>
+
+#include <SDL.h>
+
+// the first 8 bytes of every binary map
+#define MAPFILE_MAGIC		"TRPGMAP"
+#define MAPFILE_VERSION		1
+// longest map name a binary map can hold, including the terminator
+#define MAPFILE_NAME_SIZE	32
+// cells start on a multiple of this in binary maps
+#define MAPFILE_CELL_ALIGN	16
+// the most cells (width * height) create will make a map with, 4 GB of them. Those are all in
+// memory at once, so anything bigger is a typo, not a map.
+#define MAPFILE_MAX_CELLS	0x80000000ULL
+
+/// <summary>
+/// MapFileHeader -- the start of a binary map. Everything is little endian.
+///
+/// After the header comes the palette: paletteCount entries, each a Uint16 asset name
+/// length, a Uint16 order name length, then the two names (no terminators). Then, at
+/// cellsOffset, width * height Uint16 palette indices, row by row. The cells are stored
+/// exactly how Layer uses them, so a loaded map just points into the file.
+/// </summary>
+typedef struct mfh_ {
+	char magic[8];
+	Uint32 version;
+	Uint32 width;
+	Uint32 height;
+	Sint32 zlayer;
+	Uint32 paletteCount;
+	Uint32 paletteOffset;
+	Uint32 cellsOffset;
+	Uint32 reserved;
+	char name[MAPFILE_NAME_SIZE];
+} MapFileHeader;
+
+/// <summary>
+/// MapPaletteName -- a palette entry as it's written in a map file, by name.
+/// </summary>
+typedef struct mpn_ {
+	std::string asset;
+	std::string order;
+} MapPaletteName;
+
+/// <summary>
+/// MapFile -- a map as it's stored on disk, before any assets are looked up. Reads the text
+/// MAPFILE format and the binary format (see MapFileHeader), and writes the binary one.
+///
+/// Binary maps are memory-mapped copy-on-write, and the cells are used straight out of the
+/// mapping, so loading one doesn't read (or allocate) anything per cell. Changing cells
+/// never changes the file. Text maps get parsed into memory we own.
+///
+/// Palette indices are dense from 0, in file order, so cell values index getPalette directly.
+/// </summary>
+class MapFile {
+
+public:
+	MapFile();
+	~MapFile();
+	// the cells might point into a mapping we own
+	MapFile(const MapFile&) = delete;
+	MapFile& operator=(const MapFile&) = delete;
+
+	// loads either format, going by the first few bytes. Anything already loaded is thrown out.
+	bool load(const std::string& path);
+	bool loadText(const std::string& path);
+	bool loadBinary(const std::string& path);
+	// everything but the cells, for maps too big to load at once (see MapPager)
+	bool loadBinaryHeader(const std::string& path);
+	// a new map of width x height Tiles, all palette entry 0, for building maps in code
+	// (see SceneGenerator). Anything already loaded is thrown out. At most MAPFILE_MAX_CELLS Tiles.
+	bool create(const std::string& name, int width, int height, int zlayer, const std::vector<MapPaletteName>& palette);
+	// writes what's loaded in the binary format
+	bool saveBinary(const std::string& path) const;
+	// writes what's loaded as a text MAPFILE
+	bool saveText(const std::string& path) const;
+
+	const std::string& getName() const { return name; }
+	int getWidth() const { return width; }
+	int getHeight() const { return height; }
+	int getZLayer() const { return zlayer; }
+	const std::vector<MapPaletteName>& getPalette() const { return palette; }
+	// width * height palette indices, row by row. Writable, but only in memory.
+	Uint16* getCells() { return cells; }
+	const Uint16* getCells() const { return cells; }
+	// where the cells start in a binary map; 0 for text maps
+	Uint32 getCellsOffset() const { return cellsOffset; }
+
+private:
+	void clear();
+	// does the work for loadText, which cleans up after it if it fails
+	bool parseText(const std::string& path);
+	// checks and reads a binary map's header and palette out of the first available bytes of it
+	bool parseBinaryHeader(const Uint8* data, size_t available, Uint64 fileSize, const std::string& path);
+	// maps the whole file copy-on-write. Returns NULL on failure.
+	void* mapFile(const std::string& path, size_t* size);
+	void unmapFile();
+
+	std::string name;
+	int width;
+	int height;
+	int zlayer;
+	std::vector<MapPaletteName> palette;
+	// points at either ownedCells or into the mapping
+	Uint16* cells;
+	std::vector<Uint16> ownedCells;
+	Uint32 cellsOffset;
+
+	// the mapping, if there is one
+	void* mapping;
+	size_t mappingSize;
+#ifdef _WIN32
+	void* fileHandle;
+	void* mappingHandle;
+#endif
+
+};
+
+/// <summary>
+/// MapPage -- one square piece of a map's cells, as MapPager reads them.
+/// </summary>
+typedef struct mpg_ {
+	// which page, [py * pagesWide + px]
+	int index;
+	// pageTiles * pageTiles palette indices, row by row. Anything past the edge of the map is 0.
+	std::vector<Uint16> cells;
+} MapPage;
+
+/// <summary>
+/// MapPager -- reads pieces of a binary map's cells on a thread of its own, so maps far too big to
+/// load at once can be brought in a bit at a time without the game ever waiting on the disk.
+/// Ask for pages with request, then pick them up with takeLoaded whenever it's convenient.
+///
+/// Every method is safe to call from any thread, though it's meant to have one owner.
+/// </summary>
+class MapPager {
+
+public:
+	// map has to have been loaded from path, with loadBinaryHeader or loadBinary.
+	// Pages are pageTiles on a side.
+	MapPager(const std::string& path, const MapFile& map, int pageTiles);
+	~MapPager();
+	// the thread has a pointer to us
+	MapPager(const MapPager&) = delete;
+	MapPager& operator=(const MapPager&) = delete;
+
+	// false if the file or the thread couldn't be opened
+	bool isOpen() const { return thread != NULL; }
+	int getPagesWide() const { return pagesWide; }
+	int getPagesHigh() const { return pagesHigh; }
+	// replaces whatever was asked for before with pages, most wanted first. Pages that are being
+	// read right now, or are read and waiting for takeLoaded, are left out, since they'll show up
+	// in takeLoaded anyway.
+	void request(const std::vector<int>& pages);
+	// moves every page that's done onto the end of loaded
+	void takeLoaded(std::vector<MapPage>& loaded);
+
+private:
+	static int loaderMain(void* data);
+	// only ever called on our thread
+	bool readPage(int index, MapPage* page);
+
+	std::string path;
+	std::ifstream file;
+	Uint32 cellsOffset;
+	int width, height;
+	size_t paletteSize;
+	int pageTiles;
+	int pagesWide, pagesHigh;
+
+	SDL_Thread* thread;
+	SDL_mutex* lock;
+	SDL_cond* wake;
+	// everything below here is only touched while holding lock
+	std::deque<int> wanted;
+	// the page our thread is reading, or -1
+	int reading;
+	std::vector<MapPage> finished;
+	bool isQuitting;
+
+};
+
+#endif
@@ -0,0 +1,288 @@
+#include <stdio.h>
+#include <vector>
+#include <algorithm>
+#include <map>
+
+#include <SDL.h>
+
+#include "GraphicsEngine.h"
+#include "Tiles.h"
+#include "Minimap.h"
+
+static Uint32 packColor(SDL_Color color) {
+	return ((Uint32)color.r << 24) | ((Uint32)color.g << 16) | ((Uint32)color.b << 8) | color.a;
+}
+
+/// <summary>
+/// Makes the minimap's texture and hooks it up to the scene and the Layer. The texture gets filled in
+/// on the first frame it's drawn.
+/// </summary>
+/// <param name="scene">Where to draw the minimap.</param>
+/// <param name="renderer">Only used to make the texture.</param>
+/// <param name="layer">The Layer to show.</param>
+/// <param name="screenArea">Where on screen it goes, in pixels. Not affected by the camera.</param>
+/// <param name="zlayer">Should be above everything it covers.</param>
+Minimap::Minimap(AnimationManager& scene, SDL_Renderer* renderer, Layer& layer, const SDL_Rect& screenArea, int zlayer) :
+	scene{ scene },
+	layer{ layer },
+	drawSourceId{ 0 },
+	listenerId{ 0 },
+	texture{ NULL },
+	viewTexture{ NULL },
+	screenArea{ screenArea },
+	zlayer{ zlayer },
+	isVisible{ true },
+	step{ 1 },
+	width{ 0 },
+	height{ 0 },
+	isFirstUpload{ true }
+{
+	int mapWidth = layer.getWidth(), mapHeight = layer.getHeight();
+	if (mapWidth <= 0 || mapHeight <= 0) {
+		printf("ERROR: Minimap::Minimap got a Layer with no Tiles.\n");
+		return;
+	}
+	// big maps get a texel per square of Tiles, as few to a side as keeps it under the size limit
+	step = std::max(1, std::max((mapWidth + MINIMAP_MAX_SIZE - 1) / MINIMAP_MAX_SIZE, (mapHeight + MINIMAP_MAX_SIZE - 1) / MINIMAP_MAX_SIZE));
+	width = (mapWidth + step - 1) / step;
+	height = (mapHeight + step - 1) / step;
+	texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_STATIC, width, height);
+	if (texture == NULL) {
+		printf("ERROR: Minimap::Minimap could not make a %d x %d texture. SDL_Error: %s\n", width, height, SDL_GetError());
+		return;
+	}
+	SDL_SetTextureBlendMode(texture, SDL_BLENDMODE_BLEND);
+	viewTexture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_STATIC, 1, 1);
+	if (viewTexture == NULL) {
+		// still works, just without the outline
+		printf("ERROR: Minimap::Minimap could not make the view texture. SDL_Error: %s\n", SDL_GetError());
+	}
+
+	texels.assign((size_t)width * height, 0);
+	texelUnits.assign((size_t)width * height, MINIMAP_NO_UNIT);
+	isChanged.assign((size_t)width * height, false);
+
+	listenerId = layer.addChangeListener([this](const std::vector<SDL_Point>& cells) {
+		onTilesChanged(cells);
+		});
+	drawSourceId = scene.addDrawSource([this](DrawList& list, const SDL_Rect& camera) {
+		queueMinimap(list, camera);
+		});
+}
+
+Minimap::~Minimap() {
+	if (texture == NULL) return;
+	scene.removeDrawSource(drawSourceId);
+	layer.removeChangeListener(listenerId);
+	SDL_DestroyTexture(texture);
+	if (viewTexture != NULL) SDL_DestroyTexture(viewTexture);
+}
+
+void Minimap::addUnit(const Sprite& unit, SDL_Color color) {
+	if (texture == NULL) return;
+	if (&unit.getScene() != &scene) {
+		printf("ERROR: Minimap::addUnit got a Sprite from a different scene.\n");
+		return;
+	}
+	Uint32 id = unit.getID();
+	if (id == SPRITE_NO_ID) return;
+	auto it = unitSlots.find(id);
+	if (it != unitSlots.end()) {
+		// the same unit again, or an old one that had the id before it was destroyed
+		dropUnit(it->second);
+	}
+
+	Uint32 slot;
+	if (!freeUnits.empty()) {
+		slot = freeUnits.back();
+		freeUnits.pop_back();
+	}
+	else {
+		units.emplace_back();
+		slot = (Uint32)(units.size() - 1);
+	}
+	MinimapUnit& added = units[slot];
+	added.id = id;
+	added.generation = scene.getSpriteGeneration(id);
+	added.color = packColor(color);
+	added.texel = -1;
+	added.below = MINIMAP_NO_UNIT;
+	unitSlots.emplace(id, slot);
+	scene.watchSprite(id);
+	placeUnit(slot, findUnitTexel(id));
+}
+
+void Minimap::removeUnit(const Sprite& unit) {
+	auto it = unitSlots.find(unit.getID());
+	if (it != unitSlots.end()) dropUnit(it->second);
+}
+
+/// <summary>
+/// Moves the dots of the units the scene says changed this frame (and drops the ones for units that
+/// are gone), then uploads every texel that changed and draws the minimap.
+/// </summary>
+void Minimap::queueMinimap(DrawList& list, const SDL_Rect& camera) {
+	// the scene only keeps these for one build, so they get looked at even while we're hidden
+	const AnimationManager& sprites = scene;
+	for (Uint32 id : sprites.getTouchedSprites()) {
+		auto it = unitSlots.find(id);
+		if (it == unitSlots.end()) continue;
+		// the id might belong to some other Sprite by now
+		bool isOurs = (sprites.getSprite(id).flags & SPRITE_ALIVE) && sprites.getSpriteGeneration(id) == units[it->second].generation;
+		if (isOurs) placeUnit(it->second, findUnitTexel(id));
+		else dropUnit(it->second);
+	}
+	if (!isVisible) return;
+
+	if (isFirstUpload) {
+		for (int texel = 0; texel < width * height; ++texel) {
+			texels[texel] = getTexelColor(texel);
+		}
+		if (viewTexture != NULL) {
+			Uint32 viewColor = MINIMAP_VIEW_COLOR;
+			list.uploadTexture(viewTexture, SDL_Rect{ 0, 0, 1, 1 }, &viewColor);
+		}
+	}
+
+	uploadChanges(list);
+	list.add(zlayer, texture, screenArea);
+	queueView(list, camera);
+}
+
+void Minimap::queueView(DrawList& list, const SDL_Rect& camera) {
+	Sint64 mapWidth = (Sint64)layer.getWidth() * layer.getTileWidth(), mapHeight = (Sint64)layer.getHeight() * layer.getTileHeight();
+	if (viewTexture == NULL || mapWidth <= 0 || mapHeight <= 0) return;
+
+	// world pixels to minimap pixels, cut down to the minimap
+	SDL_Rect view;
+	view.x = screenArea.x + (int)((Sint64)camera.x * screenArea.w / mapWidth);
+	view.y = screenArea.y + (int)((Sint64)camera.y * screenArea.h / mapHeight);
+	view.w = std::max(1, (int)((Sint64)camera.w * screenArea.w / mapWidth));
+	view.h = std::max(1, (int)((Sint64)camera.h * screenArea.h / mapHeight));
+	SDL_Rect shown;
+	if (SDL_IntersectRect(&view, &screenArea, &shown) == SDL_FALSE) return;
+
+	// one sublayer up, so it's always on top of the minimap itself
+	list.add(zlayer, viewTexture, SDL_Rect{ shown.x, shown.y, shown.w, 1 }, 1);
+	list.add(zlayer, viewTexture, SDL_Rect{ shown.x, shown.y + shown.h - 1, shown.w, 1 }, 1);
+	list.add(zlayer, viewTexture, SDL_Rect{ shown.x, shown.y, 1, shown.h }, 1);
+	list.add(zlayer, viewTexture, SDL_Rect{ shown.x + shown.w - 1, shown.y, 1, shown.h }, 1);
+}
+
+void Minimap::onTilesChanged(const std::vector<SDL_Point>& cells) {
+	if (isFirstUpload) return;
+	for (const SDL_Point& cell : cells) {
+		int texel = (cell.y / step) * width + cell.x / step;
+		texels[texel] = getTexelColor(texel);
+		markTexel(texel);
+	}
+}
+
+Uint32 Minimap::getTexelColor(int texel) const {
+	Uint32 top = texelUnits[texel];
+	if (top != MINIMAP_NO_UNIT) return units[top].color;
+	return getTileColor(texel);
+}
+
+Uint32 Minimap::getTileColor(int texel) const {
+	// on big maps, the Tile in the middle of the texel's square
+	int x = std::min((texel % width) * step + step / 2, layer.getWidth() - 1);
+	int y = std::min((texel / width) * step + step / 2, layer.getHeight() - 1);
+	// paged maps have holes until the pages come in
+	if (!layer.isTileLoaded(x, y)) return 0;
+	return layer.getPaletteEntry(layer.getTile(x, y)).color;
+}
+
+int Minimap::findUnitTexel(Uint32 id) const {
+	int x, y;
+	scene.getWorldPosition(id, &x, &y);
+	int tileWidth = layer.getTileWidth(), tileHeight = layer.getTileHeight();
+	if (x < 0 || y < 0 || tileWidth <= 0 || tileHeight <= 0) return -1;
+	x /= tileWidth;
+	y /= tileHeight;
+	if (x >= layer.getWidth() || y >= layer.getHeight()) return -1;
+	return (y / step) * width + x / step;
+}
+
+void Minimap::placeUnit(Uint32 slot, int texel) {
+	MinimapUnit& unit = units[slot];
+	if (texel == unit.texel) return;
+
+	if (unit.texel >= 0) {
+		// only the units that shared its texel to go through
+		int old = unit.texel;
+		Uint32* link = &texelUnits[old];
+		while (*link != slot) link = &units[*link].below;
+		*link = unit.below;
+		texels[old] = getTexelColor(old);
+		markTexel(old);
+	}
+	unit.texel = texel;
+	unit.below = MINIMAP_NO_UNIT;
+	if (texel >= 0) {
+		unit.below = texelUnits[texel];
+		texelUnits[texel] = slot;
+		texels[texel] = unit.color;
+		markTexel(texel);
+	}
+}
+
+void Minimap::dropUnit(Uint32 slot) {
+	placeUnit(slot, -1);
+	unitSlots.erase(units[slot].id);
+	units[slot].id = SPRITE_NO_ID;
+	freeUnits.push_back(slot);
+}
+
+void Minimap::markTexel(int texel) {
+	if (isFirstUpload || isChanged[texel]) return;
+	isChanged[texel] = true;
+	changed.push_back(texel);
+}
+
+/// <summary>
+/// Uploads the changed texels, merging ones that sit next to each other in a row into one upload. If
+/// that's still a lot of uploads, the box around all of them goes up in one instead.
+/// </summary>
+void Minimap::uploadChanges(DrawList& list) {
+	if (isFirstUpload) {
+		SDL_Rect all = { 0, 0, width, height };
+		list.uploadTexture(texture, all, texels.data());
+		isFirstUpload = false;
+		return;
+	}
+	if (changed.empty()) return;
+
+	std::sort(changed.begin(), changed.end());
+	int runs = 1;
+	int left = width, top = height, right = 0, bottom = 0;
+	for (size_t i = 0; i < changed.size(); ++i) {
+		int x = changed[i] % width, y = changed[i] / width;
+		left = std::min(left, x);
+		top = std::min(top, y);
+		right = std::max(right, x + 1);
+		bottom = std::max(bottom, y + 1);
+		// texels on the next row over don't join a run, even if they're next in memory
+		if (i > 0 && (changed[i] != changed[i - 1] + 1 || x == 0)) ++runs;
+		isChanged[changed[i]] = false;
+	}
+
+	if (runs > MINIMAP_MAX_UPLOADS) {
+		std::vector<Uint32> box((size_t)(right - left) * (bottom - top));
+		for (int y = top; y < bottom; ++y) {
+			std::copy(&texels[(size_t)y * width + left], &texels[(size_t)y * width + right], &box[(size_t)(y - top) * (right - left)]);
+		}
+		SDL_Rect rect = { left, top, right - left, bottom - top };
+		list.uploadTexture(texture, rect, box.data());
+	}
+	else {
+		size_t start = 0;
+		for (size_t i = 1; i <= changed.size(); ++i) {
+			if (i < changed.size() && changed[i] == changed[i - 1] + 1 && changed[i] % width != 0) continue;
+			SDL_Rect rect = { changed[start] % width, changed[start] / width, (int)(i - start), 1 };
+			list.uploadTexture(texture, rect, &texels[changed[start]]);
+			start = i;
+		}
+	}
+	changed.clear();
+}
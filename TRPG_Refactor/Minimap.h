@@ -0,0 +1,129 @@
+#ifndef MINIMAP_H
+#define MINIMAP_H
+
+#include <vector>
+#include <map>
+
+#include <SDL.h>
+
+#include "GraphicsEngine.h"
+#include "Tiles.h"
+
+// past this many separate runs of changed texels in a frame, we just upload the box around all of them
+#define MINIMAP_MAX_UPLOADS		64
+// the outline of what the camera sees, SDL_PIXELFORMAT_RGBA8888
+#define MINIMAP_VIEW_COLOR		0xFFFFFFFF
+// Maps bigger than this (in Tiles) on either side get one texel for every few Tiles across and
+// down, so the texture is never bigger than this on a side. It's only shown a few hundred pixels
+// across anyway.
+#define MINIMAP_MAX_SIZE		512
+// no unit, for MinimapUnit::below and the top of an empty texel
+#define MINIMAP_NO_UNIT			0xFFFFFFFF
+
+/// <summary>
+/// MinimapUnit -- a Sprite the minimap shows as a dot.
+/// </summary>
+typedef struct mmu_ {
+	// the Sprite's id, or SPRITE_NO_ID while this slot is free, and its record's generation (see
+	// AnimationManager::getSpriteGeneration), since ids get reused
+	Uint32 id;
+	Uint32 generation;
+	// SDL_PIXELFORMAT_RGBA8888
+	Uint32 color;
+	// which texel it's on, or -1 if it's off the map
+	int texel;
+	// the next unit down on the same texel, or MINIMAP_NO_UNIT
+	Uint32 below;
+} MinimapUnit;
+
+/// <summary>
+/// Minimap -- the whole of a Layer, one texel per Tile (or per square of Tiles, see
+/// MINIMAP_MAX_SIZE), drawn into a corner of the screen with dots for units and an outline of what
+/// the camera sees on top. Each texel is its Tile's palette entry's color (the average color of its
+/// Order's first Frame). On big maps that's the Tile in the middle of the square.
+///
+/// The texture is filled in once, then only the texels that change get uploaded again: the Layer
+/// tells us which cells its edits touch, and units are watched Sprites (see
+/// AnimationManager::watchSprite), so the scene tells us which ones changed. Units that didn't
+/// aren't looked at. Each texel keeps its own stack of the units on it, the last one to arrive on
+/// top, so a unit leaving only has to look at the ones it shared a texel with. So keeping it up to
+/// date costs about as much as whatever changed. A unit attached to another Sprite only moves its
+/// dot when it changes itself, not when its parent moves. The uploads ride along in the DrawList
+/// (see DrawList::uploadTexture), so the game thread never touches the renderer.
+///
+/// Like Layer, the constructor and destructor need to be on the thread with the renderer, and
+/// everything else on the game thread. Has to go away before its Layer does.
+/// </summary>
+class Minimap {
+
+public:
+	// Shows layer in screenArea (in screen pixels) at zlayer, in scene's DrawList. renderer is
+	// only used to make the texture.
+	Minimap(AnimationManager& scene, SDL_Renderer* renderer, Layer& layer, const SDL_Rect& screenArea, int zlayer);
+	~Minimap();
+	// we're registered with the scene and the layer by address
+	Minimap(const Minimap&) = delete;
+	Minimap& operator=(const Minimap&) = delete;
+
+	// unit shows as a color dot where it is, until removeUnit or until it's destroyed. Adding it
+	// again just changes the color.
+	void addUnit(const Sprite& unit, SDL_Color color);
+	void removeUnit(const Sprite& unit);
+	void setVisible(bool isVisible) { this->isVisible = isVisible; }
+	void setScreenArea(const SDL_Rect& screenArea) { this->screenArea = screenArea; }
+
+private:
+	// our DrawSource. Moves the dots of units the scene says changed, uploads whatever changed, then
+	// draws the texture and the view.
+	void queueMinimap(DrawList& list, const SDL_Rect& camera);
+	// outlines camera (in world pixels) on the minimap
+	void queueView(DrawList& list, const SDL_Rect& camera);
+	// our LayerChangeListener
+	void onTilesChanged(const std::vector<SDL_Point>& cells);
+	// the unit on top at texel, or else the Tile there
+	Uint32 getTexelColor(int texel) const;
+	// the color of the Tile texel shows
+	Uint32 getTileColor(int texel) const;
+	// which texel the unit's on, or -1
+	int findUnitTexel(Uint32 id) const;
+	// moves the unit in slot to texel (-1 for off the map), on top of whatever's there
+	void placeUnit(Uint32 slot, int texel);
+	// takes the unit in slot off the minimap for good
+	void dropUnit(Uint32 slot);
+	void markTexel(int texel);
+	// turns the changed texels into as few uploads as is sensible
+	void uploadChanges(DrawList& list);
+
+	AnimationManager& scene;
+	Layer& layer;
+	Uint32 drawSourceId;
+	Uint32 listenerId;
+	SDL_Texture* texture;
+	// one texel of MINIMAP_VIEW_COLOR, stretched into the lines of the view's outline
+	SDL_Texture* viewTexture;
+	SDL_Rect screenArea;
+	int zlayer;
+	bool isVisible;
+	// each texel is step by step Tiles
+	int step;
+	// the texture's size, in texels
+	int width, height;
+
+	// what the texture should look like, so changes can be uploaded from it
+	std::vector<Uint32> texels;
+	// the unit on top at each texel, as a slot in units, or MINIMAP_NO_UNIT
+	std::vector<Uint32> texelUnits;
+	// slots get reused, like Sprite records, so a unit's slot never changes
+	std::vector<MinimapUnit> units;
+	std::vector<Uint32> freeUnits;
+	// Sprite id to slot in units
+	std::map<Uint32, Uint32> unitSlots;
+	// texels that changed since the last upload, and whether each is already in there
+	std::vector<int> changed;
+	std::vector<bool> isChanged;
+	// the whole texture still has to go up
+	bool isFirstUpload;
+
+};
+
+#endif
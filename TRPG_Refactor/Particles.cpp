@@ -0,0 +1,187 @@
+#include <stdio.h>
+#include <cmath>
+#include <vector>
+
+#include <SDL.h>
+
+#include "GraphicsEngine.h"
+#include "Particles.h"
+
+// SSE is always there on x64, and on x86 if the compiler was told it can use it
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#define PARTICLES_USE_SSE
+#include <xmmintrin.h>
+#endif
+
+#define PARTICLES_PI 3.14159265f
+
+/// <summary>
+/// Makes an empty ParticleSystem and adds it to the scene's draw sources.
+/// </summary>
+/// <param name="scene">The AnimationManager to draw particles with.</param>
+/// <param name="capacity">The most particles that can be alive at once.</param>
+ParticleSystem::ParticleSystem(AnimationManager& scene, size_t capacity) :
+	scene{ scene },
+	drawSourceId{ 0 },
+	count{ 0 },
+	capacity{ capacity },
+	seed{ 0x9E3779B9 }
+{
+	// padded so the SIMD loop can always read a full 4 at the end
+	size_t padded = (capacity + 3) & ~(size_t)3;
+	x.resize(padded);
+	y.resize(padded);
+	vx.resize(padded);
+	vy.resize(padded);
+	gravity.resize(padded);
+	age.resize(padded);
+	life.resize(padded);
+	effect.resize(padded);
+
+	drawSourceId = scene.addDrawSource([this](DrawList& list, const SDL_Rect& camera) {
+		queueDraws(list, camera);
+		});
+}
+
+ParticleSystem::~ParticleSystem() {
+	scene.removeDrawSource(drawSourceId);
+}
+
+/// <summary>
+/// Registers a kind of effect for emit.
+/// </summary>
+/// <param name="effect">What the effect looks like. It's copied in.</param>
+/// <returns>An id to pass to emit.</returns>
+ParticleEffectID ParticleSystem::addEffect(const ParticleEffect& effect) {
+	SDL_Rect bounds = { 0, 0, 0, 0 };
+	if (effect.order != NULL) {
+		effect.order->getBounds(&bounds, effect.scale);
+	}
+	else {
+		printf("ERROR: ParticleSystem::addEffect got an effect with no Order. It won't draw anything.\n");
+	}
+	effects.push_back(effect);
+	effectBounds.push_back(bounds);
+	return (ParticleEffectID)(effects.size() - 1);
+}
+
+/// <summary>
+/// Starts a burst of particles. Each one gets a random direction, speed and lifetime from within the
+/// effect's ranges.
+/// </summary>
+/// <param name="id">Which effect, from addEffect.</param>
+/// <param name="x">Where in the world (in pixels) the burst comes from.</param>
+/// <param name="y"></param>
+/// <returns>How many particles were actually made.</returns>
+int ParticleSystem::emit(ParticleEffectID id, int x, int y) {
+	if (id >= effects.size()) {
+		printf("ERROR: ParticleSystem::emit got an effect id %u that doesn't exist.\n", id);
+		return 0;
+	}
+	const ParticleEffect& e = effects[id];
+	if (e.order == NULL) return 0;
+
+	int made = 0;
+	for (; made < e.count && count < capacity; ++made) {
+		size_t i = count++;
+		float angle = (e.direction + e.spread * (2 * random() - 1)) * (PARTICLES_PI / 180);
+		float speed = e.minSpeed + (e.maxSpeed - e.minSpeed) * random();
+		float startAngle = 2 * PARTICLES_PI * random();
+		float startDistance = e.radius * random();
+
+		this->x[i] = x + startDistance * std::cos(startAngle);
+		this->y[i] = y + startDistance * std::sin(startAngle);
+		vx[i] = speed * std::cos(angle);
+		vy[i] = speed * std::sin(angle);
+		gravity[i] = e.gravity;
+		age[i] = 0;
+		life[i] = e.minLife + (e.maxLife - e.minLife) * random();
+		// queueDraws divides by this
+		if (life[i] < 1) life[i] = 1;
+		effect[i] = id;
+	}
+	return made;
+}
+
+/// <summary>
+/// Moves every particle along, then drops the ones that are past their lifetime. Uses SSE for four
+/// particles at a time where it's available, with plain code for the rest.
+/// </summary>
+/// <param name="ms">Milliseconds since the last update.</param>
+void ParticleSystem::update(Uint32 ms) {
+	if (count == 0 || ms == 0) return;
+
+	float dt = ms / 1000.0f;
+	float fms = (float)ms;
+	size_t i = 0;
+
+#ifdef PARTICLES_USE_SSE
+	__m128 vdt = _mm_set1_ps(dt);
+	__m128 vms = _mm_set1_ps(fms);
+	for (; i + 4 <= count; i += 4) {
+		// velocity first, then position with the new velocity, same as the plain loop below
+		__m128 nvy = _mm_add_ps(_mm_loadu_ps(&vy[i]), _mm_mul_ps(_mm_loadu_ps(&gravity[i]), vdt));
+		__m128 nx = _mm_add_ps(_mm_loadu_ps(&x[i]), _mm_mul_ps(_mm_loadu_ps(&vx[i]), vdt));
+		__m128 ny = _mm_add_ps(_mm_loadu_ps(&y[i]), _mm_mul_ps(nvy, vdt));
+		_mm_storeu_ps(&vy[i], nvy);
+		_mm_storeu_ps(&x[i], nx);
+		_mm_storeu_ps(&y[i], ny);
+		_mm_storeu_ps(&age[i], _mm_add_ps(_mm_loadu_ps(&age[i]), vms));
+	}
+#endif
+
+	for (; i < count; ++i) {
+		vy[i] += gravity[i] * dt;
+		x[i] += vx[i] * dt;
+		y[i] += vy[i] * dt;
+		age[i] += fms;
+	}
+
+	// backwards, so whatever gets moved into a hole has already been checked
+	for (size_t j = count; j-- > 0;) {
+		if (age[j] >= life[j]) removeAt(j);
+	}
+}
+
+void ParticleSystem::queueDraws(DrawList& list, const SDL_Rect& camera) const {
+	bool isCulling = camera.w > 0 && camera.h > 0;
+	double zoom = scene.getZoom();
+	for (size_t i = 0; i < count; ++i) {
+		const ParticleEffect& e = effects[effect[i]];
+		const SDL_Rect& bounds = effectBounds[effect[i]];
+		// particles are positioned by their center
+		int left = (int)x[i] - bounds.w / 2;
+		int top = (int)y[i] - bounds.h / 2;
+		if (isCulling && (left >= camera.x + camera.w || left + bounds.w <= camera.x ||
+			top >= camera.y + camera.h || top + bounds.h <= camera.y)) {
+			continue;
+		}
+
+		int length = (int)e.order->getLength();
+		if (length == 0) continue;
+		int frame = (int)(age[i] * length / life[i]);
+		if (frame >= length) frame = length - 1;
+		e.order->queueFrame(list, e.zlayer, left - bounds.x - camera.x, top - bounds.y - camera.y, frame, e.scale, 0, zoom);
+	}
+}
+
+void ParticleSystem::removeAt(size_t i) {
+	size_t last = --count;
+	if (i == last) return;
+	x[i] = x[last];
+	y[i] = y[last];
+	vx[i] = vx[last];
+	vy[i] = vy[last];
+	gravity[i] = gravity[last];
+	age[i] = age[last];
+	life[i] = life[last];
+	effect[i] = effect[last];
+}
+
+float ParticleSystem::random() {
+	seed ^= seed << 13;
+	seed ^= seed >> 17;
+	seed ^= seed << 5;
+	// top 24 bits, so it fits a float exactly
+	return (seed >> 8) * (1.0f / 16777216.0f);
+}
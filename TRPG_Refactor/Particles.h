@@ -0,0 +1,108 @@
+#ifndef PARTICLES_H
+#define PARTICLES_H
+
+#include <vector>
+
+#include <SDL.h>
+
+#include "GraphicsEngine.h"
+
+typedef Uint32 ParticleEffectID;
+
+/// <summary>
+/// ParticleEffect -- what one kind of particle burst looks like (an explosion, a puff of
+/// smoke, a muzzle flash). Register these once with ParticleSystem::addEffect, then emit
+/// them by id as often as you like.
+/// </summary>
+typedef struct pe_ {
+	// what each particle looks like. The Order plays once, stretched over the particle's life.
+	const Order* order;
+	int zlayer;
+	float scale;
+	// how many particles one emit makes
+	int count;
+	// the direction particles head off in, in degrees (0 is right, 90 is down), and how far
+	// either side of it they can stray. A spread of 180 goes every which way.
+	float direction;
+	float spread;
+	// launch speed range, in pixels per second
+	float minSpeed;
+	float maxSpeed;
+	// pulls particles down, in pixels per second per second. Negative for smoke that rises.
+	float gravity;
+	// lifetime range, in ms
+	float minLife;
+	float maxLife;
+	// particles start up to this many pixels away from the emit point
+	float radius;
+} ParticleEffect;
+
+/// <summary>
+/// ParticleSystem -- lots of short-lived, fire-and-forget graphics for combat effects. A Sprite
+/// per particle would be far too heavy, so particles don't have Sprites (or ids) at all. They're
+/// kept as flat arrays (one per field) in a pool that's allocated once, and update moves all of
+/// them in one SIMD loop.
+///
+/// The system adds itself to its scene as a draw source, so particles draw along with the
+/// scene's Sprites and sort into the same zlayers. Particles showing the same frame end up
+/// next to each other in the DrawList, so a whole burst goes out as a handful of batches.
+///
+/// Like the scene, this should only be used from one thread (the game thread), and has to be
+/// destroyed before the scene is.
+/// </summary>
+class ParticleSystem {
+
+public:
+	// capacity is the most particles that can be alive at once. Emits past that are dropped.
+	ParticleSystem(AnimationManager& scene, size_t capacity = 4096);
+	~ParticleSystem();
+	// we're registered with the scene by address
+	ParticleSystem(const ParticleSystem&) = delete;
+	ParticleSystem& operator=(const ParticleSystem&) = delete;
+
+	// Registers a kind of effect. Returns the id to emit it with.
+	ParticleEffectID addEffect(const ParticleEffect& effect);
+	// Bursts one effect at (x, y) in world pixels. Returns how many particles were made,
+	// which is fewer than the effect's count if the pool is full.
+	int emit(ParticleEffectID effect, int x, int y);
+	// moves every particle forward ms milliseconds, and drops the ones that have run out
+	void update(Uint32 ms);
+	// gets rid of every live particle
+	void clear() { count = 0; }
+	size_t getActiveCount() const { return count; }
+	size_t getCapacity() const { return capacity; }
+
+private:
+	// adds every live particle that's on camera to the list; this is our DrawSource
+	void queueDraws(DrawList& list, const SDL_Rect& camera) const;
+	// removes particle i by moving the last one into its place
+	void removeAt(size_t i);
+	// a random number from 0 up to (not including) 1
+	float random();
+
+	AnimationManager& scene;
+	Uint32 drawSourceId;
+	std::vector<ParticleEffect> effects;
+	// each effect's Order bounds at its scale, so we can center particles and cull them
+	std::vector<SDL_Rect> effectBounds;
+
+	size_t count;
+	size_t capacity;
+	// One entry per particle in each of these. They're sized to the capacity (rounded up to a
+	// multiple of 4 for the SIMD loop) up front and never reallocated.
+	std::vector<float> x;
+	std::vector<float> y;
+	std::vector<float> vx;
+	std::vector<float> vy;
+	std::vector<float> gravity;
+	// ms since the particle was emitted, and how long it lasts
+	std::vector<float> age;
+	std::vector<float> life;
+	std::vector<ParticleEffectID> effect;
+
+	// xorshift state; particles don't need anything better
+	Uint32 seed;
+
+};
+
+#endif
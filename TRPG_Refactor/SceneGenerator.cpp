@@ -0,0 +1,209 @@
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <regex>
+#include <algorithm>
+
+#include <SDL.h>
+
+#include "GraphicsEngine.h"
+#include "MapFile.h"
+#include "SceneGenerator.h"
+
+// splitmix64's finalizer. Good enough to make every Tile look independent, and the same everywhere.
+static Uint64 mix(Uint64 x) {
+	x += 0x9E3779B97F4A7C15ULL;
+	x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+	return x ^ (x >> 31);
+}
+
+static Uint64 hashCell(Uint32 seed, Uint32 salt, int x, int y) {
+	return mix(((Uint64)seed << 32 | salt) ^ mix(((Uint64)(Uint32)x << 32) | (Uint32)y));
+}
+
+// a number from 0 up to (not including) 1
+static double toUnit(Uint64 hash) {
+	return (hash >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/// <summary>
+/// Reads objects.txt the same way AssetManager::loadAssets does, but only for the names, so it works
+/// without SDL or any of the images.
+/// </summary>
+/// <param name="objectsPath">Usually assets\objects.txt.</param>
+/// <returns>false if the file couldn't be read or has nothing in it.</returns>
+bool SceneGenerator::loadCandidates(const std::string& objectsPath) {
+	std::ifstream file{ objectsPath.c_str() };
+	if (!file) {
+		printf("ERROR: SceneGenerator::loadCandidates couldn't open %s.\n", objectsPath.c_str());
+		return false;
+	}
+	std::stringstream buf;
+	buf << file.rdbuf();
+	std::string s = buf.str();
+
+	// capture 1 is the asset name and capture 3 its orders, same as loadAssets
+	std::regex assetEntry("([A-Za-z0-9_]+)\\s*(?:\\(\\s*([0-9]+(?:\\.[0-9]+)?)\\s*\\))?\\s*:\\s*\\{\\s*([^}]*)\\s*");
+	// and capture 1 here is an order's name
+	std::regex orderName("([A-Za-z0-9_]+)\\s*\\(\\s*[0-9]+(?:\\.[0-9]+)?\\s*\\)\\s*=");
+
+	candidates.clear();
+	for (std::sregex_iterator asset(s.begin(), s.end(), assetEntry); asset != std::sregex_iterator(); ++asset) {
+		std::string orders = asset->str(3);
+		for (std::sregex_iterator order(orders.begin(), orders.end(), orderName); order != std::sregex_iterator(); ++order) {
+			MapPaletteName candidate;
+			candidate.asset = asset->str(1);
+			candidate.order = order->str(1);
+			candidates.push_back(candidate);
+		}
+	}
+	if (candidates.empty()) {
+		printf("ERROR: SceneGenerator::loadCandidates didn't find any assets in %s.\n", objectsPath.c_str());
+		return false;
+	}
+	return true;
+}
+
+bool SceneGenerator::generate(const SceneSettings& settings, MapFile& map, std::vector<SceneUnit>& units) const {
+	if (!generateMap(settings, map)) return false;
+	generateUnits(settings, units);
+	return true;
+}
+
+/// <summary>
+/// Picks settings.paletteSize candidates, gives each a random share of the map, and fills the map in
+/// patches of them, with some noise on top.
+/// </summary>
+/// <returns>false if there aren't any candidates, or the size is no good.</returns>
+bool SceneGenerator::generateMap(const SceneSettings& settings, MapFile& map) const {
+	if (candidates.empty()) {
+		printf("ERROR: SceneGenerator::generateMap has no candidates to make Tiles from.\n");
+		return false;
+	}
+
+	// a shuffle of the candidates, so the palette never repeats one
+	std::vector<size_t> order(candidates.size());
+	for (size_t i = 0; i < order.size(); ++i) {
+		order[i] = i;
+	}
+	for (size_t i = order.size(); i > 1; --i) {
+		std::swap(order[i - 1], order[mix(settings.seed ^ mix(i)) % i]);
+	}
+	size_t paletteSize = std::min(order.size(), (size_t)std::max(settings.paletteSize, 1));
+	paletteSize = std::min(paletteSize, (size_t)0x10000);
+	std::vector<MapPaletteName> palette;
+	for (size_t i = 0; i < paletteSize; ++i) {
+		palette.push_back(candidates[order[i]]);
+	}
+	if (!map.create(settings.name, settings.width, settings.height, settings.zlayer, palette)) return false;
+
+	// uneven shares look more like real maps (lots of grass, a bit of everything else), and picking
+	// goes through a cumulative table
+	std::vector<double> cumulative(paletteSize);
+	double total = 0;
+	for (size_t i = 0; i < paletteSize; ++i) {
+		double share = 0.1 + toUnit(mix(settings.seed + 0x5EED0000ULL + i));
+		total += share * share;
+		cumulative[i] = total;
+	}
+	auto pick = [&](Uint64 hash) {
+		double at = toUnit(hash) * total;
+		return (Uint16)(std::upper_bound(cumulative.begin(), cumulative.end() - 1, at) - cumulative.begin());
+	};
+
+	int patchSize = std::max(settings.patchSize, 1);
+	Uint16* cells = map.getCells();
+	for (int y = 0; y < settings.height; ++y) {
+		Uint16* row = cells + (size_t)y * settings.width;
+		for (int x = 0; x < settings.width; ++x) {
+			Uint64 own = hashCell(settings.seed, 1, x, y);
+			if (patchSize == 1 || toUnit(own) < settings.noise) {
+				row[x] = pick(mix(own));
+			}
+			else {
+				row[x] = pick(hashCell(settings.seed, 2, x / patchSize, y / patchSize));
+			}
+		}
+	}
+	return true;
+}
+
+/// <summary>
+/// Puts settings.unitCount units on random Tiles, each a random candidate. Units can share a Tile, so
+/// any count works on any size of map.
+/// </summary>
+void SceneGenerator::generateUnits(const SceneSettings& settings, std::vector<SceneUnit>& units) const {
+	units.clear();
+	if (candidates.empty() || settings.width <= 0 || settings.height <= 0) return;
+	units.reserve(std::max(settings.unitCount, 0));
+	for (int i = 0; i < settings.unitCount; ++i) {
+		Uint64 hash = hashCell(settings.seed, 3, i, 0);
+		SceneUnit unit;
+		const MapPaletteName& kind = candidates[mix(hash) % candidates.size()];
+		unit.asset = kind.asset;
+		unit.order = kind.order;
+		unit.x = (int)((hash & 0xFFFFFFFF) % (Uint32)settings.width);
+		unit.y = (int)((hash >> 32) % (Uint32)settings.height);
+		units.push_back(unit);
+	}
+}
+
+bool SceneGenerator::saveUnits(const std::string& path, const std::vector<SceneUnit>& units) {
+	std::ofstream file{ path.c_str(), std::ios::trunc };
+	if (!file) {
+		printf("ERROR: SceneGenerator::saveUnits could not open %s for writing.\n", path.c_str());
+		return false;
+	}
+	for (const SceneUnit& unit : units) {
+		file << unit.asset << "::" << unit.order << " " << unit.x << " " << unit.y << "\n";
+	}
+	if (!file) {
+		printf("ERROR: SceneGenerator::saveUnits failed writing %s.\n", path.c_str());
+		return false;
+	}
+	return true;
+}
+
+bool SceneGenerator::loadUnits(const std::string& path, std::vector<SceneUnit>& units) {
+	units.clear();
+	std::ifstream file{ path.c_str() };
+	if (!file) {
+		printf("ERROR: SceneGenerator::loadUnits couldn't open %s.\n", path.c_str());
+		return false;
+	}
+	std::string line;
+	int lineNumber = 0;
+	while (std::getline(file, line)) {
+		++lineNumber;
+		if (line.find_first_not_of(" \t\r") == std::string::npos) continue;
+		std::istringstream fields(line);
+		std::string kind;
+		SceneUnit unit;
+		size_t colons;
+		if (!(fields >> kind >> unit.x >> unit.y) || (colons = kind.find("::")) == std::string::npos) {
+			printf("ERROR: SceneGenerator::loadUnits hit a bad line %d in %s (should be asset::order x y).\n", lineNumber,
+				path.c_str());
+			units.clear();
+			return false;
+		}
+		unit.asset = kind.substr(0, colons);
+		unit.order = kind.substr(colons + 2);
+		units.push_back(unit);
+	}
+	return true;
+}
+
+void SceneGenerator::spawnUnits(AssetManager& assets, AnimationManager& scene, const std::vector<SceneUnit>& units, int tileSize,
+	std::vector<Sprite>& sprites) {
+	// big scenes would move every Sprite over and over otherwise
+	sprites.reserve(sprites.size() + units.size());
+	for (const SceneUnit& unit : units) {
+		if (!assets.hasAFrame(unit.asset)) continue;
+		const AFrame& graphics = assets.getAFrame(unit.asset);
+		if (graphics.getOrder(unit.order) == NULL) continue;
+		sprites.emplace_back(scene, graphics, unit.order, unit.x * tileSize, unit.y * tileSize, 0, 1.0);
+	}
+}
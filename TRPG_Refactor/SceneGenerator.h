@@ -0,0 +1,82 @@
+#ifndef SCENEGENERATOR_H
+#define SCENEGENERATOR_H
+
+#include <string>
+#include <vector>
+
+#include <SDL.h>
+
+#include "GraphicsEngine.h"
+#include "MapFile.h"
+
+/// <summary>
+/// SceneSettings -- what kind of scene SceneGenerator makes.
+/// </summary>
+typedef struct scs_ {
+	std::string name;
+	// in Tiles
+	int width, height;
+	int zlayer;
+	// how many different kinds of Tile the map uses, picked at random from the candidates
+	int paletteSize;
+	// Tiles come in square patches this many Tiles on a side that share a kind, like real terrain
+	// does, so chunks have a realistic mix of kinds. 1 makes every Tile independent.
+	int patchSize;
+	// the chance (0 to 1) a Tile ignores its patch and picks a kind of its own
+	double noise;
+	int unitCount;
+	// the same seed and settings always make the same scene
+	Uint32 seed;
+} SceneSettings;
+
+/// <summary>
+/// SceneUnit -- a unit SceneGenerator placed, on a Tile.
+/// </summary>
+typedef struct scu_ {
+	std::string asset;
+	std::string order;
+	int x, y;
+} SceneUnit;
+
+/// <summary>
+/// SceneGenerator -- makes made-up maps and unit placements of any size, for stress testing and
+/// benchmarks (rendering, pathfinding, loading) well past what the hand-made test content covers.
+///
+/// The kinds of Tile and unit come from objects.txt: every asset::order in it is a candidate. Maps
+/// come out as a MapFile, so they can be saved in either format and loaded by Layer like any other;
+/// units come out as a list, which spawnUnits turns into Sprites, or saveUnits writes to a file.
+///
+/// Every Tile is worked out on its own from a hash of the seed and its position, so generating is
+/// one pass over the cells with nothing else allocated, and any size of map takes the same settings.
+/// Doesn't need SDL started, except for spawnUnits.
+/// </summary>
+class SceneGenerator {
+
+public:
+	SceneGenerator() = default;
+	~SceneGenerator() = default;
+
+	// reads every asset::order in an objects.txt as a candidate, replacing any there were
+	bool loadCandidates(const std::string& objectsPath);
+	void setCandidates(const std::vector<MapPaletteName>& candidates) { this->candidates = candidates; }
+	const std::vector<MapPaletteName>& getCandidates() const { return candidates; }
+
+	// fills in map (anything in it is thrown out) and units per settings
+	bool generate(const SceneSettings& settings, MapFile& map, std::vector<SceneUnit>& units) const;
+	bool generateMap(const SceneSettings& settings, MapFile& map) const;
+	void generateUnits(const SceneSettings& settings, std::vector<SceneUnit>& units) const;
+
+	// one unit per line, as asset::order x y
+	static bool saveUnits(const std::string& path, const std::vector<SceneUnit>& units);
+	static bool loadUnits(const std::string& path, std::vector<SceneUnit>& units);
+	// makes a Sprite in scene for each unit, tileSize pixels per Tile. Units whose asset or order
+	// doesn't exist are skipped.
+	static void spawnUnits(AssetManager& assets, AnimationManager& scene, const std::vector<SceneUnit>& units, int tileSize,
+		std::vector<Sprite>& sprites);
+
+private:
+	std::vector<MapPaletteName> candidates;
+
+};
+
+#endif
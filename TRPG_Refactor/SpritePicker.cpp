@@ -0,0 +1,184 @@
+#include <stdio.h>
+#include <vector>
+#include <algorithm>
+
+#include <SDL.h>
+
+#include "GraphicsEngine.h"
+#include "SpritePicker.h"
+
+// rounds down instead of towards 0, for positions left of or above the grid
+static int floorDiv(int a, int b) {
+	return (a >= 0) ? a / b : -((-a + b - 1) / b);
+}
+
+static bool contains(const SDL_Rect& r, int x, int y) {
+	return x >= r.x && x < r.x + r.w && y >= r.y && y < r.y + r.h;
+}
+
+SpritePicker::SpritePicker(const AnimationManager& scene, int cellSize) :
+	scene{ scene },
+	cellSize{ std::max(cellSize, 1) },
+	gridCellSize{ std::max(cellSize, 1) },
+	isBuilt{ false },
+	builtGeneration{ 0 },
+	originX{ 0 },
+	originY{ 0 },
+	columns{ 0 },
+	rows{ 0 },
+	found{ },
+	cellStarts{ },
+	entries{ },
+	large{ },
+	cursors{ }
+{
+
+}
+
+/// <summary>
+/// Goes over the scene in the same order buildDrawList does, then deals what it found out to the cells
+/// in two passes (count, then fill) and sorts each cell top-most first. Anything too big for the
+/// grid gets set aside in the count pass instead. Skipped if the scene's generation hasn't moved.
+/// </summary>
+void SpritePicker::rebuild() {
+	if (isBuilt && builtGeneration == scene.getGeneration()) return;
+	isBuilt = true;
+	builtGeneration = scene.getGeneration();
+
+	found.clear();
+	Uint64 queued = 0;
+	for (Uint32 id = 0; id < scene.getRecordCount(); ++id) {
+		const SpriteRecord& r = scene.getSprite(id);
+		// children get added along with their parents
+		if ((r.flags & (SPRITE_ALIVE | SPRITE_VISIBLE)) != (SPRITE_ALIVE | SPRITE_VISIBLE) || r.parent != SPRITE_NO_ID) continue;
+		addTree(id, r.x, r.y, r.zlayer, 0, &queued);
+	}
+
+	columns = 0;
+	rows = 0;
+	cellStarts.assign(1, 0);
+	entries.clear();
+	large.clear();
+	if (found.empty()) return;
+
+	Sint64 left = found[0].bounds.x, top = found[0].bounds.y, right = left, bottom = top;
+	for (const PickEntry& e : found) {
+		left = std::min(left, (Sint64)e.bounds.x);
+		top = std::min(top, (Sint64)e.bounds.y);
+		right = std::max(right, (Sint64)e.bounds.x + e.bounds.w);
+		bottom = std::max(bottom, (Sint64)e.bounds.y + e.bounds.h);
+	}
+	originX = (int)left;
+	originY = (int)top;
+
+	// a few far flung Sprites would make a huge grid of nothing, so cells get bigger until it's reasonable
+	Sint64 maxCells = std::max((Sint64)SPRITEPICKER_MIN_CELLS, (Sint64)found.size() * SPRITEPICKER_CELLS_PER_SPRITE);
+	Sint64 size = cellSize, wide, high;
+	while (true) {
+		wide = std::max((right - left + size - 1) / size, (Sint64)1);
+		high = std::max((bottom - top + size - 1) / size, (Sint64)1);
+		if (wide * high <= maxCells) break;
+		size *= 2;
+	}
+	gridCellSize = (int)size;
+	columns = (int)wide;
+	rows = (int)high;
+
+	// the range of cells each Sprite touches, and how many that is. Bounds are never empty (see
+	// Order::getBounds), and they're all inside the grid by construction.
+	auto span = [this](const PickEntry& e, int* firstX, int* firstY, int* lastX, int* lastY) {
+		*firstX = (e.bounds.x - originX) / gridCellSize;
+		*firstY = (e.bounds.y - originY) / gridCellSize;
+		*lastX = std::min(columns - 1, (e.bounds.x + std::max(e.bounds.w, 1) - 1 - originX) / gridCellSize);
+		*lastY = std::min(rows - 1, (e.bounds.y + std::max(e.bounds.h, 1) - 1 - originY) / gridCellSize);
+		return (Sint64)(*lastX - *firstX + 1) * (*lastY - *firstY + 1);
+	};
+
+	cellStarts.assign((size_t)columns * rows + 1, 0);
+	for (const PickEntry& e : found) {
+		int firstX, firstY, lastX, lastY;
+		if (span(e, &firstX, &firstY, &lastX, &lastY) > SPRITEPICKER_MAX_CELLS_PER_SPRITE) {
+			large.push_back(e);
+			continue;
+		}
+		for (int y = firstY; y <= lastY; ++y) {
+			for (int x = firstX; x <= lastX; ++x) {
+				++cellStarts[(size_t)y * columns + x + 1];
+			}
+		}
+	}
+	for (size_t i = 1; i < cellStarts.size(); ++i) {
+		cellStarts[i] += cellStarts[i - 1];
+	}
+	entries.resize(cellStarts.back());
+	cursors.assign(cellStarts.begin(), cellStarts.end() - 1);
+	// Going backwards, each cell fills up last queued first, which is already top-most first unless
+	// zlayers or children got mixed in. Cells only hold a few Sprites, so sorting them is cheap.
+	for (size_t i = found.size(); i-- > 0;) {
+		const PickEntry& e = found[i];
+		int firstX, firstY, lastX, lastY;
+		if (span(e, &firstX, &firstY, &lastX, &lastY) > SPRITEPICKER_MAX_CELLS_PER_SPRITE) continue;
+		for (int y = firstY; y <= lastY; ++y) {
+			for (int x = firstX; x <= lastX; ++x) {
+				entries[cursors[(size_t)y * columns + x]++] = e;
+			}
+		}
+	}
+	for (size_t cell = 0; cell + 1 < cellStarts.size(); ++cell) {
+		if (cellStarts[cell + 1] - cellStarts[cell] < 2) continue;
+		std::sort(entries.begin() + cellStarts[cell], entries.begin() + cellStarts[cell + 1],
+			[](const PickEntry& a, const PickEntry& b) { return a.key > b.key; });
+	}
+	std::sort(large.begin(), large.end(), [](const PickEntry& a, const PickEntry& b) { return a.key > b.key; });
+}
+
+void SpritePicker::addTree(Uint32 id, int worldX, int worldY, int zlayer, int depth, Uint64* queued) {
+	const SpriteRecord& r = scene.getSprite(id);
+	SDL_Rect bounds;
+	scene.getOrder(r.order)->getBounds(&bounds, GE_ScaleFromFixed(r.scale));
+	bounds.x += worldX;
+	bounds.y += worldY;
+
+	// the same order DrawList::sort puts them in, short of texture: zlayer, then sublayer (which is how
+	// deep a child is), then the order they were queued in
+	PickEntry e;
+	e.bounds = bounds;
+	e.key = ((Uint64)(Uint16)(zlayer + 0x8000) << 48) | ((Uint64)std::min(depth, 0xFF) << 40) | (*queued & 0xFFFFFFFFFFULL);
+	e.id = id;
+	found.push_back(e);
+	++*queued;
+
+	for (Uint32 c = r.firstChild; c != SPRITE_NO_ID; c = scene.getSprite(c).nextSibling) {
+		const SpriteRecord& child = scene.getSprite(c);
+		if (child.flags & SPRITE_VISIBLE) {
+			addTree(c, worldX + child.x, worldY + child.y, zlayer, depth + 1, queued);
+		}
+	}
+}
+
+Uint32 SpritePicker::pick(int worldX, int worldY) const {
+	const PickEntry* top = NULL;
+	int x = floorDiv(worldX - originX, gridCellSize), y = floorDiv(worldY - originY, gridCellSize);
+	if (x >= 0 && x < columns && y >= 0 && y < rows) {
+		size_t cell = (size_t)y * columns + x;
+		for (Uint32 i = cellStarts[cell]; i < cellStarts[cell + 1]; ++i) {
+			if (contains(entries[i].bounds, worldX, worldY)) {
+				top = &entries[i];
+				break;
+			}
+		}
+	}
+
+	// a big Sprite only wins if it's above what the cell found, and those all come first
+	for (const PickEntry& e : large) {
+		if (top != NULL && e.key < top->key) break;
+		if (contains(e.bounds, worldX, worldY)) return e.id;
+	}
+	return (top == NULL) ? SPRITE_NO_ID : top->id;
+}
+
+Uint32 SpritePicker::pickScreen(int screenX, int screenY) const {
+	int worldX, worldY;
+	scene.screenToWorld(screenX, screenY, &worldX, &worldY);
+	return pick(worldX, worldY);
+}
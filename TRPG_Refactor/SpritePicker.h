@@ -0,0 +1,101 @@
+#ifndef SPRITEPICKER_H
+#define SPRITEPICKER_H
+
+#include <vector>
+
+#include <SDL.h>
+
+#include "GraphicsEngine.h"
+
+// how wide (and tall) a grid cell is by default, in world pixels. About a Tile works well.
+#define SPRITEPICKER_DEFAULT_CELL_SIZE	64
+// The grid gets at most this many cells per Sprite (or SPRITEPICKER_MIN_CELLS, if that's more).
+// Sprites spread out over a huge world get bigger cells instead of a huge, mostly empty grid.
+#define SPRITEPICKER_CELLS_PER_SPRITE	4
+#define SPRITEPICKER_MIN_CELLS			4096
+// Sprites that would go in more cells than this are kept in one list of their own instead, so a few
+// huge overlapping ones don't copy themselves into thousands of cells every rebuild
+#define SPRITEPICKER_MAX_CELLS_PER_SPRITE	16
+
+/// <summary>
+/// PickEntry -- one Sprite in one cell of a SpritePicker's grid.
+/// </summary>
+typedef struct pke_ {
+	// where the Sprite is in the world, see Order::getBounds
+	SDL_Rect bounds;
+	// where it comes in the draw order (zlayer, then how deep a child it is, then queue order), so
+	// a bigger key draws on top
+	Uint64 key;
+	Uint32 id;
+} PickEntry;
+
+/// <summary>
+/// SpritePicker -- finds the Sprite on top at a point (under the mouse, say) without looking at
+/// every Sprite in the scene.
+///
+/// rebuild goes over the scene once and puts every visible Sprite in each cell of a uniform grid its
+/// bounds touch, top-most first. Picking is then working out the cell and going down its list until
+/// something contains the point, which for any sensible cell size is a handful of rects, however many
+/// Sprites there are. So hovering costs next to nothing no matter how often the mouse moves, and the
+/// one pass over the scene only happens once per tick, like buildDrawList's. Sprites that would cover
+/// more than SPRITEPICKER_MAX_CELLS_PER_SPRITE cells go in a separate top-most first list that every
+/// pick checks too (stopping as soon as what's left is under the cell's hit), so keep those to a few.
+/// Run the game with --bench-picking to see what rebuilding and picking cost.
+///
+/// Hits go by a Sprite's bounds (every frame of its Order), not its pixels. Top-most goes by zlayer,
+/// then child depth, then the order Sprites get queued in; two overlapping Sprites in the same zlayer
+/// and depth actually draw in texture order (see DrawList::sort), so keep things that overlap on
+/// different zlayers if it matters which gets picked. Zoomed out to icons, the full-size bounds are
+/// still what gets hit.
+///
+/// What gets picked is the scene as of the last rebuild, so call it once a tick (or before picking).
+/// It checks the scene's generation first and does nothing if no record changed since the last one,
+/// so a tick where nothing moved costs nothing. Everything runs on whichever thread owns the scene
+/// (the game thread).
+/// </summary>
+class SpritePicker {
+
+public:
+	// scene has to outlive us
+	SpritePicker(const AnimationManager& scene, int cellSize = SPRITEPICKER_DEFAULT_CELL_SIZE);
+	~SpritePicker() = default;
+	SpritePicker(const SpritePicker&) = delete;
+	SpritePicker& operator=(const SpritePicker&) = delete;
+
+	// indexes every Sprite in the scene as it is right now, unless nothing's changed since last time
+	void rebuild();
+	// the id of the top-most Sprite at a world position, or SPRITE_NO_ID if there isn't one
+	Uint32 pick(int worldX, int worldY) const;
+	// the same, for a position on the backbuffer, through the scene's camera and zoom
+	Uint32 pickScreen(int screenX, int screenY) const;
+	// how many Sprites the last rebuild found
+	size_t getSpriteCount() const { return found.size(); }
+	// the cell size the last rebuild actually used, in world pixels
+	int getCellSize() const { return gridCellSize; }
+
+private:
+	// adds id (at the given world position) and then its visible children to found
+	void addTree(Uint32 id, int worldX, int worldY, int zlayer, int depth, Uint64* queued);
+
+	const AnimationManager& scene;
+	int cellSize;
+	int gridCellSize;
+	// the scene's generation when the last rebuild ran, if there's been one
+	bool isBuilt;
+	Uint64 builtGeneration;
+	// the world position of cell (0, 0)'s top left
+	int originX, originY;
+	int columns, rows;
+	// every Sprite in the scene, once each. Kept so rebuilding doesn't reallocate.
+	std::vector<PickEntry> found;
+	// cell i's entries are entries[cellStarts[i], cellStarts[i + 1]), top-most first
+	std::vector<Uint32> cellStarts;
+	std::vector<PickEntry> entries;
+	// the Sprites too big for the grid, top-most first
+	std::vector<PickEntry> large;
+	// where rebuild is up to in each cell
+	std::vector<Uint32> cursors;
+
+};
+
+#endif
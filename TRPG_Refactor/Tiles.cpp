@@ -1,78 +1,126 @@
 #include <stdio.h>
 #include <string>
-#include <fstream>
-#include <sstream>
-#include <regex>
+#include <cmath>
+#include <algorithm>
+#include <functional>
 #include <unordered_map>
+#include <unordered_set>
 
 #include <SDL.h>
 #include <SDL_image.h>
 
 #include "GraphicsEngine.h"
+#include "MapFile.h"
+#include "Autotile.h"
 #include "Tiles.h"
 
-#define MAPR_HEADER_SIZE	8
-#define MAPR_NAME_SIZE		31
-#define MAPR_DIM_SIZE		4
-#define MAPR_DIM_DELIM_SIZE	2
-#define MAPR_ZLAYER_SIZE	11
-#define MAPR_ZLAYER_POS		7
-#define MAPR_PAL_START_SIZE	10
-#define MAPR_PAL_INDEX_SIZE	5
-#define MAPR_PAL_ENTRY_SIZE	51
-#define MAPR_PAL_END_SIZE	2
-#define MAPR_TILE_SIZE		5
-
-FrameOrder::FrameOrder(const AFrame& frame, std::string order) :
-	frame{ frame },
-	order{ order } {}
-
-Tile::Tile(const AFrame& graphic, std::string order, int x, int y, double size) :
-	graphic{graphic, order},
-	order{ order },
-	x{ x },
-	y{ y },
-	size{ size }
-	{ updateInternal(); }
-
-void Tile::updatePos(int nx, int ny) {
-	x = nx;
-	y = ny;
-	updateInternal();
-}
-
-void Tile::updateScale(double nsize) {
-	size = nsize;
-	updateInternal();
-}
-
-void Tile::updateInternal() {
-	this->graphic.setScale(this->size);
-	int w{ 0 }, h{ 0 };
-	graphic.getScaledWidthHeight(&w, &h);
-	this->graphic.setXY(this->x * w, this->y * h);
-}
-
-void Tile::setVisible(bool isVisible) {
-	graphic.setVisible(isVisible);
-}
-
-
-
-Layer::Layer(AssetManager& assets, std::string mappath, double scale) :
+Layer::Layer(AssetManager& assets, AnimationManager& scene, SDL_Renderer* renderer, std::string mappath, double scale,
+	int chunkCacheSize, int pageWindow) :
 	assets{ assets },
+	scene{ scene },
+	drawSourceId{ 0 },
 	map{ },
+	cells{ NULL },
+	palette{ },
 	width{ },
 	height{ },
 	zlayer{ },
 	mapName{ },
 	isInit{ false },
 	scale{ scale },
-	isVisible{ true }
+	isVisible{ true },
+	tileWidth{ 0 },
+	tileHeight{ 0 },
+	chunks{ },
+	chunksWide{ 0 },
+	chunksHigh{ 0 },
+	drawCount{ 0 },
+	lodBlocks{ },
+	lodBakesLeft{ 0 },
+	overview{ NULL },
+	overviewTexels{ },
+	overviewDirty{ 0, 0, 0, 0 },
+	overviewStep{ 1 },
+	overviewWidth{ 0 },
+	overviewHeight{ 0 },
+	stack{ NULL },
+	pager{ NULL },
+	pageWindow{ pageWindow },
+	pagesWide{ 0 },
+	pages{ },
+	pageEdits{ },
+	isLoggingCells{ true },
+	nextChangeListenerId{ 0 },
+	autotiles{ NULL }
 {
 	if (!loadMap(mappath)) {
 		printf("ERROR: Layer::loadMap returned error state.\n");
+		return;
+	}
+
+	// no point making more textures than every phase of every chunk could use
+	int slots = std::min(chunkCacheSize, chunksWide * chunksHigh * LAYER_MAX_PHASES);
+	for (int i = 0; i < slots; ++i) {
+		SDL_Texture* texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_TARGET,
+			LAYER_CHUNK_TILES * tileWidth, LAYER_CHUNK_TILES * tileHeight);
+		if (texture == NULL) {
+			// we can still draw without them, just slower
+			printf("ERROR: Layer::Layer could only make %d of %d chunk textures. SDL_Error: %s\n", i, slots, SDL_GetError());
+			break;
+		}
+		SDL_SetTextureBlendMode(texture, SDL_BLENDMODE_BLEND);
+		chunkTextures.push_back(texture);
+		slotOwner.push_back(LAYER_NO_SLOT);
+		slotLevel.push_back(0);
+		slotLastUsed.push_back(0);
+	}
+
+	// big maps get a texel per square of Tiles, as few to a side as keeps it under the size limit
+	overviewStep = std::max(1, std::max((width + LAYER_OVERVIEW_MAX_SIZE - 1) / LAYER_OVERVIEW_MAX_SIZE,
+		(height + LAYER_OVERVIEW_MAX_SIZE - 1) / LAYER_OVERVIEW_MAX_SIZE));
+	overviewWidth = (width + overviewStep - 1) / overviewStep;
+	overviewHeight = (height + overviewStep - 1) / overviewStep;
+	overview = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_STATIC, overviewWidth, overviewHeight);
+	if (overview == NULL) {
+		// zoomed all the way out just keeps using the last LOD level
+		printf("ERROR: Layer::Layer could not make its overview texture. SDL_Error: %s\n", SDL_GetError());
 	}
+	else {
+		SDL_SetTextureBlendMode(overview, SDL_BLENDMODE_BLEND);
+		// each texel is a whole Tile (or more), so keep the edges sharp
+		SDL_SetTextureScaleMode(overview, SDL_ScaleModeNearest);
+		overviewTexels.assign((size_t)overviewWidth * overviewHeight, 0);
+		overviewDirty = { 0, 0, width, height };
+	}
+
+	drawSourceId = scene.addDrawSource([this](DrawList& list, const SDL_Rect& camera) {
+		queueChunks(list, camera);
+		});
+}
+
+Layer::~Layer() {
+	if (stack != NULL) stack->removeLayer(*this);
+	if (isInit) scene.removeDrawSource(drawSourceId);
+	for (SDL_Texture* texture : chunkTextures) {
+		SDL_DestroyTexture(texture);
+	}
+	if (overview != NULL) SDL_DestroyTexture(overview);
+	// waits for the pager's thread to finish up
+	delete pager;
+}
+
+static LayerPaletteEntry makePaletteEntry(const AFrame& graphics, const Order* order) {
+	LayerPaletteEntry entry;
+	entry.graphics = &graphics;
+	entry.order = order;
+	entry.isAnimated = order->getLength() > 1 && order->getMSPerFrame() >= 1;
+	entry.color = 0;
+	entry.autotileKind = AUTOTILE_NONE;
+	if (order->getLength() > 0) {
+		SDL_Color c = order->getAverageColor(0);
+		entry.color = ((Uint32)c.r << 24) | ((Uint32)c.g << 16) | ((Uint32)c.b << 8) | c.a;
+	}
+	return entry;
 }
 
 bool Layer::loadMap(std::string mappath) {
@@ -82,98 +130,66 @@ bool Layer::loadMap(std::string mappath) {
 		return false;
 	}
 
-	std::ifstream mapFile{ mappath.c_str() };
-	if (!mapFile) {
-		printf("ERROR: Layer::loadMap could not load map file at %s.\n", mappath.c_str());
-		return false;
-	}
-
-	char header[MAPR_HEADER_SIZE];
-	char mapName[MAPR_NAME_SIZE];
-	char width[MAPR_DIM_SIZE];
-	char height[MAPR_DIM_SIZE];
-	char zlayer[MAPR_ZLAYER_SIZE];
-	char paletteStart[MAPR_PAL_START_SIZE];
-	char paletteBuf[MAPR_PAL_INDEX_SIZE];
-	char entryBuf[MAPR_TILE_SIZE];
-
-	// make sure we're working with a real map file
-	mapFile.getline(header, MAPR_HEADER_SIZE);
-	if (std::strncmp(header, "MAPFILE", MAPR_HEADER_SIZE) != 0) {
-		printf("ERROR: Layer::loadMap loaded invalid map file at %s.\n", mappath.c_str());
-		return false;
+	if (pageWindow > 0) {
+		// cells come in a page at a time from the pager's thread, so all we read here is the header
+		if (!map.loadBinaryHeader(mappath)) {
+			printf("ERROR: Layer::loadMap can only page binary maps (see --convert-map), and %s isn't one.\n", mappath.c_str());
+			return false;
+		}
+		pager = new MapPager(mappath, map, LAYER_PAGE_TILES);
+		if (!pager->isOpen()) return false;
+		pagesWide = pager->getPagesWide();
 	}
-	// we don't do any more syntax checking -- if it's wrong, it'll blow up (perhaps silently), so be careful
-	// Remember that whitespace is important -- no extra newlines or spaces or tabs (unless required)
+	// binary maps come back pointing straight into the file, so this is all the loading the cells get
+	else if (!map.load(mappath)) return false;
 
-	mapFile.getline(mapName, MAPR_NAME_SIZE);
-	mapFile.getline(width, MAPR_DIM_SIZE, ' ');
-	// this read gets clobbered right afterwards (it just flushes the " x ")
-	mapFile.getline(height, MAPR_DIM_DELIM_SIZE, ' ');
-	mapFile.getline(height, MAPR_DIM_SIZE);
-	mapFile.getline(zlayer, MAPR_ZLAYER_SIZE);
-	mapFile.getline(paletteStart, MAPR_PAL_START_SIZE);
+	this->width = map.getWidth();
+	this->height = map.getHeight();
+	this->zlayer = map.getZLayer();
+	this->mapName = map.getName();
+	cells = map.getCells();
 	
-	this->width = std::stoi(width);
-	this->height = std::stoi(height);
-	std::string zlayerstd(zlayer);
-	this->zlayer = std::stoi(zlayerstd.substr(MAPR_ZLAYER_POS));
-	this->mapName.assign(mapName);
-	
-	// read palette entries
-	std::unordered_map<int, FrameOrder> palette;
-	mapFile.getline(paletteBuf, MAPR_PAL_INDEX_SIZE, '\t');
-	while (paletteBuf[0] != '}') {
-		char buffer[MAPR_PAL_ENTRY_SIZE];
-		mapFile.getline(buffer, MAPR_PAL_ENTRY_SIZE);
-
-		int thisIndex = std::stoi(paletteBuf);
-		std::string bufferstd(buffer);
-		size_t colonIndex = bufferstd.find(":");
-		// i lied we check for this too, though we'd likely hit an out of bounds exception either way
-		if (colonIndex == std::string::npos) {
-			printf("ERROR: Layer::loadMap hit invalid palette entry %s.\n", buffer);
-			// probably memory leaks if this happens but eh whatever, it's broke here anyways
+	// the map's palette indices are already dense, so ours have to line up with them one for one
+	palette.clear();
+	for (const MapPaletteName& name : map.getPalette()) {
+		const AFrame& graphics = assets.getAFrame(name.asset);
+		const Order* order = graphics.getOrder(name.order);
+		if (order == NULL) {
+			printf("ERROR: Layer::loadMap hit palette entry %s::%s with an order that doesn't exist.\n",
+				name.asset.c_str(), name.order.c_str());
 			return false;
 		}
-
-		std::string assetName = bufferstd.substr(0, colonIndex);
-		// debug
-		//printf("assetName: %s\n", assetName.c_str());
-		
-		// +2 gets to the start of the string after the "::"
-		// we don't check for out of bounds here ( it should break anyway, but lazy :( )
-		std::string orderName = bufferstd.substr(colonIndex + 2);
-		// debug
-		//printf("orderName: %s\n", orderName.c_str());
-
-		FrameOrder animFrame{assets.getAFrame(assetName), orderName};
-		palette.emplace(thisIndex, animFrame);
-
-		mapFile.getline(paletteBuf, MAPR_PAL_INDEX_SIZE, '\t');
-	}
-
-	map.clear();
-	for (int i = 0; i < this->height; ++i) {
-		std::vector<Tile> row;
-		row.clear();
-		// since the last index has a \n delim instead of a \t, we treat it differently
-		for (int j = 0; j < this->width - 1; ++j) {
-			mapFile.getline(entryBuf, MAPR_TILE_SIZE, '\t');
-			FrameOrder thisFrame = palette.at(std::stoi(entryBuf));
-			// we now know enough to make our Tile for this position
-			row.emplace_back(thisFrame.frame, thisFrame.order, j, i, scale);
-		}
-		// grab our last index and make the Tile
-		mapFile.getline(entryBuf, MAPR_TILE_SIZE);
-		FrameOrder thisFrame = palette.at(std::stoi(entryBuf));
-		Tile k{ thisFrame.frame, thisFrame.order, this->width - 1, i, scale };
-		row.push_back(k);
-		// this row is complete; push it to the complete map and continue
-		map.push_back(row);
+		palette.push_back(makePaletteEntry(graphics, order));
 	}
 	
-	setZLayer(this->zlayer);
+	if (palette.empty()) {
+		printf("ERROR: Layer::loadMap got a map with an empty palette at %s.\n", mappath.c_str());
+		return false;
+	}
+	// every Tile is the same size, so the first one tells us
+	palette[(cells != NULL) ? cells[0] : 0].order->getWidthHeight(&tileWidth, &tileHeight, 0);
+	tileWidth = (int)(tileWidth * scale);
+	tileHeight = (int)(tileHeight * scale);
+
+	chunksWide = (this->width + LAYER_CHUNK_TILES - 1) / LAYER_CHUNK_TILES;
+	chunksHigh = (this->height + LAYER_CHUNK_TILES - 1) / LAYER_CHUNK_TILES;
+	LayerChunk empty;
+	empty.isDirty = true;
+	empty.isBaked = false;
+	empty.isLive = false;
+	empty.phaseCount = 0;
+	empty.phasePeriod = 0;
+	empty.shownPhase = 0;
+	chunks.assign(chunksWide * chunksHigh, empty);
+
+	LayerLodBlock emptyBlock;
+	emptyBlock.slot = LAYER_NO_SLOT;
+	emptyBlock.isBaked = false;
+	lodBlocks.clear();
+	for (int level = 1; level <= LAYER_LOD_LEVELS; ++level) {
+		int blocksHigh = (chunksHigh + (1 << level) - 1) >> level;
+		lodBlocks.emplace_back((size_t)getBlocksWide(level) * blocksHigh, emptyBlock);
+	}
 	
 	// if we made it here, we successfully init-ed
 	isInit = true;
@@ -181,26 +197,1281 @@ bool Layer::loadMap(std::string mappath) {
 }
 
 void Layer::updateTile(int x, int y, std::string asset, std::string order) {
-	Tile t{ assets.getAFrame(asset), order, x, y, map[y][x].getScale() };
-	map[y][x] = t;
+	if (x < 0 || y < 0 || x >= width || y >= height) {
+		printf("ERROR: Layer::updateTile got a position (%d, %d) outside the map.\n", x, y);
+		return;
+	}
+	Uint16 index;
+	if (!findTileKind(asset, order, &index)) return;
+
+	SDL_Rect touched = { 0, 0, 0, 0 };
+	setCell(x, y, index, &touched);
+	finishEdit(touched);
+}
+
+/// <summary>
+/// Sets every Tile in area to the same thing, redrawing once at the end.
+/// </summary>
+/// <param name="area">In Tiles. Whatever's outside the map is ignored.</param>
+/// <param name="asset">The name of the AFrame.</param>
+/// <param name="order">The name of the Order in it.</param>
+/// <returns>How many Tiles changed. Tiles on pages that aren't loaded yet are changed when they are, and aren't counted.</returns>
+int Layer::fillTiles(const SDL_Rect& area, std::string asset, std::string order) {
+	Uint16 index;
+	SDL_Rect clipped;
+	if (!findTileKind(asset, order, &index) || !clipToMap(area, &clipped)) return 0;
+
+	int changed = 0;
+	SDL_Rect touched = { 0, 0, 0, 0 };
+	if (pager != NULL) {
+		// every page gets the fill logged as one entry, and only the pages that are in get written now
+		isLoggingCells = false;
+		for (int py = clipped.y / LAYER_PAGE_TILES; py <= (clipped.y + clipped.h - 1) / LAYER_PAGE_TILES; ++py) {
+			for (int px = clipped.x / LAYER_PAGE_TILES; px <= (clipped.x + clipped.w - 1) / LAYER_PAGE_TILES; ++px) {
+				SDL_Rect page = { px * LAYER_PAGE_TILES, py * LAYER_PAGE_TILES, LAYER_PAGE_TILES, LAYER_PAGE_TILES }, part;
+				SDL_IntersectRect(&clipped, &page, &part);
+				addPageFill(part, index);
+				if (pages.count(py * pagesWide + px) == 0) continue;
+				for (int y = part.y; y < part.y + part.h; ++y) {
+					for (int x = part.x; x < part.x + part.w; ++x) {
+						if (setCell(x, y, index, &touched)) ++changed;
+					}
+				}
+			}
+		}
+		isLoggingCells = true;
+	}
+	else {
+		for (int y = clipped.y; y < clipped.y + clipped.h; ++y) {
+			for (int x = clipped.x; x < clipped.x + clipped.w; ++x) {
+				if (setCell(x, y, index, &touched)) ++changed;
+			}
+		}
+	}
+	finishEdit(touched);
+	return changed;
+}
+
+/// <summary>
+/// Sets a scattered bunch of Tiles to the same thing, redrawing once at the end.
+/// </summary>
+/// <param name="positions">In Tiles. Any outside the map are skipped.</param>
+/// <param name="asset">The name of the AFrame.</param>
+/// <param name="order">The name of the Order in it.</param>
+/// <returns>How many Tiles changed. Tiles on pages that aren't loaded yet are changed when they are, and aren't counted.</returns>
+int Layer::setTiles(const std::vector<SDL_Point>& positions, std::string asset, std::string order) {
+	Uint16 index;
+	if (!findTileKind(asset, order, &index)) return 0;
+
+	int changed = 0;
+	SDL_Rect touched = { 0, 0, 0, 0 };
+	for (const SDL_Point& position : positions) {
+		if (position.x < 0 || position.y < 0 || position.x >= width || position.y >= height) continue;
+		if (setCell(position.x, position.y, index, &touched)) ++changed;
+	}
+	finishEdit(touched);
+	return changed;
+}
+
+/// <summary>
+/// Swaps one kind of Tile for another everywhere in area (grass for snow, say), redrawing once at the end.
+/// </summary>
+/// <param name="area">In Tiles. Whatever's outside the map is ignored.</param>
+/// <param name="fromAsset">The AFrame and Order of the Tiles to replace.</param>
+/// <param name="fromOrder"></param>
+/// <param name="toAsset">The AFrame and Order to replace them with.</param>
+/// <param name="toOrder"></param>
+/// <returns>How many Tiles changed. Tiles on pages that aren't loaded are skipped, since we can't know what's there.</returns>
+int Layer::replaceTiles(const SDL_Rect& area, std::string fromAsset, std::string fromOrder, std::string toAsset,
+	std::string toOrder) {
+	const Order* from = assets.getAFrame(fromAsset).getOrder(fromOrder);
+	Uint16 fromIndex, toIndex;
+	SDL_Rect clipped;
+	if (from == NULL || !clipToMap(area, &clipped)) return 0;
+	// if it's not in the palette, there aren't any to replace
+	if (!findPaletteOrder(from, &fromIndex)) return 0;
+	if (!findTileKind(toAsset, toOrder, &toIndex) || fromIndex == toIndex) return 0;
+
+	int changed = 0;
+	SDL_Rect touched = { 0, 0, 0, 0 };
+	for (int y = clipped.y; y < clipped.y + clipped.h; ++y) {
+		for (int x = clipped.x; x < clipped.x + clipped.w; ++x) {
+			int stride;
+			const Uint16* cell = findCell(x, y, &stride);
+			if (cell != NULL && *cell == fromIndex && setCell(x, y, toIndex, &touched)) ++changed;
+		}
+	}
+	finishEdit(touched);
+	return changed;
+}
+
+bool Layer::findTileKind(const std::string& asset, const std::string& order, Uint16* index) {
+	const AFrame& graphics = assets.getAFrame(asset);
+	const Order* o = graphics.getOrder(order);
+	if (o == NULL) {
+		printf("ERROR: Layer::findTileKind got an order %s that doesn't exist.\n", order.c_str());
+		return false;
+	}
+	return findPaletteIndex(graphics, o, index);
+}
+
+bool Layer::clipToMap(const SDL_Rect& area, SDL_Rect* clipped) const {
+	SDL_Rect map = { 0, 0, width, height };
+	return SDL_IntersectRect(&area, &map, clipped) == SDL_TRUE;
+}
+
+bool Layer::setCell(int x, int y, Uint16 index, SDL_Rect* touched) {
+	int stride;
+	Uint16* cell = findCell(x, y, &stride);
+	if (cell == NULL) {
+		// not paged in yet; it'll be put in when it is
+		if (isLoggingCells) addPageEdit(x, y, index);
+		return false;
+	}
+	// an autotiled Tile painted over with another variant of itself is no change
+	int kind = palette[index].autotileKind;
+	if (kind != AUTOTILE_NONE && palette[*cell].autotileKind == kind) return false;
+	if (!writeCell(x, y, cell, index, touched)) return false;
+	// the variant isn't picked until the whole edit's in, since the neighbors might change too
+	if (autotiles != NULL) autotileEdits.push_back(SDL_Point{ x, y });
+	return true;
+}
+
+bool Layer::writeCell(int x, int y, Uint16* cell, Uint16 index, SDL_Rect* touched) {
+	if (*cell == index) return false;
+	if (editRecorder) editChanges.push_back(LayerCellChange{ x, y, *cell, index });
+	*cell = index;
+	// there's nowhere to write edits back to, so they're kept for when the page is read in again
+	if (pager != NULL && isLoggingCells) addPageEdit(x, y, index);
+	markChunkDirty((y / LAYER_CHUNK_TILES) * chunksWide + x / LAYER_CHUNK_TILES);
+
+	if (!changeListeners.empty()) changedCells.push_back(SDL_Point{ x, y });
+
+	if (touched->w == 0) {
+		*touched = { x, y, 1, 1 };
+	}
+	else {
+		int right = std::max(touched->x + touched->w, x + 1), bottom = std::max(touched->y + touched->h, y + 1);
+		touched->x = std::min(touched->x, x);
+		touched->y = std::min(touched->y, y);
+		touched->w = right - touched->x;
+		touched->h = bottom - touched->y;
+	}
+	return true;
+}
+
+void Layer::finishEdit(SDL_Rect touched) {
+	resolveEdits(&touched);
+	if (!editChanges.empty()) {
+		if (editRecorder) editRecorder(editChanges);
+		editChanges.clear();
+	}
+	notifyChanged();
+	invalidateTiles(touched);
+}
+
+void Layer::applyChanges(const std::vector<LayerCellChange>& changes, bool isReverse) {
+	SDL_Rect touched = { 0, 0, 0, 0 };
+	for (const LayerCellChange& change : changes) {
+		Uint16 index = isReverse ? change.from : change.to;
+		if (change.x < 0 || change.y < 0 || change.x >= width || change.y >= height || index >= palette.size()) continue;
+		int stride;
+		Uint16* cell = findCell(change.x, change.y, &stride);
+		if (cell == NULL) {
+			addPageEdit(change.x, change.y, index);
+			continue;
+		}
+		writeCell(change.x, change.y, cell, index, &touched);
+	}
+	// whoever's recording already knows about these
+	editChanges.clear();
+	finishEdit(touched);
+}
+
+void Layer::invalidateTiles(const SDL_Rect& area) {
+	if (stack == NULL || area.w == 0) return;
+	SDL_Rect pixels = { area.x * tileWidth, area.y * tileHeight, area.w * tileWidth, area.h * tileHeight };
+	stack->invalidate(pixels);
+}
+
+void Layer::notifyChanged() {
+	if (changedCells.empty()) return;
+	for (const LayerChangeListener& listener : changeListeners) {
+		listener(changedCells);
+	}
+	changedCells.clear();
+}
+
+Uint32 Layer::addChangeListener(LayerChangeListener listener) {
+	changeListeners.push_back(listener);
+	changeListenerIds.push_back(nextChangeListenerId);
+	return nextChangeListenerId++;
+}
+
+void Layer::removeChangeListener(Uint32 id) {
+	for (size_t i = 0; i < changeListenerIds.size(); ++i) {
+		if (changeListenerIds[i] == id) {
+			changeListeners.erase(changeListeners.begin() + i);
+			changeListenerIds.erase(changeListenerIds.begin() + i);
+			return;
+		}
+	}
+}
+
+void Layer::setAutotiles(const AutotileSet* rules) {
+	if (!isInit) return;
+	autotiles = rules;
+	autotileEdits.clear();
+	variantIndices.assign((rules == NULL) ? 0 : (size_t)rules->getKindCount() * AUTOTILE_BLOB_VARIANTS, -1);
+	for (LayerPaletteEntry& entry : palette) {
+		entry.autotileKind = (rules == NULL) ? AUTOTILE_NONE : rules->findKind(entry.order);
+	}
+	if (rules == NULL) return;
+
+	// paged maps only have some of it in; the rest gets done as it comes in
+	SDL_Rect touched = { 0, 0, 0, 0 };
+	if (pager == NULL) {
+		resolveArea(SDL_Rect{ 0, 0, width, height }, &touched);
+	}
+	else {
+		for (const std::pair<const int, LayerPage>& page : pages) {
+			int left = (page.first % pagesWide) * LAYER_PAGE_TILES, top = (page.first / pagesWide) * LAYER_PAGE_TILES;
+			resolveArea(SDL_Rect{ left, top, LAYER_PAGE_TILES, LAYER_PAGE_TILES }, &touched);
+		}
+	}
+	finishEdit(touched);
+}
+
+/// <summary>
+/// Autotiles the 3x3 around every cell the edit in progress set. Those are the only Tiles whose neighbor
+/// masks could have changed, and picking a variant never changes a Tile's kind, so nothing further out
+/// needs looking at.
+/// </summary>
+/// <param name="touched">Grown to cover any Tile that changes, in Tiles.</param>
+void Layer::resolveEdits(SDL_Rect* touched) {
+	if (autotileEdits.empty()) return;
+	std::vector<SDL_Point> edits;
+	edits.swap(autotileEdits);
+
+	// big fills are cheaper done as one box than as overlapping 3x3s
+	SDL_Rect box = { touched->x - 1, touched->y - 1, touched->w + 2, touched->h + 2 };
+	if ((Uint64)edits.size() * 9 >= (Uint64)box.w * box.h) {
+		resolveArea(box, touched);
+		return;
+	}
+
+	std::vector<SDL_Point> around;
+	around.reserve(edits.size() * 9);
+	for (const SDL_Point& edit : edits) {
+		for (int dy = -1; dy <= 1; ++dy) {
+			for (int dx = -1; dx <= 1; ++dx) {
+				around.push_back(SDL_Point{ edit.x + dx, edit.y + dy });
+			}
+		}
+	}
+	// edits next to each other share most of their neighbors
+	std::sort(around.begin(), around.end(), [](const SDL_Point& a, const SDL_Point& b) {
+		return (a.y != b.y) ? a.y < b.y : a.x < b.x;
+		});
+	around.erase(std::unique(around.begin(), around.end(), [](const SDL_Point& a, const SDL_Point& b) {
+		return a.x == b.x && a.y == b.y;
+		}), around.end());
+	for (const SDL_Point& cell : around) {
+		if (cell.x < 0 || cell.y < 0 || cell.x >= width || cell.y >= height) continue;
+		resolveCell(cell.x, cell.y, touched);
+	}
+}
+
+void Layer::resolveArea(const SDL_Rect& area, SDL_Rect* touched) {
+	SDL_Rect clipped;
+	if (autotiles == NULL || !clipToMap(area, &clipped)) return;
+	for (int y = clipped.y; y < clipped.y + clipped.h; ++y) {
+		for (int x = clipped.x; x < clipped.x + clipped.w; ++x) {
+			resolveCell(x, y, touched);
+		}
+	}
+}
+
+bool Layer::resolveCell(int x, int y, SDL_Rect* touched) {
+	// clockwise from north, same as the AUTOTILE_ bits
+	static const int offsetX[8] = { 0, 1, 1, 1, 0, -1, -1, -1 };
+	static const int offsetY[8] = { -1, -1, 0, 1, 1, 1, 0, -1 };
+
+	int stride;
+	Uint16* cell = findCell(x, y, &stride);
+	if (cell == NULL) return false;
+	int kind = palette[*cell].autotileKind;
+	if (kind == AUTOTILE_NONE) return false;
+
+	Uint8 mask = 0;
+	for (int i = 0; i < 8; ++i) {
+		int nx = x + offsetX[i], ny = y + offsetY[i];
+		// roads run off the edge of the map rather than stopping short of it. Same for pages that
+		// aren't in yet; this gets worked out again when they are.
+		bool isConnected = true;
+		if (nx >= 0 && ny >= 0 && nx < width && ny < height) {
+			int neighborStride;
+			const Uint16* neighbor = findCell(nx, ny, &neighborStride);
+			if (neighbor != NULL) isConnected = autotiles->connects(kind, palette[*neighbor].autotileKind);
+		}
+		if (isConnected) mask |= (Uint8)(1 << i);
+	}
+
+	Uint16 index;
+	if (!findVariantIndex(kind, autotiles->getVariant(kind, mask), &index)) return false;
+	return writeCell(x, y, cell, index, touched);
+}
+
+bool Layer::findVariantIndex(int kind, int variant, Uint16* index) {
+	int& cached = variantIndices[(size_t)kind * AUTOTILE_BLOB_VARIANTS + variant];
+	if (cached >= 0) {
+		*index = (Uint16)cached;
+		return true;
+	}
+	const AutotileRule& rule = autotiles->getRule(kind);
+	if (!findPaletteIndex(*rule.graphics, rule.variants[variant], index)) return false;
+	cached = *index;
+	return true;
+}
+
+bool Layer::findPaletteOrder(const Order* order, Uint16* index) const {
+	// palettes are small, so a straight search is fine
+	for (size_t i = 0; i < palette.size(); ++i) {
+		if (palette[i].order == order) {
+			*index = (Uint16)i;
+			return true;
+		}
+	}
+	return false;
+}
+
+bool Layer::findPaletteIndex(const AFrame& graphics, const Order* order, Uint16* index) {
+	if (findPaletteOrder(order, index)) return true;
+	if (palette.size() >= LAYER_MAX_PALETTE) {
+		printf("ERROR: Layer::findPaletteIndex ran out of palette entries.\n");
+		return false;
+	}
+	palette.push_back(makePaletteEntry(graphics, order));
+	if (autotiles != NULL) palette.back().autotileKind = autotiles->findKind(order);
+	*index = (Uint16)(palette.size() - 1);
+	return true;
 }
 
 void Layer::setZLayer(int zlayer) {
+	if (stack != NULL && zlayer != this->zlayer) stack->invalidateAll();
 	this->zlayer = zlayer;
-	for (auto& i : map) {
-		for (auto& j : i) {
-			j.updateZLayer(zlayer);
+}
+
+void Layer::setVisible(bool isVisible) {
+	if (stack != NULL && isVisible != this->isVisible) stack->invalidateAll();
+	this->isVisible = isVisible;
+}
+
+// rounds down instead of towards 0, so cameras left of or above the map work out
+static int floorDiv(int a, int b) {
+	return (a >= 0) ? a / b : -((-a + b - 1) / b);
+}
+
+// where a world rect (relative to the view) lands on screen. Edges are rounded down after zooming,
+// so rects that touch still touch.
+static SDL_Rect zoomRect(int x, int y, int w, int h, double zoom) {
+	if (zoom == 1) return SDL_Rect{ x, y, w, h };
+	int left = (int)floor(x * zoom), top = (int)floor(y * zoom);
+	SDL_Rect rect = { left, top, (int)floor((x + w) * zoom) - left, (int)floor((y + h) * zoom) - top };
+	return rect;
+}
+
+static Uint64 gcd(Uint64 a, Uint64 b) {
+	while (b != 0) {
+		Uint64 t = a % b;
+		a = b;
+		b = t;
+	}
+	return a;
+}
+
+/// <summary>
+/// Draws every chunk the camera can see as one quad each, baking the ones that changed first. Chunks
+/// that couldn't get their textures draw their Tiles one by one instead. Zoomed out, it's LayerLodBlocks
+/// or the overview instead of chunks.
+/// </summary>
+/// <param name="list">The scene's DrawList.</param>
+/// <param name="camera">What the scene's camera sees. If it has no size, every chunk is drawn.</param>
+void Layer::queueChunks(DrawList& list, const SDL_Rect& camera) {
+	if (!isInit || !isVisible || stack != NULL) return;
+
+	// all the animated Tiles share one clock, same as synchronized Sprites
+	Uint32 now = SDL_GetTicks();
+	++drawCount;
+	lodBakesLeft = LAYER_LOD_BAKES_PER_FRAME;
+
+	SDL_Rect region = camera;
+	if (camera.w <= 0 || camera.h <= 0) {
+		region = { 0, 0, width * tileWidth, height * tileHeight };
+	}
+	updatePages(region);
+	prepareChunks(list, region, now);
+	queueRegion(list, region, camera.x, camera.y, zlayer, now);
+}
+
+bool Layer::getChunkRange(const SDL_Rect& region, int* firstX, int* firstY, int* lastX, int* lastY, int level) const {
+	int chunkWidth = (LAYER_CHUNK_TILES * tileWidth) << level, chunkHeight = (LAYER_CHUNK_TILES * tileHeight) << level;
+	if (region.w <= 0 || region.h <= 0 || chunkWidth <= 0 || chunkHeight <= 0) return false;
+	int wide = getBlocksWide(level), high = (chunksHigh + (1 << level) - 1) >> level;
+	*firstX = std::max(0, floorDiv(region.x, chunkWidth));
+	*firstY = std::max(0, floorDiv(region.y, chunkHeight));
+	*lastX = std::min(wide - 1, floorDiv(region.x + region.w - 1, chunkWidth));
+	*lastY = std::min(high - 1, floorDiv(region.y + region.h - 1, chunkHeight));
+	return *firstX <= *lastX && *firstY <= *lastY;
+}
+
+/// <summary>
+/// Picks what to draw at a zoom. Chunk textures are drawn at between half and full size; once they'd
+/// be smaller than that, the next level of LayerLodBlocks is, and so on.
+/// </summary>
+int Layer::getLodLevel(double zoom) const {
+	int level = 0;
+	while (level < LAYER_LOD_LEVELS && zoom * (2 << level) <= 1) ++level;
+	if (level == LAYER_LOD_LEVELS && overview != NULL && zoom * (2 << level) <= 1) return LAYER_LOD_OVERVIEW;
+	return level;
+}
+
+void Layer::prepareChunks(DrawList& list, const SDL_Rect& region, Uint32 now) {
+	int level = getLodLevel(scene.getZoom());
+	if (level == LAYER_LOD_OVERVIEW) {
+		prepareOverview(list);
+		return;
+	}
+	if (level > 0) {
+		prepareBlocks(list, region, level);
+		return;
+	}
+
+	int firstX, firstY, lastX, lastY;
+	if (!getChunkRange(region, &firstX, &firstY, &lastX, &lastY)) return;
+
+	for (int cy = firstY; cy <= lastY; ++cy) {
+		for (int cx = firstX; cx <= lastX; ++cx) {
+			int index = cy * chunksWide + cx;
+			LayerChunk& chunk = chunks[index];
+			if (!isChunkLoaded(cx, cy)) continue;
+
+			if (chunk.isDirty) updatePhases(index);
+			// queueRegion draws the Tiles one by one for chunks left without textures
+			if ((int)chunk.slots.size() != chunk.phaseCount && !acquireSlots(index)) continue;
+
+			for (int slot : chunk.slots) {
+				slotLastUsed[slot] = drawCount;
+			}
+			if (!chunk.isBaked || hasAnimationMoved(chunk, now)) bakeChunk(list, index, now);
 		}
 	}
 }
 
-void Layer::setVisible(bool isVisible) {
-	if (this->isVisible != isVisible) {
-		this->isVisible = isVisible;
-		for (auto& i : map) {
-			for (auto& j : i) {
-				j.setVisible(isVisible);
+void Layer::queueRegion(DrawList& list, const SDL_Rect& region, int originX, int originY, int zlayer, Uint32 now) {
+	double zoom = scene.getZoom();
+	int level = getLodLevel(zoom);
+	if (level == LAYER_LOD_OVERVIEW) {
+		queueOverview(list, originX, originY, zlayer, zoom, 0);
+		return;
+	}
+	if (level > 0) {
+		queueBlocks(list, region, originX, originY, zlayer, level, zoom);
+		return;
+	}
+
+	int firstX, firstY, lastX, lastY;
+	if (!getChunkRange(region, &firstX, &firstY, &lastX, &lastY)) return;
+
+	int chunkWidth = LAYER_CHUNK_TILES * tileWidth, chunkHeight = LAYER_CHUNK_TILES * tileHeight;
+	for (int cy = firstY; cy <= lastY; ++cy) {
+		for (int cx = firstX; cx <= lastX; ++cx) {
+			const LayerChunk& chunk = chunks[cy * chunksWide + cx];
+			if (!isChunkLoaded(cx, cy)) continue;
+			int left = cx * chunkWidth - originX, top = cy * chunkHeight - originY;
+			if (!chunk.isBaked) {
+				queueTiles(list, cx, cy, left, top, zlayer, now, zoom);
+				continue;
 			}
+			SDL_Rect dst = zoomRect(left, top, chunkWidth, chunkHeight, zoom);
+			list.add(zlayer, chunkTextures[chunk.slots[getPhase(chunk, now)]], dst);
 		}
 	}
 }
+
+/// <summary>
+/// Gets every LayerLodBlock touching region baked, as far as this frame's budget goes. Blocks that don't
+/// make it get the overview under them for now, and (in a stack) a redraw next frame to try again.
+/// </summary>
+void Layer::prepareBlocks(DrawList& list, const SDL_Rect& region, int level) {
+	int firstX, firstY, lastX, lastY;
+	if (!getChunkRange(region, &firstX, &firstY, &lastX, &lastY, level)) return;
+	// in case some blocks have to fall back on it
+	if (overview != NULL) prepareOverview(list);
+
+	std::vector<LayerLodBlock>& blocks = lodBlocks[level - 1];
+	int wide = getBlocksWide(level);
+	int blockWidth = (LAYER_CHUNK_TILES * tileWidth) << level, blockHeight = (LAYER_CHUNK_TILES * tileHeight) << level;
+	for (int by = firstY; by <= lastY; ++by) {
+		for (int bx = firstX; bx <= lastX; ++bx) {
+			int index = by * wide + bx;
+			LayerLodBlock& block = blocks[index];
+			if (block.slot != LAYER_NO_SLOT) slotLastUsed[block.slot] = drawCount;
+			if (block.isBaked) continue;
+
+			if (lodBakesLeft > 0 && block.slot == LAYER_NO_SLOT) {
+				block.slot = takeSlot(level, index);
+				if (block.slot != LAYER_NO_SLOT) slotLastUsed[block.slot] = drawCount;
+			}
+			if (lodBakesLeft <= 0 || block.slot == LAYER_NO_SLOT) {
+				SDL_Rect area = { bx * blockWidth, by * blockHeight, blockWidth, blockHeight };
+				if (stack != NULL) stack->invalidate(area);
+				continue;
+			}
+			bakeBlock(list, level, index);
+			--lodBakesLeft;
+		}
+	}
+}
+
+void Layer::queueBlocks(DrawList& list, const SDL_Rect& region, int originX, int originY, int zlayer, int level, double zoom) {
+	int firstX, firstY, lastX, lastY;
+	if (!getChunkRange(region, &firstX, &firstY, &lastX, &lastY, level)) return;
+
+	const std::vector<LayerLodBlock>& blocks = lodBlocks[level - 1];
+	int wide = getBlocksWide(level);
+	int blockWidth = (LAYER_CHUNK_TILES * tileWidth) << level, blockHeight = (LAYER_CHUNK_TILES * tileHeight) << level;
+	bool isMissing = false;
+	for (int by = firstY; by <= lastY; ++by) {
+		for (int bx = firstX; bx <= lastX; ++bx) {
+			const LayerLodBlock& block = blocks[by * wide + bx];
+			if (!block.isBaked) {
+				isMissing = true;
+				continue;
+			}
+			SDL_Rect dst = zoomRect(bx * blockWidth - originX, by * blockHeight - originY, blockWidth, blockHeight, zoom);
+			list.add(zlayer, chunkTextures[block.slot], dst);
+		}
+	}
+	// under everything, so baked blocks cover it
+	if (isMissing && overview != NULL) queueOverview(list, originX, originY, zlayer, zoom, -1);
+}
+
+/// <summary>
+/// Draws every Tile under a LayerLodBlock into its texture, shrunk to fit. Chunks that aren't paged in are
+/// left empty; they mark the block dirty when they come in.
+/// </summary>
+void Layer::bakeBlock(DrawList& list, int level, int index) {
+	LayerLodBlock& block = lodBlocks[level - 1][index];
+	int span = 1 << level;
+	int wide = getBlocksWide(level);
+	int firstX = (index % wide) * span, firstY = (index / wide) * span;
+	int chunkWidth = LAYER_CHUNK_TILES * tileWidth, chunkHeight = LAYER_CHUNK_TILES * tileHeight;
+
+	list.beginTarget(chunkTextures[block.slot]);
+	for (int cy = firstY; cy < std::min(firstY + span, chunksHigh); ++cy) {
+		for (int cx = firstX; cx < std::min(firstX + span, chunksWide); ++cx) {
+			if (!isChunkLoaded(cx, cy)) continue;
+			// at 0 ms every Order is on its first frame
+			queueTiles(list, cx, cy, (cx - firstX) * chunkWidth, (cy - firstY) * chunkHeight, 0, 0, 1.0 / span);
+		}
+	}
+	list.endTarget();
+	block.isBaked = true;
+}
+
+void Layer::releaseBlock(int level, int index) {
+	LayerLodBlock& block = lodBlocks[level - 1][index];
+	if (block.slot != LAYER_NO_SLOT) slotOwner[block.slot] = LAYER_NO_SLOT;
+	block.slot = LAYER_NO_SLOT;
+	block.isBaked = false;
+}
+
+void Layer::markChunkDirty(int chunk) {
+	chunks[chunk].isDirty = true;
+	int cx = chunk % chunksWide, cy = chunk / chunksWide;
+	for (int level = 1; level <= LAYER_LOD_LEVELS; ++level) {
+		lodBlocks[level - 1][(cy >> level) * getBlocksWide(level) + (cx >> level)].isBaked = false;
+	}
+	if (overview != NULL) {
+		SDL_Rect tiles = { cx * LAYER_CHUNK_TILES, cy * LAYER_CHUNK_TILES, LAYER_CHUNK_TILES, LAYER_CHUNK_TILES };
+		if (overviewDirty.w == 0) overviewDirty = tiles;
+		else SDL_UnionRect(&overviewDirty, &tiles, &overviewDirty);
+	}
+}
+
+/// <summary>
+/// Works the overview's dirty texels out again from the palette and uploads them. On big maps each texel
+/// is just the Tile in the middle of its square, so this stays one lookup per texel. Tiles on pages that
+/// aren't in keep whatever they showed last.
+/// </summary>
+void Layer::prepareOverview(DrawList& list) {
+	SDL_Rect map = { 0, 0, width, height };
+	SDL_Rect tiles;
+	if (overviewDirty.w == 0 || !SDL_IntersectRect(&overviewDirty, &map, &tiles)) return;
+	overviewDirty = { 0, 0, 0, 0 };
+
+	int left = tiles.x / overviewStep, top = tiles.y / overviewStep;
+	SDL_Rect rect = { left, top, (tiles.x + tiles.w - 1) / overviewStep - left + 1, (tiles.y + tiles.h - 1) / overviewStep - top + 1 };
+	for (int ty = rect.y; ty < rect.y + rect.h; ++ty) {
+		for (int tx = rect.x; tx < rect.x + rect.w; ++tx) {
+			int x = std::min(tx * overviewStep + overviewStep / 2, width - 1);
+			int y = std::min(ty * overviewStep + overviewStep / 2, height - 1);
+			int stride;
+			const Uint16* cell = findCell(x, y, &stride);
+			if (cell != NULL) overviewTexels[(size_t)ty * overviewWidth + tx] = palette[*cell].color;
+		}
+	}
+
+	if (rect.w == overviewWidth) {
+		list.uploadTexture(overview, rect, &overviewTexels[(size_t)rect.y * overviewWidth]);
+		return;
+	}
+	std::vector<Uint32> pixels((size_t)rect.w * rect.h);
+	for (int y = 0; y < rect.h; ++y) {
+		const Uint32* row = &overviewTexels[(size_t)(rect.y + y) * overviewWidth + rect.x];
+		std::copy(row, row + rect.w, &pixels[(size_t)y * rect.w]);
+	}
+	list.uploadTexture(overview, rect, pixels.data());
+}
+
+void Layer::queueOverview(DrawList& list, int originX, int originY, int zlayer, double zoom, int sublayer) {
+	// on big maps the last row and column of texels cover less than a full square, so it stretches a
+	// hair to fit, which nobody can see from that far out
+	SDL_Rect dst = zoomRect(-originX, -originY, width * tileWidth, height * tileHeight, zoom);
+	list.add(zlayer, overview, dst, sublayer);
+}
+
+int Layer::getPhase(const LayerChunk& chunk, Uint32 now) const {
+	// with one phase this is always 0
+	int phase = 0;
+	if (chunk.phaseCount > 1) {
+		Uint32 into = now % chunk.phasePeriod;
+		while (phase + 1 < chunk.phaseCount && chunk.phaseStarts[phase + 1] <= into) ++phase;
+	}
+	return phase;
+}
+
+/// <summary>
+/// Finds every chunk in view that looks different now than the last time this was called, because
+/// one of its animated Tiles changed frame, and tells our stack to redraw it.
+/// </summary>
+/// <param name="view">What the stack can see, in world pixels.</param>
+/// <param name="now">The time the stack is drawing for.</param>
+void Layer::invalidateAnimated(const SDL_Rect& view, Uint32 now) {
+	int firstX, firstY, lastX, lastY;
+	if (stack == NULL || !isInit || !isVisible || !getChunkRange(view, &firstX, &firstY, &lastX, &lastY)) return;
+	// zoomed out, nothing animates
+	if (getLodLevel(scene.getZoom()) > 0) return;
+
+	int chunkWidth = LAYER_CHUNK_TILES * tileWidth, chunkHeight = LAYER_CHUNK_TILES * tileHeight;
+	for (int cy = firstY; cy <= lastY; ++cy) {
+		for (int cx = firstX; cx <= lastX; ++cx) {
+			int index = cy * chunksWide + cx;
+			LayerChunk& chunk = chunks[index];
+			if (!isChunkLoaded(cx, cy)) continue;
+			// whatever changed in here already marked itself
+			if (chunk.isDirty) updatePhases(index);
+			if (chunk.animated.empty()) continue;
+
+			bool hasChanged = false;
+			if (chunk.isLive) {
+				chunk.shownFrames.resize(chunk.animated.size(), -1);
+				for (size_t i = 0; i < chunk.animated.size(); ++i) {
+					int frame = chunk.animated[i]->getFrameAt(now);
+					if (frame != chunk.shownFrames[i]) {
+						chunk.shownFrames[i] = frame;
+						hasChanged = true;
+					}
+				}
+			}
+			else {
+				int phase = getPhase(chunk, now);
+				hasChanged = phase != chunk.shownPhase;
+				chunk.shownPhase = phase;
+			}
+			if (hasChanged) {
+				SDL_Rect area = { cx * chunkWidth, cy * chunkHeight, chunkWidth, chunkHeight };
+				stack->invalidate(area);
+			}
+		}
+	}
+}
+
+Uint16 Layer::getTile(int x, int y) const {
+	int stride;
+	const Uint16* cell = findCell(x, y, &stride);
+	return (cell == NULL) ? 0 : *cell;
+}
+
+bool Layer::isTileLoaded(int x, int y) const {
+	return pager == NULL || pages.count(getPageIndex(x, y)) != 0;
+}
+
+bool Layer::getTileAt(int worldX, int worldY, int* x, int* y) const {
+	if (tileWidth <= 0 || tileHeight <= 0) return false;
+	int tileX = floorDiv(worldX, tileWidth), tileY = floorDiv(worldY, tileHeight);
+	if (tileX < 0 || tileX >= width || tileY < 0 || tileY >= height) return false;
+	*x = tileX;
+	*y = tileY;
+	return true;
+}
+
+Uint16* Layer::findCell(int x, int y, int* stride) {
+	if (pager == NULL) {
+		*stride = width;
+		return cells + (size_t)y * width + x;
+	}
+	std::unordered_map<int, LayerPage>::iterator found = pages.find(getPageIndex(x, y));
+	if (found == pages.end()) return NULL;
+	*stride = LAYER_PAGE_TILES;
+	return &found->second.cells[(y % LAYER_PAGE_TILES) * LAYER_PAGE_TILES + x % LAYER_PAGE_TILES];
+}
+
+const Uint16* Layer::findCell(int x, int y, int* stride) const {
+	return const_cast<Layer*>(this)->findCell(x, y, stride);
+}
+
+bool Layer::isChunkLoaded(int cx, int cy) const {
+	return pager == NULL || pages.count(getPageIndex(cx * LAYER_CHUNK_TILES, cy * LAYER_CHUNK_TILES)) != 0;
+}
+
+/// <summary>
+/// Keeps the pages around view loaded, for Layers that page. Takes whatever the pager has finished, asks
+/// for whatever's missing (closest to the middle of view first, plus a page of border all round so it's
+/// usually there before it's needed), and throws out the furthest pages if that puts us over pageWindow.
+/// Never waits on the pager, so pages that aren't in yet just don't draw.
+/// </summary>
+/// <param name="view">What's on screen, in world pixels.</param>
+void Layer::updatePages(const SDL_Rect& view) {
+	if (pager == NULL || !isInit) return;
+
+	int pageWidth = LAYER_PAGE_TILES * tileWidth, pageHeight = LAYER_PAGE_TILES * tileHeight;
+	int pagesHigh = pager->getPagesHigh();
+	int firstX = std::max(0, floorDiv(view.x, pageWidth) - 1);
+	int firstY = std::max(0, floorDiv(view.y, pageHeight) - 1);
+	int lastX = std::min(pagesWide - 1, floorDiv(view.x + std::max(view.w, 1) - 1, pageWidth) + 1);
+	int lastY = std::min(pagesHigh - 1, floorDiv(view.y + std::max(view.h, 1) - 1, pageHeight) + 1);
+
+	// closest first, measured from the middle of the view to the middle of each page
+	Sint64 centerX = view.x + view.w / 2, centerY = view.y + view.h / 2;
+	std::vector<std::pair<Sint64, int>> nearby;
+	for (int py = firstY; py <= lastY; ++py) {
+		for (int px = firstX; px <= lastX; ++px) {
+			Sint64 dx = (Sint64)px * pageWidth + pageWidth / 2 - centerX, dy = (Sint64)py * pageHeight + pageHeight / 2 - centerY;
+			nearby.push_back(std::make_pair(dx * dx + dy * dy, py * pagesWide + px));
+		}
+	}
+	std::sort(nearby.begin(), nearby.end());
+	if ((int)nearby.size() > pageWindow) nearby.resize(pageWindow);
+	std::unordered_set<int> wanted;
+	for (const std::pair<Sint64, int>& page : nearby) {
+		wanted.insert(page.second);
+	}
+
+	std::vector<MapPage> loaded;
+	pager->takeLoaded(loaded);
+	for (MapPage& page : loaded) {
+		// the camera's moved on since we asked for it
+		if (pages.count(page.index) != 0 || wanted.count(page.index) == 0) continue;
+
+		LayerPage& resident = pages[page.index];
+		resident.cells = std::move(page.cells);
+		applyPageEdits(page.index);
+		forEachChunkInPage(page.index, [this](int chunk) {
+			markChunkDirty(chunk);
+			});
+		if (stack != NULL) stack->invalidate(getPageRect(page.index));
+		if (autotiles != NULL) {
+			// the file has whatever variants were saved, and the Tiles along the edges of the pages
+			// around it couldn't see into it until now
+			int left = (page.index % pagesWide) * LAYER_PAGE_TILES, top = (page.index / pagesWide) * LAYER_PAGE_TILES;
+			SDL_Rect area = { left - 1, top - 1, LAYER_PAGE_TILES + 2, LAYER_PAGE_TILES + 2 };
+			SDL_Rect touched = { 0, 0, 0, 0 };
+			// this isn't an edit, so there's nothing to undo or log
+			isLoggingCells = false;
+			resolveArea(area, &touched);
+			isLoggingCells = true;
+			editChanges.clear();
+			invalidateTiles(touched);
+		}
+		if (!changeListeners.empty()) {
+			int left = (page.index % pagesWide) * LAYER_PAGE_TILES, top = (page.index / pagesWide) * LAYER_PAGE_TILES;
+			for (int y = top; y < std::min(top + LAYER_PAGE_TILES, height); ++y) {
+				for (int x = left; x < std::min(left + LAYER_PAGE_TILES, width); ++x) {
+					changedCells.push_back(SDL_Point{ x, y });
+				}
+			}
+			notifyChanged();
+		}
+	}
+
+	// edited pages go too; their edits come back with them (see LayerPageEdits)
+	while ((int)pages.size() > pageWindow) {
+		int worst = -1;
+		Sint64 worstDistance = -1;
+		for (const std::pair<const int, LayerPage>& page : pages) {
+			if (wanted.count(page.first) != 0) continue;
+			SDL_Rect rect = getPageRect(page.first);
+			Sint64 dx = rect.x + rect.w / 2 - centerX, dy = rect.y + rect.h / 2 - centerY;
+			if (dx * dx + dy * dy > worstDistance) {
+				worstDistance = dx * dx + dy * dy;
+				worst = page.first;
+			}
+		}
+		if (worst < 0) break;
+		forEachChunkInPage(worst, [this](int chunk) {
+			releaseSlots(chunk);
+			// zoomed out views keep showing what was there
+			chunks[chunk].isDirty = true;
+			});
+		if (stack != NULL) stack->invalidate(getPageRect(worst));
+		pages.erase(worst);
+	}
+
+	// edits to pages that aren't in just wait for the camera to get there
+	std::vector<int> missing;
+	for (const std::pair<Sint64, int>& page : nearby) {
+		if (pages.count(page.second) == 0) missing.push_back(page.second);
+	}
+	pager->request(missing);
+}
+
+void Layer::addPageEdit(int x, int y, Uint16 index) {
+	LayerPageEdits& edits = pageEdits[getPageIndex(x, y)];
+	edits.cells[(Uint16)((y % LAYER_PAGE_TILES) * LAYER_PAGE_TILES + x % LAYER_PAGE_TILES)] = index;
+}
+
+/// <summary>
+/// Logs a fill as one entry, throwing out whatever older entries it covers completely. Pages that keep
+/// getting filled in bits have their fills folded into cells once there are too many.
+/// </summary>
+void Layer::addPageFill(const SDL_Rect& area, Uint16 index) {
+	LayerPageEdits& edits = pageEdits[getPageIndex(area.x, area.y)];
+	int left = area.x % LAYER_PAGE_TILES, top = area.y % LAYER_PAGE_TILES;
+	// whichever's fewer, the cells in the fill or the cells logged
+	if ((size_t)area.w * area.h < edits.cells.size()) {
+		for (int y = top; y < top + area.h; ++y) {
+			for (int x = left; x < left + area.w; ++x) {
+				edits.cells.erase((Uint16)(y * LAYER_PAGE_TILES + x));
+			}
+		}
+	}
+	else {
+		for (auto it = edits.cells.begin(); it != edits.cells.end();) {
+			int x = it->first % LAYER_PAGE_TILES, y = it->first / LAYER_PAGE_TILES;
+			if (x >= left && x < left + area.w && y >= top && y < top + area.h) it = edits.cells.erase(it);
+			else ++it;
+		}
+	}
+	edits.fills.erase(std::remove_if(edits.fills.begin(), edits.fills.end(), [&area](const LayerPageFill& fill) {
+		return fill.area.x >= area.x && fill.area.y >= area.y && fill.area.x + fill.area.w <= area.x + area.w &&
+			fill.area.y + fill.area.h <= area.y + area.h;
+		}), edits.fills.end());
+	edits.fills.push_back(LayerPageFill{ area, index });
+	if (edits.fills.size() <= LAYER_PAGE_MAX_FILLS) return;
+
+	// the cells logged so far are all newer than every fill, so they go on top
+	std::unordered_map<Uint16, Uint16> folded;
+	for (const LayerPageFill& fill : edits.fills) {
+		int fillLeft = fill.area.x % LAYER_PAGE_TILES, fillTop = fill.area.y % LAYER_PAGE_TILES;
+		for (int y = fillTop; y < fillTop + fill.area.h; ++y) {
+			for (int x = fillLeft; x < fillLeft + fill.area.w; ++x) {
+				folded[(Uint16)(y * LAYER_PAGE_TILES + x)] = fill.index;
+			}
+		}
+	}
+	for (const std::pair<const Uint16, Uint16>& cell : edits.cells) {
+		folded[cell.first] = cell.second;
+	}
+	edits.cells.swap(folded);
+	edits.fills.clear();
+}
+
+void Layer::applyPageEdits(int page) {
+	auto found = pageEdits.find(page);
+	if (found == pageEdits.end()) return;
+	std::vector<Uint16>& cells = pages[page].cells;
+	for (const LayerPageFill& fill : found->second.fills) {
+		int left = fill.area.x % LAYER_PAGE_TILES, top = fill.area.y % LAYER_PAGE_TILES;
+		for (int y = top; y < top + fill.area.h; ++y) {
+			std::fill_n(cells.begin() + y * LAYER_PAGE_TILES + left, fill.area.w, fill.index);
+		}
+	}
+	for (const std::pair<const Uint16, Uint16>& cell : found->second.cells) {
+		cells[cell.first] = cell.second;
+	}
+}
+
+int Layer::getPageIndex(int x, int y) const {
+	return (y / LAYER_PAGE_TILES) * pagesWide + x / LAYER_PAGE_TILES;
+}
+
+SDL_Rect Layer::getPageRect(int page) const {
+	SDL_Rect rect = { (page % pagesWide) * LAYER_PAGE_TILES * tileWidth, (page / pagesWide) * LAYER_PAGE_TILES * tileHeight,
+		LAYER_PAGE_TILES * tileWidth, LAYER_PAGE_TILES * tileHeight };
+	return rect;
+}
+
+void Layer::forEachChunkInPage(int page, const std::function<void(int)>& action) {
+	int pageChunks = LAYER_PAGE_TILES / LAYER_CHUNK_TILES;
+	int firstX = (page % pagesWide) * pageChunks, firstY = (page / pagesWide) * pageChunks;
+	int lastX = std::min(firstX + pageChunks, chunksWide), lastY = std::min(firstY + pageChunks, chunksHigh);
+	for (int cy = firstY; cy < lastY; ++cy) {
+		for (int cx = firstX; cx < lastX; ++cx) {
+			action(cy * chunksWide + cx);
+		}
+	}
+}
+
+void Layer::queueTiles(DrawList& list, int cx, int cy, int originX, int originY, int zlayer, Uint32 now, double zoom) const {
+	int startX = cx * LAYER_CHUNK_TILES, startY = cy * LAYER_CHUNK_TILES;
+	int endX = std::min(startX + LAYER_CHUNK_TILES, width), endY = std::min(startY + LAYER_CHUNK_TILES, height);
+	int stride;
+	const Uint16* base = findCell(startX, startY, &stride);
+	if (base == NULL) return;
+	for (int y = startY; y < endY; ++y) {
+		const Uint16* row = base + (y - startY) * stride - startX;
+		for (int x = startX; x < endX; ++x) {
+			const Order* order = palette[row[x]].order;
+			order->queueFrame(list, zlayer, originX + (x - startX) * tileWidth, originY + (y - startY) * tileHeight,
+				order->getFrameAt(now), scale, 0, zoom);
+		}
+	}
+}
+
+/// <summary>
+/// Works out which animated Orders a chunk has and how many phases that gives it. Since every Tile
+/// animates off the same clock, the chunk as a whole repeats every phasePeriod ms (the least common
+/// multiple of each Order's loop), and only changes when one of its Orders changes frame. Each of
+/// those moments starts a new phase. If that comes to more than LAYER_MAX_PHASES, the chunk gets
+/// a single texture that's re-baked whenever something in it changes frame instead.
+/// </summary>
+/// <param name="index">The chunk to work out.</param>
+void Layer::updatePhases(int index) {
+	LayerChunk& chunk = chunks[index];
+	int cx = index % chunksWide, cy = index / chunksWide;
+	int startX = cx * LAYER_CHUNK_TILES, startY = cy * LAYER_CHUNK_TILES;
+	int endX = std::min(startX + LAYER_CHUNK_TILES, width), endY = std::min(startY + LAYER_CHUNK_TILES, height);
+
+	int stride;
+	const Uint16* base = findCell(startX, startY, &stride);
+	// not paged in; this gets done when it is
+	if (base == NULL) return;
+
+	chunk.animated.clear();
+	chunk.shownFrames.clear();
+	for (int y = startY; y < endY; ++y) {
+		for (int x = startX; x < endX; ++x) {
+			const LayerPaletteEntry& entry = palette[base[(y - startY) * stride + (x - startX)]];
+			if (entry.isAnimated &&
+				std::find(chunk.animated.begin(), chunk.animated.end(), entry.order) == chunk.animated.end()) {
+				chunk.animated.push_back(entry.order);
+			}
+		}
+	}
+
+	Uint64 period = 1;
+	bool isTooMany = false;
+	for (const Order* order : chunk.animated) {
+		Uint64 ms = (Uint64)order->getMSPerFrame();
+		Uint64 loop = ms * order->getLength();
+		period = period / gcd(period, loop) * loop;
+		// every Order changes frame at least once per loop, so this many is already too many
+		if (period / ms > LAYER_MAX_PHASES * chunk.animated.size()) {
+			isTooMany = true;
+			break;
+		}
+	}
+
+	// every time some Order changes frame, in order
+	chunk.phaseStarts.clear();
+	if (!isTooMany) {
+		for (const Order* order : chunk.animated) {
+			Uint32 ms = (Uint32)order->getMSPerFrame();
+			for (Uint64 t = 0; t < period; t += ms) {
+				chunk.phaseStarts.push_back((Uint32)t);
+			}
+		}
+		std::sort(chunk.phaseStarts.begin(), chunk.phaseStarts.end());
+		chunk.phaseStarts.erase(std::unique(chunk.phaseStarts.begin(), chunk.phaseStarts.end()), chunk.phaseStarts.end());
+		isTooMany = chunk.phaseStarts.size() > LAYER_MAX_PHASES;
+	}
+
+	int phaseCount = 1;
+	chunk.phasePeriod = 0;
+	chunk.isLive = false;
+	if (isTooMany) {
+		chunk.isLive = true;
+		chunk.phaseStarts.clear();
+	}
+	else if (!chunk.animated.empty()) {
+		phaseCount = (int)chunk.phaseStarts.size();
+		chunk.phasePeriod = (Uint32)period;
+	}
+
+	if (phaseCount != chunk.phaseCount) releaseSlots(index);
+	chunk.phaseCount = phaseCount;
+	chunk.isDirty = false;
+	chunk.isBaked = false;
+}
+
+/// <summary>
+/// Draws every phase of the chunk into its textures through target passes on list.
+/// </summary>
+void Layer::bakeChunk(DrawList& list, int index, Uint32 now) {
+	LayerChunk& chunk = chunks[index];
+	int cx = index % chunksWide, cy = index / chunksWide;
+
+	for (int phase = 0; phase < chunk.phaseCount; ++phase) {
+		// live chunks just show whatever's on now
+		Uint32 when = (chunk.phaseCount > 1) ? chunk.phaseStarts[phase] : now;
+		list.beginTarget(chunkTextures[chunk.slots[phase]]);
+		queueTiles(list, cx, cy, 0, 0, 0, when);
+		list.endTarget();
+	}
+
+	if (chunk.isLive) {
+		chunk.bakedFrames.resize(chunk.animated.size());
+		for (size_t i = 0; i < chunk.animated.size(); ++i) {
+			chunk.bakedFrames[i] = chunk.animated[i]->getFrameAt(now);
+		}
+	}
+	chunk.isBaked = true;
+}
+
+bool Layer::hasAnimationMoved(const LayerChunk& chunk, Uint32 now) const {
+	if (!chunk.isLive) return false;
+	for (size_t i = 0; i < chunk.animated.size(); ++i) {
+		if (chunk.animated[i]->getFrameAt(now) != chunk.bakedFrames[i]) return true;
+	}
+	return false;
+}
+
+/// <summary>
+/// Gets a chunk one texture per phase. Free textures go first, then ones belonging to whichever chunks have
+/// been off screen longest (those chunks lose all of theirs). Textures already drawn this frame are never taken.
+/// </summary>
+/// <param name="index">The chunk that needs textures.</param>
+/// <returns>false (and nothing changes) if there aren't enough textures to go around this frame.</returns>
+bool Layer::acquireSlots(int index) {
+	LayerChunk& chunk = chunks[index];
+	releaseSlots(index);
+	if (countFreeSlots() < chunk.phaseCount) return false;
+
+	while ((int)chunk.slots.size() < chunk.phaseCount) {
+		chunk.slots.push_back(takeSlot(0, index));
+	}
+	chunk.isBaked = false;
+	return true;
+}
+
+int Layer::countFreeSlots() const {
+	int available = 0;
+	for (size_t slot = 0; slot < chunkTextures.size(); ++slot) {
+		if (slotOwner[slot] == LAYER_NO_SLOT || slotLastUsed[slot] != drawCount) ++available;
+	}
+	return available;
+}
+
+int Layer::takeSlot(int level, int owner) {
+	int best = LAYER_NO_SLOT;
+	for (int slot = 0; slot < (int)chunkTextures.size(); ++slot) {
+		if (slotOwner[slot] == LAYER_NO_SLOT) {
+			best = slot;
+			break;
+		}
+		// on screen this frame, or one we just took
+		if (slotLastUsed[slot] == drawCount || (slotOwner[slot] == owner && slotLevel[slot] == level)) continue;
+		if (best == LAYER_NO_SLOT || slotLastUsed[slot] < slotLastUsed[best]) best = slot;
+	}
+	if (best == LAYER_NO_SLOT) return LAYER_NO_SLOT;
+	// frees best, along with the rest of its chunk's textures
+	if (slotOwner[best] != LAYER_NO_SLOT) {
+		if (slotLevel[best] == 0) releaseSlots(slotOwner[best]);
+		else releaseBlock(slotLevel[best], slotOwner[best]);
+	}
+	slotOwner[best] = owner;
+	slotLevel[best] = level;
+	return best;
+}
+
+void Layer::releaseSlots(int index) {
+	LayerChunk& chunk = chunks[index];
+	for (int slot : chunk.slots) {
+		slotOwner[slot] = LAYER_NO_SLOT;
+	}
+	chunk.slots.clear();
+	chunk.isBaked = false;
+}
+
+
+/// <summary>
+/// Makes an empty stack and adds it to the scene's draw sources.
+/// </summary>
+/// <param name="scene">The scene every Layer in the stack belongs to.</param>
+/// <param name="renderer">Only used to make the stack's texture.</param>
+/// <param name="width">The size of the scene's camera, in pixels.</param>
+/// <param name="height"></param>
+/// <param name="zlayer">Where the whole stack goes among the scene's Sprites.</param>
+LayerStack::LayerStack(AnimationManager& scene, SDL_Renderer* renderer, int width, int height, int zlayer) :
+	scene{ scene },
+	drawSourceId{ 0 },
+	layers{ },
+	composite{ NULL },
+	width{ width },
+	height{ height },
+	zlayer{ zlayer },
+	dirty{ },
+	isAllDirty{ true },
+	lastX{ 0 },
+	lastY{ 0 },
+	lastZoom{ 1 },
+	lastRedrawArea{ 0 }
+{
+	composite = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_TARGET, width, height);
+	if (composite == NULL) {
+		// addLayer will refuse everything, so the Layers just keep drawing themselves
+		printf("ERROR: LayerStack::LayerStack could not make its texture. SDL_Error: %s\n", SDL_GetError());
+		return;
+	}
+	SDL_SetTextureBlendMode(composite, SDL_BLENDMODE_BLEND);
+
+	drawSourceId = scene.addDrawSource([this](DrawList& list, const SDL_Rect& camera) {
+		queueComposite(list, camera);
+		});
+}
+
+LayerStack::~LayerStack() {
+	for (Layer* layer : layers) {
+		layer->stack = NULL;
+	}
+	if (composite != NULL) {
+		scene.removeDrawSource(drawSourceId);
+		SDL_DestroyTexture(composite);
+	}
+}
+
+bool LayerStack::addLayer(Layer& layer) {
+	if (composite == NULL) {
+		printf("ERROR: LayerStack::addLayer can't stack Layers without a texture.\n");
+		return false;
+	}
+	if (layer.stack != NULL) {
+		printf("ERROR: LayerStack::addLayer got a Layer that's already in a stack.\n");
+		return false;
+	}
+	if (&layer.scene != &scene) {
+		printf("ERROR: LayerStack::addLayer got a Layer from a different scene.\n");
+		return false;
+	}
+	layer.stack = this;
+	layers.push_back(&layer);
+	isAllDirty = true;
+	return true;
+}
+
+void LayerStack::removeLayer(Layer& layer) {
+	std::vector<Layer*>::iterator found = std::find(layers.begin(), layers.end(), &layer);
+	if (found == layers.end()) return;
+	layers.erase(found);
+	layer.stack = NULL;
+	isAllDirty = true;
+}
+
+void LayerStack::invalidate(const SDL_Rect& area) {
+	if (isAllDirty || area.w <= 0 || area.h <= 0) return;
+	dirty.push_back(area);
+}
+
+/// <summary>
+/// Redraws whatever parts of our texture are dirty, then adds it to the list. Each Layer gets its chunks
+/// ready for all the dirty regions first, since baking uses target passes too and those can't nest.
+/// </summary>
+/// <param name="list">The scene's DrawList.</param>
+/// <param name="camera">What the scene's camera sees. Only its position is used; the size is ours, at the scene's zoom.</param>
+void LayerStack::queueComposite(DrawList& list, const SDL_Rect& camera) {
+	double zoom = scene.getZoom();
+	SDL_Rect view = { camera.x, camera.y, (int)ceil(width / zoom), (int)ceil(height / zoom) };
+	if (view.x != lastX || view.y != lastY || zoom != lastZoom) isAllDirty = true;
+	lastX = view.x;
+	lastY = view.y;
+	lastZoom = zoom;
+
+	Uint32 now = SDL_GetTicks();
+	for (Layer* layer : layers) {
+		layer->updatePages(view);
+	}
+	// even on a full redraw, so each chunk's shownPhase is up to date for next time
+	for (Layer* layer : layers) {
+		layer->invalidateAnimated(view, now);
+	}
+
+	std::vector<SDL_Rect> regions;
+	if (isAllDirty) regions.push_back(view);
+	else mergeDirty(view, regions);
+	dirty.clear();
+	isAllDirty = false;
+
+	lastRedrawArea = 0;
+	if (!regions.empty()) {
+		for (Layer* layer : layers) {
+			if (!layer->isInit || !layer->isVisible) continue;
+			++layer->drawCount;
+			layer->lodBakesLeft = LAYER_LOD_BAKES_PER_FRAME;
+			for (const SDL_Rect& region : regions) {
+				layer->prepareChunks(list, region, now);
+			}
+		}
+		for (const SDL_Rect& region : regions) {
+			SDL_Rect clip = zoomRect(region.x - view.x, region.y - view.y, region.w, region.h, zoom);
+			list.beginTarget(composite, &clip);
+			for (Layer* layer : layers) {
+				if (!layer->isInit || !layer->isVisible) continue;
+				layer->queueRegion(list, region, view.x, view.y, layer->zlayer, now);
+			}
+			list.endTarget();
+			lastRedrawArea += (Uint64)clip.w * clip.h;
+		}
+	}
+
+	SDL_Rect dst = { 0, 0, width, height };
+	list.add(zlayer, composite, dst);
+}
+
+void LayerStack::mergeDirty(const SDL_Rect& view, std::vector<SDL_Rect>& regions) const {
+	// merging is quadratic, so don't even try with piles of them
+	if (dirty.size() > LAYERSTACK_MAX_REGIONS * 4) {
+		regions.assign(1, view);
+		return;
+	}
+	for (const SDL_Rect& area : dirty) {
+		SDL_Rect clipped;
+		if (SDL_IntersectRect(&area, &view, &clipped)) regions.push_back(clipped);
+	}
+
+	// keep merging anything that overlaps until nothing does. There's only ever a handful of these.
+	bool hasMerged = true;
+	while (hasMerged) {
+		hasMerged = false;
+		for (size_t i = 0; i < regions.size() && !hasMerged; ++i) {
+			for (size_t j = i + 1; j < regions.size(); ++j) {
+				if (SDL_HasIntersection(&regions[i], &regions[j])) {
+					SDL_UnionRect(&regions[i], &regions[j], &regions[i]);
+					regions.erase(regions.begin() + j);
+					hasMerged = true;
+					break;
+				}
+			}
+		}
+	}
+
+	// past this, one big pass is cheaper than lots of little ones
+	Uint64 area = 0;
+	for (const SDL_Rect& region : regions) {
+		area += (Uint64)region.w * region.h;
+	}
+	if (regions.size() > LAYERSTACK_MAX_REGIONS || area * 2 > (Uint64)view.w * view.h) {
+		regions.assign(1, view);
+	}
+}
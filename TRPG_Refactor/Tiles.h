@@ -2,52 +2,154 @@
 #define TILES_H
 
 #include <stdio.h>
+#include <vector>
+#include <functional>
+#include <unordered_map>
 
 #include <SDL.h>
 
 #include "GraphicsEngine.h"
+#include "MapFile.h"
+#include "Autotile.h"
+
+// Layers bake their Tiles into textures this many Tiles on a side
+#define LAYER_CHUNK_TILES		16
+// how many chunk textures a Layer keeps by default. Enough to cover the screen at 64
+// pixel Tiles, with a chunk of border on each side, for terrain with two phases.
+#define LAYER_CHUNK_CACHE_SIZE	24
+// slotOwner for a texture no chunk has right now
+#define LAYER_NO_SLOT			-1
+// chunks that would cycle through more looks than this are re-baked as they animate instead
+#define LAYER_MAX_PHASES		8
+// cells are 16 bit palette indices, so this is as many kinds of Tile as a Layer can have
+#define LAYER_MAX_PALETTE		0x10000
+// Layers that page their map (see the Layer constructor) load it in squares this many Tiles on a
+// side. Has to be a multiple of LAYER_CHUNK_TILES.
+#define LAYER_PAGE_TILES		(LAYER_CHUNK_TILES * 4)
+// a page whose LayerPageEdits has more fills than this gets them folded into its cells
+#define LAYER_PAGE_MAX_FILLS	16
+// a LayerStack with more dirty rects than this in a frame just redraws everything
+#define LAYERSTACK_MAX_REGIONS	32
+// Zoomed out, Layers draw LayerLodBlocks instead of chunks. Level n blocks are 2^n chunks on a
+// side, baked at 1 / 2^n size into the same textures chunks use. Past the last level, it's the
+// overview (one texel per Tile, or per few Tiles on big maps) instead.
+#define LAYER_LOD_LEVELS		2
+#define LAYER_LOD_OVERVIEW		(LAYER_LOD_LEVELS + 1)
+// how many LayerLodBlocks a Layer bakes per frame at most. The rest show the overview until they're done.
+#define LAYER_LOD_BAKES_PER_FRAME	4
+// Layers bigger than this (in Tiles) on either side get an overview with one texel for every few
+// Tiles across and down, so it's never bigger than this on a side
+#define LAYER_OVERVIEW_MAX_SIZE	2048
 
 /// <summary>
-/// This is purely a graphics concept for tile based rendering. This
-/// is combined into Layers.
+/// LayerPaletteEntry -- one kind of Tile. A Layer only stores an index into its palette
+/// of these for each cell, and works out what to draw from that when it draws.
 /// </summary>
-class Tile {
-	
-public:
-	Tile(const AFrame& graphic, std::string order, int x, int y, double size);
-	~Tile() = default;
-	void updatePos(int nx, int ny);
-	void updateScale(double nsize);
-	void updateZLayer(int zlayer) { graphic.setZlayer(zlayer); }
-	double getScale() const { return size; }
-	void setVisible(bool isVisible);
+typedef struct lpe_ {
+	const AFrame* graphics;
+	const Order* order;
+	// worked out once when the entry is made; animated Tiles make their chunk bake again
+	bool isAnimated;
+	// the average color of the Order's first Frame, as SDL_PIXELFORMAT_RGBA8888, for the overview
+	Uint32 color;
+	// which of the Layer's AutotileSet rules the Order is a variant of, or AUTOTILE_NONE
+	int autotileKind;
+} LayerPaletteEntry;
 
-private:
-	// bulk update the underlying Sprite
-	// on any other update
-	void updateInternal();
+/// <summary>
+/// LayerChunk -- a LAYER_CHUNK_TILES square block of a Layer's Tiles. Each one that's on screen
+/// gets baked into textures once and then drawn as a single quad, until one of its Tiles changes.
+/// 
+/// Animated Tiles all run off the same clock, so a chunk with some in it just cycles through a
+/// few fixed looks (phases). Each phase gets baked into its own texture up front, and drawing just
+/// picks the right one, so animated terrain costs the same per frame as static terrain.
+/// </summary>
+typedef struct lch_ {
+	// the Tiles changed, so the phases have to be worked out again (and baked)
+	bool isDirty;
+	// the textures are up to date
+	bool isBaked;
+	// true if there'd be too many phases. Then the chunk has one texture that gets
+	// re-baked whenever one of its animated Orders changes frame.
+	bool isLive;
+	// one of the Layer's chunk textures per phase, or empty if the chunk isn't baked anywhere
+	std::vector<int> slots;
+	// static (and live) chunks have one phase. Otherwise the chunk repeats every phasePeriod ms,
+	// and phase n is what it looks like from phaseStarts[n] ms into that until the next one.
+	int phaseCount;
+	std::vector<Uint32> phaseStarts;
+	Uint32 phasePeriod;
+	// the animated Orders in here, and (for live chunks) the frame each one was on when we baked
+	std::vector<const Order*> animated;
+	std::vector<int> bakedFrames;
+	// for Layers in a LayerStack: the phase (or for live chunks, the frames) the stack last saw,
+	// so it knows when the chunk's look changes and that part of it has to be redrawn
+	int shownPhase;
+	std::vector<int> shownFrames;
+} LayerChunk;
 
-	Sprite graphic;
-	std::string order;
-	int x;
-	int y;
-	double size;
+/// <summary>
+/// LayerLodBlock -- 2^level by 2^level chunks shrunk into one chunk texture, for drawing zoomed out.
+/// Baked straight from the Tiles, first frame only, since nobody can see animation from that far out.
+/// </summary>
+typedef struct llb_ {
+	// one of the Layer's chunk textures, or LAYER_NO_SLOT
+	int slot;
+	bool isBaked;
+} LayerLodBlock;
 
-};
+/// <summary>
+/// LayerPage -- a LAYER_PAGE_TILES square piece of a paged Layer's cells that's loaded right now.
+/// </summary>
+typedef struct lpg_ {
+	// index this [(y % LAYER_PAGE_TILES) * LAYER_PAGE_TILES + x % LAYER_PAGE_TILES]
+	std::vector<Uint16> cells;
+} LayerPage;
 
 /// <summary>
-/// Baby lil tuple class because VS is pissed at me
+/// LayerPageFill -- a fillTiles, cut down to one page.
 /// </summary>
-class FrameOrder {
-public:
-	FrameOrder(const AFrame& frame, std::string order);
+typedef struct lpf_ {
+	// in Tiles, all inside the page
+	SDL_Rect area;
+	Uint16 index;
+} LayerPageFill;
 
-	const AFrame& frame;
-	std::string order;
-};
+/// <summary>
+/// LayerPageEdits -- everything that's been changed on one page of a paged Layer since it was read
+/// from the file. It's put back in every time the page comes in, so edited pages can be thrown out
+/// like any other, and editing a page that isn't in yet costs next to nothing.
+/// </summary>
+typedef struct lped_ {
+	// put in first, oldest first
+	std::vector<LayerPageFill> fills;
+	// then these, by [(y % LAYER_PAGE_TILES) * LAYER_PAGE_TILES + x % LAYER_PAGE_TILES]. Only the latest
+	// edit to each cell is kept, and a fill throws out any it covers, so these are always newer.
+	std::unordered_map<Uint16, Uint16> cells;
+} LayerPageEdits;
+
+// told which cells (in Tiles) an edit changed, or a page that came in filled in
+typedef std::function<void(const std::vector<SDL_Point>& cells)> LayerChangeListener;
+
+/// <summary>
+/// LayerCellChange -- one cell an edit changed, and what it was before and after, as palette indices.
+/// </summary>
+typedef struct lcc_ {
+	int x, y;
+	Uint16 from;
+	Uint16 to;
+} LayerCellChange;
+
+// told exactly what every edit changed, for undo (see LayerHistory)
+typedef std::function<void(const std::vector<LayerCellChange>& changes)> LayerEditRecorder;
+
+class LayerStack;
 
 /// <summary>
-/// This is essentially a grid of Tiles. Generally, this works best
+/// This is essentially a grid of Tiles. Each Tile is just a 16 bit index into
+/// the Layer's palette, all in one flat array, so a 1024x1024 map is about 2 MB.
+/// Maps can be text or binary (see MapFile); binary ones load without parsing anything.
+/// Nothing per Tile exists besides that. Generally, this works best
 /// when initialized early and modified infrequently. If you want to move
 /// stuff around, a plain Sprite is better for the job. Layers also
 /// feature a fixed zlayer for all Tiles in the Layer.
@@ -57,12 +159,38 @@ public:
 /// TODO: (maybe) add support for rectangles other than squares (though
 /// each tile having the same dimensions will likely remain a requirement)
 /// 
-/// TODO: (maybe) right now everything is loaded as a Sprite, which might be a little intensive.
-/// These objects only move relative to the camera so it's a good idea to separate their
-/// rendering from the AnimationManager (might save time in the rendering process). Perhaps
-/// inserting the whole layer as one "Sprite" with one zlayer could speed things up a bit.
-/// It's premature optimization if we do it now, but still something to keep in mind.
+/// Layers don't draw Tile by Tile. The map is split into LayerChunks, and each chunk
+/// on camera is baked into a texture (through a target pass on the scene's DrawList, so
+/// the game thread never touches the renderer) and drawn as one quad. Only chunks whose
+/// Tiles changed get baked again, so terrain costs a handful of draws per frame. The
+/// textures are a fixed pool, handed out to whichever chunks are on screen; if there
+/// aren't enough, the leftover chunks just draw their Tiles directly.
+/// 
+/// The chunk textures are made in the constructor and freed in the destructor, so
+/// both need to happen on the thread that owns the renderer.
+/// 
+/// Zoomed out (see AnimationManager::setZoom), chunks would get too many and too small to be
+/// worth drawing one by one, so the Layer switches to LayerLodBlocks: several chunks at once,
+/// baked smaller into the same pool of textures. Either way about the same number of textures
+/// cover the screen, at about one texel per pixel, so zooming out costs the same per frame as
+/// not. Further out than the last level, the whole Layer is a single quad of its overview, one
+/// texel per Tile in the average color of its first Frame. Maps too big for that get one texel
+/// per square of Tiles instead (the color of the Tile in the middle), so however big the map
+/// and however far out the camera, there's never more to draw than the pool of textures covers.
 /// 
+/// Maps too big to keep in memory can be paged instead (give the constructor a pageWindow).
+/// Then only the header is read up front, and the map comes in LAYER_PAGE_TILES square
+/// pages on a background thread as the camera gets near them, with at most pageWindow
+/// of them kept at once. Nothing ever waits on the disk: pages that haven't arrived yet
+/// just aren't drawn. Edits can't be written back to the file, so each page keeps a log of
+/// them instead (see LayerPageEdits) that's put back in whenever it's read again. Paging
+/// needs a binary map.
+///
+/// Roads, rivers and shorelines can be autotiled (see setAutotiles and AutotileSet): their Tiles get
+/// whichever variant fits their neighbors, through a table lookup on a neighbor mask. Changing a
+/// Tile can only change the variants right around it, so edits only work out the 3x3 around each
+/// Tile they set, and the cost stays proportional to the edit, not the map.
+///
 /// TODO: (one more ok?) the constructor requires a mappath right now and then loads a
 /// map file every time. you can't make a Layer without a map file, so you can't really
 /// make a custom Layer at runtime. Maybe add support for empty Layers that can be
@@ -70,24 +198,282 @@ public:
 /// </summary>
 class Layer {
 
+	// the stack draws our chunks itself
+	friend class LayerStack;
+
 public:
-	Layer(AssetManager& assets, std::string mappath, double scale = 1);
-	~Layer() = default;
+	// Every Tile of the Layer is drawn as part of scene. renderer is only used to make the chunk
+	// textures; chunkCacheSize is how many to make. If pageWindow is more than 0, the map is paged
+	// in around the camera, keeping at most that many pages. It should be enough to cover the
+	// screen with a page of border all round.
+	Layer(AssetManager& assets, AnimationManager& scene, SDL_Renderer* renderer, std::string mappath, double scale = 1,
+		int chunkCacheSize = LAYER_CHUNK_CACHE_SIZE, int pageWindow = 0);
+	~Layer();
+	// we're registered with the scene by address
+	Layer(const Layer&) = delete;
+	Layer& operator=(const Layer&) = delete;
 	void setVisible(bool isVisible);
 	void updateTile(int x, int y, std::string asset, std::string order);
+	// Batched edits, for when lots of Tiles change at once (a brush, a captured city, weather).
+	// The asset and order are only looked up once, and whatever has to redraw is marked once for
+	// the whole batch. Areas are in Tiles. Each returns how many Tiles changed.
+	int fillTiles(const SDL_Rect& area, std::string asset, std::string order);
+	int setTiles(const std::vector<SDL_Point>& positions, std::string asset, std::string order);
+	// every fromAsset::fromOrder Tile in area becomes toAsset::toOrder
+	int replaceTiles(const SDL_Rect& area, std::string fromAsset, std::string fromOrder, std::string toAsset,
+		std::string toOrder);
 	void setZLayer(int zlayer);
+	int getWidth() const { return width; }
+	int getHeight() const { return height; }
+	// what's at (x, y), as an index into the palette. For paged maps, that's 0 if it isn't loaded.
+	Uint16 getTile(int x, int y) const;
+	// false if (x, y) is on a page that isn't in right now (always true for Layers that don't page)
+	bool isTileLoaded(int x, int y) const;
+	// which Tile is under a world position (see AnimationManager::screenToWorld). Returns false if
+	// it's off the map, and leaves x and y alone.
+	bool getTileAt(int worldX, int worldY, int* x, int* y) const;
+	const LayerPaletteEntry& getPaletteEntry(Uint16 index) const { return palette[index]; }
+	// the size of one Tile on screen, in pixels
+	int getTileWidth() const { return tileWidth; }
+	int getTileHeight() const { return tileHeight; }
+	// Calls listener (on the game thread) once at the end of every edit that changes something,
+	// and whenever a page comes in. Returns an id for removing it.
+	Uint32 addChangeListener(LayerChangeListener listener);
+	void removeChangeListener(Uint32 id);
+	// Tiles drawn with one of rules' Orders get their variant picked from their neighbors, from now on.
+	// The whole map (whatever's loaded of it) is worked out again now; after that, edits only redo the
+	// Tiles around what they changed. rules has to outlive us. NULL turns autotiling off.
+	void setAutotiles(const AutotileSet* rules);
+	// Calls recorder at the end of every edit with what it changed, including any autotiling it caused.
+	// Only one at a time; an empty one turns it off. Edits to pages that aren't loaded yet aren't recorded.
+	void setEditRecorder(LayerEditRecorder recorder) { editRecorder = recorder; }
+	// Puts each change's to (or from, if isReverse) straight into its cell, with no autotiling, since the
+	// changes already have the variants in them. Tells listeners and the stack, but not the recorder.
+	void applyChanges(const std::vector<LayerCellChange>& changes, bool isReverse);
 
 private:
 	bool loadMap(std::string mappath);
+	// finds the palette index for this AFrame and Order, adding it if it's new.
+	// Returns false if the palette is full.
+	bool findPaletteIndex(const AFrame& graphics, const Order* order, Uint16* index);
+	// same, but only finds; returns false if order isn't in the palette
+	bool findPaletteOrder(const Order* order, Uint16* index) const;
+	// looks up asset::order and finds (or adds) its palette index, printing why if it can't
+	bool findTileKind(const std::string& asset, const std::string& order, Uint16* index);
+	// area (in Tiles) cut down to what's on the map. Returns false if none of it is.
+	bool clipToMap(const SDL_Rect& area, SDL_Rect* clipped) const;
+	// sets one cell, marking its chunk dirty and growing touched (in Tiles) to cover it if it changed.
+	// Returns true if it changed.
+	bool setCell(int x, int y, Uint16 index, SDL_Rect* touched);
+	// setCell, once the cell's been found
+	bool writeCell(int x, int y, Uint16* cell, Uint16 index, SDL_Rect* touched);
+	// autotiles around whatever a batch changed, then tells our listeners what changed, and our stack to redraw it
+	void finishEdit(SDL_Rect touched);
+	// marks area (in Tiles) for our stack to redraw
+	void invalidateTiles(const SDL_Rect& area);
+	// hands changedCells to every listener, then empties it
+	void notifyChanged();
+	// our DrawSource. Bakes whichever chunks on camera need it, then draws them. Does nothing
+	// while we're in a LayerStack.
+	void queueChunks(DrawList& list, const SDL_Rect& camera);
+	// gets every chunk touching region (in world pixels) baked and ready for queueRegion. Target
+	// passes go onto list, so this can't be called inside one.
+	void prepareChunks(DrawList& list, const SDL_Rect& region, Uint32 now);
+	// adds every chunk touching region to list, with the world's (originX, originY) at the list's 0, 0
+	void queueRegion(DrawList& list, const SDL_Rect& region, int originX, int originY, int zlayer, Uint32 now);
+	// tells our stack about every chunk in view whose animation moved on since it last looked
+	void invalidateAnimated(const SDL_Rect& view, Uint32 now);
+	// which of the chunk's phases is showing at now
+	int getPhase(const LayerChunk& chunk, Uint32 now) const;
+	// where cell (x, y) is, with rows stride apart, or NULL if it isn't paged in
+	Uint16* findCell(int x, int y, int* stride);
+	const Uint16* findCell(int x, int y, int* stride) const;
+	bool isChunkLoaded(int cx, int cy) const;
+	// takes in finished pages, asks for the ones around view that are missing, and drops far away ones
+	void updatePages(const SDL_Rect& view);
+	// adds to the page's LayerPageEdits. area has to be inside one page.
+	void addPageEdit(int x, int y, Uint16 index);
+	void addPageFill(const SDL_Rect& area, Uint16 index);
+	// puts a page's LayerPageEdits into it, once it's just come in
+	void applyPageEdits(int page);
+	int getPageIndex(int x, int y) const;
+	// in world pixels
+	SDL_Rect getPageRect(int page) const;
+	void forEachChunkInPage(int page, const std::function<void(int)>& action);
+	// the range of chunks (or level's LayerLodBlocks) touching region (in world pixels). Returns false if
+	// there aren't any.
+	bool getChunkRange(const SDL_Rect& region, int* firstX, int* firstY, int* lastX, int* lastY, int level = 0) const;
+	// adds every Tile in chunk (cx, cy) to list, with the chunk's top left at (originX, originY) before zooming
+	void queueTiles(DrawList& list, int cx, int cy, int originX, int originY, int zlayer, Uint32 now, double zoom = 1) const;
+	// 0 for chunks, a LayerLodBlock level, or LAYER_LOD_OVERVIEW
+	int getLodLevel(double zoom) const;
+	// how many of level's LayerLodBlocks it takes to cover the map across
+	int getBlocksWide(int level) const { return (chunksWide + (1 << level) - 1) >> level; }
+	// the chunk's Tiles changed, so it and everything zoomed out that shows it have to be drawn again
+	void markChunkDirty(int chunk);
+	// prepareChunks and queueRegion, zoomed out
+	void prepareBlocks(DrawList& list, const SDL_Rect& region, int level);
+	void queueBlocks(DrawList& list, const SDL_Rect& region, int originX, int originY, int zlayer, int level, double zoom);
+	void bakeBlock(DrawList& list, int level, int index);
+	void releaseBlock(int level, int index);
+	// uploads whatever part of the overview is out of date
+	void prepareOverview(DrawList& list);
+	void queueOverview(DrawList& list, int originX, int originY, int zlayer, double zoom, int sublayer);
+	// works out the chunk's animated Orders and phases after its Tiles change
+	void updatePhases(int chunk);
+	// draws each of the chunk's phases into its textures through target passes on list
+	void bakeChunk(DrawList& list, int chunk, Uint32 now);
+	// true if the chunk is live and any animated Order in it is on a different frame than when it was baked
+	bool hasAnimationMoved(const LayerChunk& chunk, Uint32 now) const;
+	// finds a texture for each of chunk's phases, taking them off chunks that aren't on screen if
+	// we have to. Returns false if there aren't enough free this frame.
+	bool acquireSlots(int chunk);
+	// gives back all of chunk's textures
+	void releaseSlots(int chunk);
+	// how many chunk textures haven't been drawn with this frame
+	int countFreeSlots() const;
+	// takes the best texture for a chunk or block that needs one (see acquireSlots). Returns LAYER_NO_SLOT
+	// if every one is in use this frame.
+	int takeSlot(int level, int owner);
+	// picks the variant for every autotiled Tile within one Tile of autotileEdits, then empties it
+	void resolveEdits(SDL_Rect* touched);
+	// picks the variant for every autotiled Tile in area (in Tiles) that's loaded
+	void resolveArea(const SDL_Rect& area, SDL_Rect* touched);
+	// picks the variant for the Tile at (x, y) from its neighbors. Returns true if it changed.
+	bool resolveCell(int x, int y, SDL_Rect* touched);
+	// the palette index for one of kind's variants, adding it if it's new. Returns false if the palette is full.
+	bool findVariantIndex(int kind, int variant, Uint16* index);
+
 	AssetManager& assets;
-	// index this [y][x]
-	std::vector< std::vector<Tile> > map;
+	AnimationManager& scene;
+	Uint32 drawSourceId;
+	// where the cells live. Binary maps are mapped in, so for those cells points right into the file
+	// (copy-on-write, so updateTile never changes it).
+	MapFile map;
+	// index this [y * width + x]. NULL for paged maps, which go through findCell.
+	Uint16* cells;
+	std::vector<LayerPaletteEntry> palette;
 	int width, height; // in Tiles, not pixels
 	int zlayer;
 	std::string mapName;
 	bool isInit;
 	double scale; // how much to resize each Tile AFrame by. 1 is default
 	bool isVisible;
+	// the size of one Tile on screen, in pixels
+	int tileWidth, tileHeight;
+	// index these [cy * chunksWide + cx]
+	std::vector<LayerChunk> chunks;
+	int chunksWide, chunksHigh;
+	// the chunk texture pool, which chunk (or level's LayerLodBlock) has each one, and the last draw each
+	// was used in
+	std::vector<SDL_Texture*> chunkTextures;
+	std::vector<int> slotOwner;
+	std::vector<int> slotLevel;
+	std::vector<Uint32> slotLastUsed;
+	Uint32 drawCount;
+	// index these [level - 1][by * getBlocksWide(level) + bx]
+	std::vector<std::vector<LayerLodBlock>> lodBlocks;
+	// how many more LayerLodBlocks this draw can bake
+	int lodBakesLeft;
+	// NULL only if it couldn't be made. One texel per overviewStep by overviewStep Tiles (see
+	// LAYER_OVERVIEW_MAX_SIZE), kept in overviewTexels too, and the part of the map (in Tiles) that has
+	// to be worked out and uploaded again.
+	SDL_Texture* overview;
+	std::vector<Uint32> overviewTexels;
+	SDL_Rect overviewDirty;
+	int overviewStep;
+	// in texels
+	int overviewWidth, overviewHeight;
+	// the stack we're in, if any. It tells us when it goes away.
+	LayerStack* stack;
+	// Only for paged maps; pager is NULL otherwise, and cells has everything. Then pages has
+	// whichever pages are loaded, by [py * pagesWide + px].
+	MapPager* pager;
+	int pageWindow;
+	int pagesWide;
+	std::unordered_map<int, LayerPage> pages;
+	// by page index, and only for pages that have been edited
+	std::unordered_map<int, LayerPageEdits> pageEdits;
+	// writeCell adds to pageEdits unless this is false, which it is while something else is logging
+	// the edit (fillTiles), or it isn't really an edit (autotiling a page that just came in)
+	bool isLoggingCells;
+	// see addChangeListener, along with their ids
+	std::vector<LayerChangeListener> changeListeners;
+	std::vector<Uint32> changeListenerIds;
+	Uint32 nextChangeListenerId;
+	// what the edit in progress has changed so far. Only filled in if anyone's listening.
+	std::vector<SDL_Point> changedCells;
+	// NULL unless setAutotiles was given some
+	const AutotileSet* autotiles;
+	// palette index for each [kind * AUTOTILE_BLOB_VARIANTS + variant], or -1 if we haven't needed it yet
+	std::vector<int> variantIndices;
+	// the cells the edit in progress has set, whose neighborhoods have to be autotiled when it's done
+	std::vector<SDL_Point> autotileEdits;
+	// see setEditRecorder, and what the edit in progress has changed for it so far
+	LayerEditRecorder editRecorder;
+	std::vector<LayerCellChange> editChanges;
+
+};
+
+/// <summary>
+/// LayerStack -- a pile of Layers (terrain, roads, decorations, move highlights, fog...) flattened
+/// into one screen-sized texture, which then goes into the scene as a single quad at the stack's
+/// zlayer. Layers inside the stack keep their own zlayers for ordering among themselves, but stop
+/// drawing on their own.
+///
+/// The texture is only redrawn where something changed: Layers report the Tiles updateTile
+/// changes and the chunks whose animation moves on, and anything else (an overlay that isn't a
+/// Layer, say) can be marked with invalidate. Those rects get merged and redrawn through clipped
+/// target passes, so a frame where nothing happened costs one quad. Moving or zooming the camera
+/// redraws everything.
+///
+/// Units are plain Sprites, so they're drawn by the scene every frame anyway and don't need to
+/// dirty anything. To have Layers above them (fog, say), use a second stack with a higher zlayer.
+///
+/// Like Layer, the constructor and destructor need to run on the thread with the renderer, and
+/// everything else on the game thread. Every Layer in the stack has to share its scene.
+/// </summary>
+class LayerStack {
+
+public:
+	// width and height should be the size of the scene's camera
+	LayerStack(AnimationManager& scene, SDL_Renderer* renderer, int width, int height, int zlayer);
+	~LayerStack();
+	// we're registered with the scene (and our Layers) by address
+	LayerStack(const LayerStack&) = delete;
+	LayerStack& operator=(const LayerStack&) = delete;
+
+	// layer stops drawing itself and gets drawn into the stack. Returns false if it can't be.
+	bool addLayer(Layer& layer);
+	// layer goes back to drawing itself
+	void removeLayer(Layer& layer);
+	// marks area (in world pixels) to be redrawn next frame
+	void invalidate(const SDL_Rect& area);
+	void invalidateAll() { isAllDirty = true; }
+	void setZLayer(int zlayer) { this->zlayer = zlayer; }
+	// how many pixels the last frame had to redraw; 0 on a quiet frame
+	Uint64 getLastRedrawArea() const { return lastRedrawArea; }
+
+private:
+	// our DrawSource. Redraws the dirty parts of the texture, then draws it.
+	void queueComposite(DrawList& list, const SDL_Rect& camera);
+	// merges overlapping dirty rects, clipped to view. Gives up and does all of view if they're
+	// most of it anyway.
+	void mergeDirty(const SDL_Rect& view, std::vector<SDL_Rect>& regions) const;
+
+	AnimationManager& scene;
+	Uint32 drawSourceId;
+	std::vector<Layer*> layers;
+	SDL_Texture* composite;
+	int width, height;
+	int zlayer;
+	// in world pixels
+	std::vector<SDL_Rect> dirty;
+	bool isAllDirty;
+	// where the camera was when we last drew, so we know when it moves (or zooms)
+	int lastX, lastY;
+	double lastZoom;
+	Uint64 lastRedrawArea;
 
 };
 
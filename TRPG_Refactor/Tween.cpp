@@ -0,0 +1,227 @@
+#include <stdio.h>
+#include <cmath>
+#include <vector>
+#include <functional>
+
+#include <SDL.h>
+
+#include "GraphicsEngine.h"
+#include "Tween.h"
+
+/// <summary>
+/// Makes a TweenManager that moves Sprites in the given scene.
+/// </summary>
+/// <param name="scene">The AnimationManager whose Sprites this will move.</param>
+TweenManager::TweenManager(AnimationManager& scene) :
+	scene{ scene },
+	nextID{ 0 },
+	liveWaypoints{ 0 } {}
+
+/// <summary>
+/// Starts a new motion. The Sprite's current position becomes the first point of the path, so a
+/// path of one point is just a straight line there.
+/// </summary>
+/// <param name="sprite">The Sprite to move. It has to be in this TweenManager's scene.</param>
+/// <param name="path">The points to visit, in order, in world pixels.</param>
+/// <param name="pixelsPerSecond">Average speed along the path. Easing speeds up and slows down around this.</param>
+/// <param name="easing">The curve applied over the whole path.</param>
+/// <param name="onDone">Called with the motion's id once the Sprite reaches the last point.</param>
+/// <returns>An id you can pass to cancel.</returns>
+TweenID TweenManager::moveAlong(const Sprite& sprite, const std::vector<SDL_Point>& path, float pixelsPerSecond,
+	TweenEasing easing, std::function<void(TweenID)> onDone) {
+
+	if (&sprite.getScene() != &scene) {
+		printf("ERROR: TweenManager::moveAlong got a Sprite from a different scene.\n");
+		return TWEEN_NO_ID;
+	}
+
+	// the path starts where the Sprite is right now
+	SDL_Point start;
+	start.x = sprite.getX();
+	start.y = sprite.getY();
+
+	Uint32 first = (Uint32)waypoints.size();
+	float total = 0;
+	waypoints.push_back(start);
+	waypointDistance.push_back(0);
+	for (const SDL_Point& p : path) {
+		const SDL_Point& last = waypoints.back();
+		total += std::hypot((float)(p.x - last.x), (float)(p.y - last.y));
+		waypoints.push_back(p);
+		waypointDistance.push_back(total);
+	}
+	Uint32 count = (Uint32)(waypoints.size() - first);
+	liveWaypoints += count;
+
+	// easing is one cubic for everything
+	float a = 1, b = 0, c = 0;
+	switch (easing) {
+	case TWEEN_EASE_IN:		a = 0; b = 1; c = 0; break;		// t^2
+	case TWEEN_EASE_OUT:	a = 2; b = -1; c = 0; break;	// t(2 - t)
+	case TWEEN_EASE_IN_OUT:	a = 0; b = 3; c = -2; break;	// t^2(3 - 2t)
+	default: break;
+	}
+
+	TweenID id = nextID++;
+	// never hand out the sentinel, even after wrapping around
+	if (nextID == TWEEN_NO_ID) nextID = 0;
+	ids.push_back(id);
+	spriteIds.push_back(sprite.getID());
+	progress.push_back(0);
+	// a zero length path (or a silly speed) finishes on the next update
+	rate.push_back((total > 0 && pixelsPerSecond > 0) ? pixelsPerSecond / (total * 1000.0f) : 1.0f);
+	c1.push_back(a);
+	c2.push_back(b);
+	c3.push_back(c);
+	length.push_back(total);
+	pathStart.push_back(first);
+	pathCount.push_back(count);
+	segment.push_back(0);
+	callbacks.push_back(std::move(onDone));
+
+	return id;
+}
+
+void TweenManager::cancel(TweenID id) {
+	for (size_t i = 0; i < ids.size(); ++i) {
+		if (ids[i] == id) {
+			removeAt(i);
+			return;
+		}
+	}
+}
+
+void TweenManager::cancelSprite(const Sprite& sprite) {
+	Uint32 spriteId = sprite.getID();
+	for (size_t i = 0; i < ids.size();) {
+		// removeAt swaps the last one in here, so only step forward when we keep this one
+		if (spriteIds[i] == spriteId) removeAt(i);
+		else ++i;
+	}
+}
+
+/// <summary>
+/// Advances every motion. The first pass is plain arithmetic over the flat arrays (no branches, no
+/// indirection) and works out how far along its path each motion is. The second pass finds the
+/// segment each one is on, which usually doesn't change between ticks, and writes the position
+/// into the Sprite's record. Finished motions are removed and then their onDone callbacks are run,
+/// so callbacks are free to start new motions.
+/// </summary>
+/// <param name="ms">Milliseconds since the last update.</param>
+void TweenManager::update(Uint32 ms) {
+	size_t n = ids.size();
+	if (n == 0) return;
+
+	float dt = (float)ms;
+	distance.resize(n);
+
+	// pass 1: progress and easing for everything at once
+	float* p = progress.data();
+	const float* r = rate.data();
+	const float* a = c1.data();
+	const float* b = c2.data();
+	const float* c = c3.data();
+	const float* len = length.data();
+	float* d = distance.data();
+	for (size_t i = 0; i < n; ++i) {
+		float t = p[i] + r[i] * dt;
+		t = (t < 1.0f) ? t : 1.0f;
+		p[i] = t;
+		d[i] = (a[i] * t + b[i] * t * t + c[i] * t * t * t) * len[i];
+	}
+
+	// pass 2: find the segment and write the position
+	finished.clear();
+	for (size_t i = 0; i < n; ++i) {
+		Uint32 first = pathStart[i];
+		Uint32 last = first + pathCount[i] - 1;
+		Uint32 seg = first + segment[i];
+		while (seg + 1 < last && waypointDistance[seg + 1] < d[i]) ++seg;
+		segment[i] = seg - first;
+
+		SpriteRecord& record = scene.getSprite(spriteIds[i]);
+		if (p[i] >= 1.0f || seg == last) {
+			// snap exactly onto the end so rounding never leaves us a pixel off
+			record.x = waypoints[last].x;
+			record.y = waypoints[last].y;
+			finished.push_back(i);
+			continue;
+		}
+
+		const SDL_Point& from = waypoints[seg];
+		const SDL_Point& to = waypoints[seg + 1];
+		float segLength = waypointDistance[seg + 1] - waypointDistance[seg];
+		float f = (segLength > 0) ? (d[i] - waypointDistance[seg]) / segLength : 1.0f;
+		record.x = (int)std::lround(from.x + (to.x - from.x) * f);
+		record.y = (int)std::lround(from.y + (to.y - from.y) * f);
+	}
+
+	if (finished.empty()) return;
+
+	// pull out the finished motions (back to front, so the swaps don't move any we still need)
+	// and then tell everyone once the arrays are consistent again
+	std::vector< std::pair<TweenID, std::function<void(TweenID)>> > done;
+	done.reserve(finished.size());
+	for (size_t k = finished.size(); k-- > 0;) {
+		size_t i = finished[k];
+		done.emplace_back(ids[i], std::move(callbacks[i]));
+		removeAt(i);
+	}
+	for (auto it = done.rbegin(); it != done.rend(); ++it) {
+		if (it->second) it->second(it->first);
+	}
+
+	compactWaypoints();
+}
+
+void TweenManager::removeAt(size_t i) {
+	size_t last = ids.size() - 1;
+	liveWaypoints -= pathCount[i];
+	if (i != last) {
+		ids[i] = ids[last];
+		spriteIds[i] = spriteIds[last];
+		progress[i] = progress[last];
+		rate[i] = rate[last];
+		c1[i] = c1[last];
+		c2[i] = c2[last];
+		c3[i] = c3[last];
+		length[i] = length[last];
+		pathStart[i] = pathStart[last];
+		pathCount[i] = pathCount[last];
+		segment[i] = segment[last];
+		callbacks[i] = std::move(callbacks[last]);
+	}
+	ids.pop_back();
+	spriteIds.pop_back();
+	progress.pop_back();
+	rate.pop_back();
+	c1.pop_back();
+	c2.pop_back();
+	c3.pop_back();
+	length.pop_back();
+	pathStart.pop_back();
+	pathCount.pop_back();
+	segment.pop_back();
+	callbacks.pop_back();
+}
+
+/// <summary>
+/// Finished paths leave holes in waypoints. Once more than half of it is dead, we copy the live
+/// paths down to the front. This only happens every so often, so it doesn't cost much overall.
+/// </summary>
+void TweenManager::compactWaypoints() {
+	if (liveWaypoints * 2 >= waypoints.size()) return;
+
+	std::vector<SDL_Point> points;
+	std::vector<float> distances;
+	points.reserve(liveWaypoints);
+	distances.reserve(liveWaypoints);
+	for (size_t i = 0; i < ids.size(); ++i) {
+		Uint32 first = pathStart[i];
+		pathStart[i] = (Uint32)points.size();
+		points.insert(points.end(), waypoints.begin() + first, waypoints.begin() + first + pathCount[i]);
+		distances.insert(distances.end(), waypointDistance.begin() + first, waypointDistance.begin() + first + pathCount[i]);
+	}
+	waypoints.swap(points);
+	waypointDistance.swap(distances);
+}
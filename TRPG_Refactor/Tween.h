@@ -0,0 +1,96 @@
+#ifndef TWEEN_H
+#define TWEEN_H
+
+#include <vector>
+#include <functional>
+
+#include <SDL.h>
+
+#include "GraphicsEngine.h"
+
+typedef Uint32 TweenID;
+// what moveAlong hands back when it couldn't start a motion. cancel just ignores it
+#define TWEEN_NO_ID 0xFFFFFFFF
+
+// Easing curves for a whole motion. Each one is a cubic in the motion's
+// progress, so they can all go through the same (branch-free) math.
+enum TweenEasing {
+	TWEEN_LINEAR,
+	TWEEN_EASE_IN,
+	TWEEN_EASE_OUT,
+	TWEEN_EASE_IN_OUT
+};
+
+/// <summary>
+/// TweenManager -- moves Sprites along paths of waypoints over time, instead of calling
+/// Sprite::setXY by hand every frame. All active motions are stored as flat arrays (one
+/// per field) so update can advance every one of them in a single tight loop, which the
+/// compiler is free to vectorize. Positions are written straight into the scene's
+/// Sprite records.
+/// 
+/// A TweenManager works on one scene, and should be updated from the same thread as it.
+/// Cancel a Sprite's motion before destroying the Sprite, or its record might get reused
+/// by some other Sprite that will then start moving around on its own.
+/// </summary>
+class TweenManager {
+
+public:
+	TweenManager(AnimationManager& scene);
+	~TweenManager() = default;
+	// Starts moving sprite through each point of path (in world pixels) at the given
+	// speed. The Sprite starts from wherever it is now. onDone is called once it gets
+	// to the end, from inside update. Returns an id for cancelling the motion, or
+	// TWEEN_NO_ID if sprite belongs to some other scene.
+	TweenID moveAlong(const Sprite& sprite, const std::vector<SDL_Point>& path, float pixelsPerSecond,
+		TweenEasing easing = TWEEN_LINEAR, std::function<void(TweenID)> onDone = nullptr);
+	// stops a motion where it is, without calling its onDone
+	void cancel(TweenID id);
+	// stops every motion on this Sprite
+	void cancelSprite(const Sprite& sprite);
+	// advances every motion by ms milliseconds and moves their Sprites
+	void update(Uint32 ms);
+	size_t getActiveCount() const { return ids.size(); }
+
+private:
+	// removes motion i by swapping the last one into its place
+	void removeAt(size_t i);
+	// throws away waypoints belonging to finished motions once they pile up
+	void compactWaypoints();
+
+	AnimationManager& scene;
+	TweenID nextID;
+
+	// one entry per active motion in each of these
+	std::vector<TweenID> ids;
+	std::vector<Uint32> spriteIds;
+	// how far along the whole path, from 0 to 1
+	std::vector<float> progress;
+	// progress per millisecond
+	std::vector<float> rate;
+	// easing polynomial: eased = c1*t + c2*t^2 + c3*t^3
+	std::vector<float> c1;
+	std::vector<float> c2;
+	std::vector<float> c3;
+	// total path length in pixels
+	std::vector<float> length;
+	// where this motion's points start in waypoints, and how many there are
+	std::vector<Uint32> pathStart;
+	std::vector<Uint32> pathCount;
+	// which segment the motion was on last update; paths only go forward
+	std::vector<Uint32> segment;
+	std::vector< std::function<void(TweenID)> > callbacks;
+
+	// every motion's path, back to back. Each point also stores how far
+	// along its path it is, in pixels.
+	std::vector<SDL_Point> waypoints;
+	std::vector<float> waypointDistance;
+	// how many entries in waypoints still belong to an active motion
+	size_t liveWaypoints;
+
+	// scratch space for update, kept so it doesn't reallocate each tick
+	std::vector<float> distance;
+	std::vector<size_t> finished;
+
+};
+
+#endif